@@ -1,16 +1,47 @@
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
 #include "peglib.h"
+#include "query.h"
+#include "batch.h"
+#include "rule_set.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "static_query.h"
+#include "query_parser.h"
 #include <unordered_map>
 #include <string>
 
 using namespace peg;
+using namespace gwmb;
+
+// Heap allocations made on this thread, for --bench. Counting them replaces
+// the global operator new for the whole binary, so it is only built in with
+// GWMB_COUNT_ALLOCATIONS defined.
+thread_local size_t allocation_count = 0;
+
+#if defined(GWMB_COUNT_ALLOCATIONS)
+constexpr bool counts_allocations = true;
+
+// Kept out of line, with operator delete, or GCC takes the inlined malloc()
+// and free() for a mismatch with the operator they are paired with
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    allocation_count++;
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
 
-struct FileVersion {
-    int hash;
-    int size;
-    int fname0;
-    int fname1;
-};
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#else
+constexpr bool counts_allocations = false;
+#endif
 
 struct TestCase {
     std::string input;
@@ -23,24 +54,22 @@ struct TestCase {
 };
 
 
-bool run_test(parser& p, const std::string& input, int expected, std::unordered_map<std::string, FileVersion>& fileVersions, bool expect_parse_success, bool expect_exception) {
+bool run_test(const parser& p, const std::string& input, int expected, const FileVersionStore& fileVersions, bool expect_parse_success, bool expect_exception) {
     int val = 0;
+    std::any dt = &fileVersions;
 
+    ParseOptions options;
     if (expect_parse_success) {
-        p.set_logger([](size_t line, size_t col, const std::string& msg, const std::string& rule) {
+        options.log = [](size_t line, size_t col, const std::string& msg, const std::string& rule) {
             std::cerr << line << ":" << col << ": " << msg << " in rule: " << rule << "\n";
-            });
-    }
-    else {
-        p.set_logger([](size_t line, size_t col, const std::string& msg, const std::string& rule) {
-            });
+            };
     }
 
     bool success = false;
     bool exception_thrown = false;
     try
     {
-        success = p.parse(input, val);
+        success = p.parse_with(input, dt, val, options);
     }
     catch (const std::exception& e)
     {
@@ -61,49 +90,1436 @@ bool run_test(parser& p, const std::string& input, int expected, std::unordered_
             return false;
         }
     }
-
-    if (val != expected && expect_parse_success) {
-        std::cout << "Test failed for input: " << "\"" << input << "\"" << ". Expected: " << expected << ", Got: " << val << std::endl;
-        return false;
+
+    if (val != expected && expect_parse_success) {
+        std::cout << "Test failed for input: " << "\"" << input << "\"" << ". Expected: " << expected << ", Got: " << val << std::endl;
+        return false;
+    }
+
+    std::cout << "Test passed for input: " << "\"" << input << "\"" << std::endl;
+    return true;
+}
+
+// Runs `evaluate` and reports its value, or the error it throws.
+template <typename Evaluate>
+std::string outcome_of(Evaluate evaluate) {
+    try
+    {
+        return std::to_string(evaluate());
+    }
+    catch (const std::exception& e)
+    {
+        return e.what();
+    }
+}
+
+// The outcome of parsing `input` against `versions`, "parse failed" if it
+// does not match. With `logged`, the messages logged follow the outcome.
+template <typename Parser>
+std::string parse_outcome(const Parser& p, std::string_view input, const FileVersionStore& versions,
+    ParseOptions options = ParseOptions(), bool logged = false) {
+    std::string messages;
+    if (logged) {
+        options.log = [&](size_t line, size_t col, const std::string& msg, const std::string& rule) {
+            messages += std::to_string(line) + ":" + std::to_string(col) + ": " + msg + " in rule: " + rule + "\n";
+            };
+    }
+    auto outcome = outcome_of([&] {
+        int val = 0;
+        std::any dt = &versions;
+        if (!p.parse_with(input, dt, val, options)) {
+            throw std::runtime_error("parse failed");
+        }
+        return val;
+        });
+    return logged ? outcome + "\n" + messages : outcome;
+}
+
+// `actual` must give the outcome `expected` does, both called with an input
+// and the versions to evaluate against: for the test input against every
+// seventh file of `table`, and for each prefix of it against the first.
+template <typename Expected, typename Actual>
+bool compare_on_corpus(const TestCase& test, const FileTable& table, Expected expected, Actual actual, const char* label) {
+    auto compare = [&](std::string_view input, size_t file) {
+        const auto versions = table.versions_of(file);
+        auto want = expected(input, versions);
+        auto got = actual(input, versions);
+        if (got != want) {
+            std::cout << label << " test failed for input: " << "\"" << input << "\"" << " at file " << file
+                << ". Expected: " << want << ", Got: " << got << std::endl;
+            return false;
+        }
+        return true;
+        };
+
+    for (size_t file = 0; file < table.file_count(); file += 7) {
+        if (!compare(test.input, file)) {
+            return false;
+        }
+    }
+    for (size_t len = 0; len < test.input.size(); len++) {
+        if (!compare(std::string_view(test.input.data(), len), 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A rule's boxed values read as ints, for the query semantics
+struct BoxedInts {
+    const SemanticValues& sv;
+
+    size_t size() const { return sv.size(); }
+    int operator[](size_t i) const { return any_cast<int>(sv[i]); }
+};
+
+// The actions of `main` over unboxed int values. FACTOR, PRIMARY and NUMBER
+// pass their only value through, which rules without an action already do.
+void set_typed_actions(typed_parser<int>& parser) {
+    parser["COMPARE_TYPE"] = [](const SemanticValues& sv, TypedValues<int> values, std::any& dt) {
+        const auto& fileVersions = *any_cast<const FileVersionStore*>(dt);
+        return semantics::compare_type(fileVersions, sv.choice(), values[0]);
+        };
+
+    parser["NOT_OP"] = [](const SemanticValues& sv, TypedValues<int> values) {
+        return semantics::not_op(sv.choice(), values[0]);
+        };
+
+    parser["OR_OP"] = [](const SemanticValues&, TypedValues<int> values) {
+        return semantics::logic(OpCode::Or, values);
+        };
+
+    parser["AND_OP"] = [](const SemanticValues&, TypedValues<int> values) {
+        return semantics::logic(OpCode::And, values);
+        };
+
+    parser["EXISTS"] = [](const SemanticValues&, TypedValues<int> values, std::any& dt) {
+        const auto& fileVersions = *any_cast<const FileVersionStore*>(dt);
+        return semantics::exists(fileVersions, values);
+        };
+
+    parser["COMP"] = [](const SemanticValues&, TypedValues<int> values) {
+        return semantics::comp(values);
+        };
+
+    parser["ARITHMETIC"] = [](const SemanticValues&, TypedValues<int> values) {
+        return semantics::chain(add_sub_ops, values);
+        };
+
+    parser["TERM"] = [](const SemanticValues&, TypedValues<int> values) {
+        return semantics::chain(mul_div_ops, values);
+        };
+
+    parser["COMP_OP"] = [](const SemanticValues& sv, TypedValues<int>) {
+        return static_cast<int>(sv.choice());
+        };
+
+    parser["ADD_SUB_OP"] = [](const SemanticValues& sv, TypedValues<int>) {
+        return static_cast<int>(sv.choice());
+        };
+
+    parser["MUL_DIV_OP"] = [](const SemanticValues& sv, TypedValues<int>) {
+        return static_cast<int>(sv.choice());
+        };
+
+    parser["HEX_NUMBER"] = [](const SemanticValues& sv, TypedValues<int>) {
+        return sv.token_to_integer<int>(16);
+        };
+
+    parser["DEC_NUMBER"] = [](const SemanticValues& sv, TypedValues<int>) {
+        return sv.token_to_integer<int>();
+        };
+}
+
+// The typed parser must agree with the boxed one on values and errors.
+bool run_typed_test(const parser& boxed, const typed_parser<int>& typed, const TestCase& test, const FileTable& table) {
+    auto parse = [](const auto& p) {
+        return [&p](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions);
+            };
+        };
+    return compare_on_corpus(test, table, parse(boxed), parse(typed), "Typed parser");
+}
+
+// The query semantics as hooks of the parser generated from the grammar
+struct QueryActions {
+    using Match = QueryParserMatch;
+    using Values = std::span<const int>;
+
+    const FileVersionStore* fileVersions;
+
+    static int number(const Match& m, int base) {
+        int n = 0;
+        if (token_to_integer_(m.token(), n, base) < 0) {
+            throw integer_out_of_range(m.line_info(), m.token());
+        }
+        return n;
+    }
+
+    int COMPARE_TYPE(const Match& m, Values values) const {
+        return semantics::compare_type(*fileVersions, m.choice, values[0]);
+    }
+
+    int NOT_OP(const Match& m, Values values) const { return semantics::not_op(m.choice, values[0]); }
+    int OR_OP(const Match&, Values values) const { return semantics::logic(OpCode::Or, values); }
+    int AND_OP(const Match&, Values values) const { return semantics::logic(OpCode::And, values); }
+    int EXISTS(const Match&, Values values) const { return semantics::exists(*fileVersions, values); }
+    int COMP(const Match&, Values values) const { return semantics::comp(values); }
+    int ARITHMETIC(const Match&, Values values) const { return semantics::chain(add_sub_ops, values); }
+    int TERM(const Match&, Values values) const { return semantics::chain(mul_div_ops, values); }
+
+    int COMP_OP(const Match& m, Values) const { return static_cast<int>(m.choice); }
+    int ADD_SUB_OP(const Match& m, Values) const { return static_cast<int>(m.choice); }
+    int MUL_DIV_OP(const Match& m, Values) const { return static_cast<int>(m.choice); }
+    int HEX_NUMBER(const Match& m, Values) const { return number(m, 16); }
+    int DEC_NUMBER(const Match& m, Values) const { return number(m, 10); }
+};
+
+using GeneratedQueryParser = QueryParser<int, QueryActions>;
+
+// The generated parser must agree with the typed one on values and errors.
+bool run_generated_test(const typed_parser<int>& typed, GeneratedQueryParser& generated, const TestCase& test, const FileTable& table) {
+    return compare_on_corpus(test, table,
+        [&](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(typed, input, versions);
+        },
+        [&](std::string_view input, const FileVersionStore& versions) {
+            return outcome_of([&] {
+                int val = 0;
+                QueryActions actions{ &versions };
+                if (!generated.parse(input, actions, val)) {
+                    throw std::runtime_error("parse failed");
+                }
+                return val;
+                });
+        },
+        "Generated parser");
+}
+
+// The precedence-climbing grammar must give the cascade's outcome, including
+// on every prefix, which fails part way through an operator chain
+bool run_precedence_test(const parser& cascade, const parser& precedence, const TestCase& test, const FileTable& table) {
+    auto parse = [](const parser& p) {
+        return [&p](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions);
+            };
+        };
+    return compare_on_corpus(test, table, parse(cascade), parse(precedence), "Precedence climbing");
+}
+
+// A table operator matches in any case only when the operator rule does
+bool run_precedence_case_test() {
+    for (auto [op, accepted] : { std::pair("'and'i", true), std::pair("'and' / 'AND'", false) }) {
+        peg::parser p((R"(
+            EXPR        <- ATOM (OP ATOM)* {
+                             precedence
+                               L and
+                               L +
+                           }
+            ATOM        <- < [0-9]+ >
+            OP          <- < '+' / )" + std::string(op) + R"( >
+            %whitespace <- [ \t]*
+        )").c_str());
+        if (p.parse("1 and 2 + 3") != true || p.parse("1 AND 2 + 3") != accepted) {
+            std::cout << "Precedence case test failed for operators: " << op << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Inlined rules and leading literal checks must not change a parse: not its
+// outcome, nor with errors tracked the messages
+bool run_optimization_test(const parser& optimized, const parser& plain, const TestCase& test, const FileTable& table) {
+    auto parse = [](const parser& p) {
+        return [&p](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions) + "\n" +
+                parse_outcome(p, input, versions, ParseOptions(), true);
+            };
+        };
+    return compare_on_corpus(test, table, parse(plain), parse(optimized), "Grammar optimization");
+}
+
+// Boxed, typed and compiled queries must agree on number literals, including
+// the error for one that does not fit in an int.
+bool run_number_test(const parser& boxed, const typed_parser<int>& typed, const QueryCompiler& compiler, const TestCase& test, const FileVersionStore& fileVersions) {
+    if (!run_test(boxed, test.input, test.expected, fileVersions, test.expect_parse_success, test.expect_exception)) {
+        return false;
+    }
+
+    ParseOptions quiet;
+    auto parse = [&](const auto& p) {
+        return outcome_of([&] {
+            int val = 0;
+            std::any dt = &fileVersions;
+            if (!p.parse_with(test.input, dt, val, quiet)) {
+                throw std::runtime_error("parse failed");
+            }
+            return val;
+            });
+        };
+    auto expected = parse(boxed);
+    if (test.expect_exception && expected.find("out of range") == std::string::npos) {
+        std::cout << "Number test failed for input: " << "\"" << test.input << "\""
+            << ". Expected an out of range error, Got: " << expected << std::endl;
+        return false;
+    }
+    auto compiled = outcome_of([&] {
+        CompiledQuery query;
+        if (!compiler.compile(test.input, query)) {
+            throw std::runtime_error("parse failed");
+        }
+        return query.evaluate(fileVersions);
+        });
+    for (const auto& actual : { parse(typed), compiled }) {
+        if (actual != expected) {
+            std::cout << "Number test failed for input: " << "\"" << test.input << "\""
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compares an optimized shared AST with an optimized arena AST node by node.
+bool same_ast(const Ast& expected, const ArenaAst& ast, AstId id) {
+    const auto& node = ast[id];
+    if (expected.name != ast.name(id) || expected.original_name != ast.original_name(id) ||
+        expected.is_token != node.is_token || expected.nodes.size() != ast.nodes(id).size()) {
+        return false;
+    }
+    if (expected.is_token && expected.token != ast.token(id)) {
+        return false;
+    }
+    for (size_t i = 0; i < expected.nodes.size(); i++) {
+        if (!same_ast(*expected.nodes[i], ast, ast.nodes(id)[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The arena AST must match the enable_ast() tree before and after optimization.
+bool run_arena_ast_test(const parser& shared, const arena_ast_parser& arena, const TestCase& test) {
+    std::shared_ptr<Ast> expected;
+    ArenaAst ast;
+    ParseOptions quiet;
+    bool expected_ok = shared.parse_with(test.input, expected, quiet);
+    bool actual_ok = arena.parse_with(test.input, ast, quiet);
+    if (expected_ok != actual_ok) {
+        std::cout << "Arena AST test failed for input: " << "\"" << test.input << "\"" << ". Expected parse "
+            << (expected_ok ? "success" : "failure") << std::endl;
+        return false;
+    }
+    if (!expected_ok) {
+        return true;
+    }
+    if (ast_to_s(expected) != ast_to_s(ast)) {
+        std::cout << "Arena AST test failed for input: " << "\"" << test.input << "\"" << ". Expected:\n"
+            << ast_to_s(expected) << "Got:\n" << ast_to_s(ast);
+        return false;
+    }
+    expected = shared.optimize_ast(expected);
+    arena.optimize_ast(ast);
+    if (!same_ast(*expected, ast, ast.root())) {
+        std::cout << "Arena AST test failed for input: " << "\"" << test.input << "\"" << " after optimization. Expected:\n"
+            << ast_to_s(expected) << "Got:\n" << ast_to_s(ast);
+        return false;
+    }
+    return true;
+}
+
+// The memo table against std::unordered_map: keys that share a slot of the
+// initial 64-slot table, overwritten keys, growth and reuse after clear().
+bool run_packrat_memo_table_test() {
+    std::vector<size_t> keys;
+    for (size_t key = 0; keys.size() < 12; key++) {
+        if (((key * 0x9E3779B97F4A7C15ull) >> 58) == 5) { keys.push_back(key); }
+    }
+    for (size_t key = 0; key < 3000; key += 7) { keys.push_back(key); }
+
+    PackratMemo memo;
+    for (int round = 0; round < 2; round++) {
+        std::unordered_map<size_t, size_t> expected;
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto len = i % 5 == 4 ? static_cast<size_t>(-1) : i + round;
+            memo.insert(keys[i], len, std::any(static_cast<int>(len)));
+            expected[keys[i]] = len;
+            if (i % 3 == 0) {
+                memo.insert(keys[i], len + 1, std::any(static_cast<int>(len + 1)));
+                expected[keys[i]] = len + 1;
+            }
+        }
+        if (memo.size() != expected.size()) {
+            std::cout << "Packrat memo test failed: " << memo.size() << " entries, expected " << expected.size() << std::endl;
+            return false;
+        }
+        for (size_t key = 0; key < 3100; key++) {
+            auto entry = memo.find(key);
+            auto it = expected.find(key);
+            auto found = entry != nullptr;
+            if (found != (it != expected.end()) ||
+                (found && (entry->len != it->second || std::any_cast<int>(entry->val) != static_cast<int>(it->second)))) {
+                std::cout << "Packrat memo test failed for key " << key << std::endl;
+                return false;
+            }
+        }
+        memo.clear();
+        auto left = std::count_if(keys.begin(), keys.end(), [&](size_t key) { return memo.find(key) != nullptr; });
+        if (memo.size() != 0 || left != 0) {
+            std::cout << "Packrat memo test failed: " << left << " entries left after clear()" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A parse with every rule memoized must give the values and errors of one
+// without memoization, on the test input and every prefix of it.
+bool run_packrat_test(const parser& memoized, const parser& unmemoized, const TestCase& test, const FileVersionStore& fileVersions) {
+    for (size_t len = 0; len <= test.input.size(); len++) {
+        std::string_view input(test.input.data(), len);
+        auto parse = [&](const peg::parser& p) {
+            return outcome_of([&] {
+                int val = 0;
+                std::any dt = &fileVersions;
+                if (!p.parse_with(input, dt, val, ParseOptions())) {
+                    throw std::runtime_error("parse failed");
+                }
+                return val;
+                });
+            };
+        auto expected = parse(unmemoized);
+        auto actual = parse(memoized);
+        if (actual != expected) {
+            std::cout << "Packrat test failed for input: " << "\"" << input << "\""
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Under PackratMode::Selected only the rule annotated `{ memoize }` uses the
+// memo table; with PackratMode::All the others are counted as well.
+bool run_memoize_annotation_test() {
+    peg::parser p(R"(
+        LIST        <- ITEM (',' ITEM)*
+        ITEM        <- PAIR / NAME
+        PAIR        <- NAME '=' NAME
+        NAME        <- < [a-z]+ > { memoize }
+        %whitespace <- [ \t]*
+    )");
+    for (auto mode : { PackratMode::Selected, PackratMode::All }) {
+        p.enable_packrat_parsing(mode);
+        PackratStats stats;
+        ParseOptions options;
+        options.packrat_stats = &stats;
+        std::any dt;
+        std::string counted;
+        if (p.parse_with("a, b = c, d", dt, options)) {
+            for (const auto& [name, rule_stats] : p.packrat_report(stats)) {
+                counted += name + (name == "NAME" && rule_stats.hits ? "+" : "") + " ";
+            }
+        }
+        auto expected = mode == PackratMode::Selected ? "NAME+ " : "ITEM LIST NAME+ PAIR ";
+        if (counted != expected) {
+            std::cout << "Memoize annotation test failed. Expected: " << expected << ", Got: " << counted << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Skipping alternatives by their first byte, which happens only while no
+// error positions are tracked, must not change any outcome. Checked on the
+// input and on each of its prefixes.
+bool run_dispatch_test(const parser& p, const TestCase& test, const FileTable& table) {
+    ParseOptions tracked;
+    tracked.log = [](size_t, size_t, const std::string&, const std::string&) {};
+    return compare_on_corpus(test, table,
+        [&](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions, tracked);
+        },
+        [&](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions);
+        },
+        "Dispatch");
+}
+
+// A parse that only tracks errors once it has failed must report the same
+// messages, and throw the same parse_error, as one that tracks them throughout.
+bool run_lazy_error_test(const parser& p, const TestCase& test, const FileTable& table) {
+    auto parse = [&](bool lazy) {
+        return [&p, lazy](std::string_view input, const FileVersionStore& versions) {
+            std::string outcomes;
+            for (auto error_mode : { ErrorMode::Log, ErrorMode::Throw }) {
+                ParseOptions options;
+                options.error_mode = error_mode;
+                options.lazy_errors = lazy;
+                outcomes += parse_outcome(p, input, versions, options, true);
+            }
+            return outcomes;
+            };
+        };
+    return compare_on_corpus(test, table, parse(false), parse(true), "Lazy error");
+}
+
+// A grammar restored from an image must give the same values and messages as
+// the one it was saved from.
+bool run_image_test(const parser& loaded, const parser& restored, const TestCase& test, const FileTable& table) {
+    auto parse = [](const parser& p) {
+        return [&p](std::string_view input, const FileVersionStore& versions) {
+            return parse_outcome(p, input, versions, ParseOptions(), true);
+            };
+        };
+    return compare_on_corpus(test, table, parse(loaded), parse(restored), "Grammar image");
+}
+
+// Images of a grammar with the operators the query grammar does not use:
+// precedence climbing, dictionaries, macros, cut, labels with recovery,
+// error messages and a word rule. Compares syntax trees and messages.
+bool run_image_feature_test() {
+    const char* source = R"(
+        START       <- STATEMENT (';' STATEMENT)*
+        STATEMENT   <- KEYWORD / EXPR
+        EXPR        <- ATOM (OP ATOM)* {
+                         precedence
+                           L + -
+                           L * / mod
+                       }
+        ATOM        <- NUMBER / '(' ↑ EXPR ')'
+        OP          <- < [-+*/] / 'mod'i >
+        NUMBER      <- < [0-9]+ > { error_message "a number is expected" }
+        KEYWORD     <- ('kw' / 'key'i | 'keyword'i) ('alphabet' | 'alpha' | 'beta') LIST(NUMBER, ',')^missing
+        LIST(I, D)  <- I (D I)*
+        missing     <- (!';' .)*
+        %whitespace <- [ \t]*
+        %word       <- [a-z]+
+    )";
+    peg::parser loaded(source);
+    std::string image;
+    peg::parser restored;
+    if (!loaded.save_grammar_image(image) || !restored.load_grammar_image(source, image)) {
+        std::cout << "Grammar image feature test failed to save or restore" << std::endl;
+        return false;
+    }
+    loaded.enable_ast();
+    restored.enable_ast();
+    for (std::string input : { "1+2*3;kw alpha 1,2", "(1+2", "(1+2)*4-5/6", "kw beta", "kw gamma 1",
+        "kw alphabet 3, 4,5;2/2", "7 MOD 2+1", "kw alphabeta 1", "KeyWord beta 1", "KEY alpha 2;keys beta", "1 + ", "" }) {
+        auto parse = [&](const peg::parser& p) {
+            std::string result;
+            ParseOptions options;
+            options.log = [&](size_t line, size_t col, const std::string& msg, const std::string& rule) {
+                result += std::to_string(line) + ":" + std::to_string(col) + ": " + msg + " in rule: " + rule + "\n";
+                };
+            std::shared_ptr<Ast> ast;
+            if (p.parse_with(input, ast, options)) {
+                result += ast_to_s(p.optimize_ast(ast));
+            }
+            return result;
+            };
+        auto expected = parse(loaded);
+        auto actual = parse(restored);
+        if (actual != expected) {
+            std::cout << "Grammar image feature test failed for input: " << "\"" << input << "\""
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A class's vectorized span scan must stop exactly where a byte-by-byte scan
+// of its members would, across block boundaries and at non-ASCII bytes.
+bool run_span_tests() {
+    std::vector<CharacterClass> classes = {
+        { " \t", false, false },
+        { "0-9", false, false },
+        { "a-fA-F0-9", false, false },
+        { "a-f", false, true },
+        { "a-z", true, false },
+        { "a-bd-eg-hj-kx", false, false },
+    };
+    const std::string others = " \t09afAFgz_\xc3\xa9";
+    uint32_t seed = 12345;
+    auto next = [&] {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    for (const auto& cls : classes) {
+        std::string members;
+        for (char32_t ch = 0; ch < 0x80; ch++) {
+            if (cls.contains(ch)) { members += static_cast<char>(ch); }
+        }
+        for (int round = 0; round < 2000; round++) {
+            // Mostly members, so spans often cross 16- and 32-byte blocks
+            std::string text(next() % 100, ' ');
+            for (auto& ch : text) {
+                ch = next() % 16 ? members[next() % members.size()] : others[next() % others.size()];
+            }
+            size_t expected = 0;
+            while (expected < text.size() && static_cast<unsigned char>(text[expected]) < 0x80 &&
+                cls.contains(static_cast<unsigned char>(text[expected]))) {
+                expected++;
+            }
+            auto actual = cls.scan_span(text.data(), text.size());
+            if (actual != expected) {
+                std::cout << "Span test failed for \"" << text << "\". Expected: " << expected << ", Got: " << actual << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A dictionary must match the longest of its words that the input starts
+// with, as trying each word would, with and without case, and a dictionary
+// rule must parse like the choice of its words.
+bool run_dictionary_tests() {
+    uint32_t seed = 54321;
+    auto next = [&] {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    auto longest = [](const std::vector<std::string>& words, const std::string& text, bool ignore_case) {
+        size_t len = 0;
+        for (const auto& word : words) {
+            if (word.size() <= text.size() && word.size() > len &&
+                std::equal(word.begin(), word.end(), text.begin(), [&](char a, char b) {
+                    return ignore_case ? std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b)) : a == b;
+                    })) {
+                len = word.size();
+            }
+        }
+        return len;
+        };
+
+    std::vector<std::vector<std::string>> vocabularies = {
+        { "hash", "size", "fname0", "fname1", "fname", "exists", "and", "or", "not" },
+        { "", "a", "ab", "abc", "AB", "b" },
+    };
+    // Random words over a few bytes, including NUL and bytes above 0x7f
+    const std::string bytes("aAbB\0\x7f\x80\xff", 8);
+    for (int i = 0; i < 50; i++) {
+        std::vector<std::string> words(next() % 30);
+        for (auto& word : words) {
+            word.resize(next() % 5 + 1);
+            for (auto& ch : word) { ch = bytes[next() % bytes.size()]; }
+        }
+        vocabularies.push_back(words);
+    }
+    for (const auto& words : vocabularies) {
+        std::string others = bytes;
+        for (const auto& word : words) { others += word; }
+        for (auto ignore_case : { false, true }) {
+            Trie trie(words, ignore_case);
+            for (int round = 0; round < 200; round++) {
+                std::string text(next() % 10, ' ');
+                for (auto& ch : text) { ch = others[next() % others.size()]; }
+                if (!words.empty() && next() % 2) {
+                    text = words[next() % words.size()] + text;
+                }
+                auto expected = longest(words, text, ignore_case);
+                auto actual = trie.match(text.data(), text.size());
+                if (actual != expected) {
+                    std::cout << "Dictionary test failed for \"" << text << "\". Expected: " << expected << ", Got: " << actual << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+
+    peg::parser dictionary(R"(
+        WORDS       <- WORD*
+        WORD        <- 'hash'i | 'size'i | 'fname0'i | 'fname1'i | 'fname'i | 'exists'i | 'and'i | 'or'i | 'not'i
+        %whitespace <- [ \t]*
+        %word       <- [a-zA-Z0-9]+
+    )");
+    peg::parser choice(R"(
+        WORDS       <- WORD*
+        WORD        <- 'fname0'i / 'fname1'i / 'exists'i / 'fname'i / 'hash'i / 'size'i / 'and'i / 'not'i / 'or'i
+        %whitespace <- [ \t]*
+        %word       <- [a-zA-Z0-9]+
+    )");
+    for (std::string input : { "hash SIZE fname0 Fname1 fname exists AND or Not", "fname2", "hashsize",
+        "ors", "EXISTS exist", "fName1 fname10", "" }) {
+        auto parse = [&](peg::parser& p) {
+            std::string matched;
+            p["WORD"] = [&](const SemanticValues& vs) { matched += std::string(vs.sv()) + ","; };
+            return p.parse(input) ? matched : "failed";
+            };
+        auto expected = parse(choice);
+        auto actual = parse(dictionary);
+        if (actual != expected) {
+            std::cout << "Dictionary test failed for input: \"" << input << "\". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The instruction program must accept exactly what the tree-walking parser
+// accepts, checked on the input and on each of its prefixes.
+bool run_program_test(const parser& recognizer, const PegProgram& program, const TestCase& test) {
+    ParseOptions quiet;
+    for (size_t len = 0; len <= test.input.size(); len++) {
+        std::string_view input(test.input.data(), len);
+        std::any dt;
+        bool expected = recognizer.parse_with(input, dt, quiet);
+        if (program.match(input) != expected) {
+            std::cout << "Program test failed for input: " << "\"" << input << "\"" << ". Expected "
+                << (expected ? "a match" : "no match") << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// One parser evaluates the same text against different files: the versions
+// travel with each parse call instead of being captured by the actions.
+bool run_dataset_test(parser& p, const QueryCompiler& compiler, const TestCase& test, const FileTable& table) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        return true;
+    }
+
+    for (size_t file = 0; file < table.file_count(); file += 7) {
+        const auto versions = table.versions_of(file);
+        auto expected = outcome_of([&] { return query.evaluate(versions); });
+        auto actual = outcome_of([&] {
+            int val = 0;
+            std::any dt = &versions;
+            if (!p.parse(test.input, dt, val)) {
+                throw std::runtime_error("parse failed");
+            }
+            return val;
+            });
+        if (actual != expected) {
+            std::cout << "Dataset test failed for input: " << "\"" << test.input << "\"" << " at file " << file
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the whole corpus from many threads at once on one shared parser. Each
+// thread evaluates against its own file, logs into its own counter and, on odd
+// threads, asks for parse errors as exceptions.
+bool run_concurrent_tests(const parser& p, const QueryCompiler& compiler, const std::vector<TestCase>& test_cases, const FileTable& table, size_t thread_count, int rounds) {
+    std::atomic<size_t> failures{ 0 };
+    std::mutex output_mutex;
+
+    auto worker = [&](size_t thread_index) {
+        const auto versions = table.versions_of(thread_index % table.file_count());
+        auto error_mode = thread_index % 2 ? ErrorMode::Throw : ErrorMode::Log;
+
+        for (int round = 0; round < rounds; round++) {
+            for (const auto& test : test_cases) {
+                CompiledQuery query;
+                auto compiled = compiler.compile(test.input, query);
+                auto expected = compiled ? outcome_of([&] { return query.evaluate(versions); }) : "parse failed";
+
+                size_t logged = 0;
+                ParseOptions options;
+                options.error_mode = error_mode;
+                options.log = [&](size_t, size_t, const std::string&, const std::string&) {
+                    logged++;
+                    };
+
+                std::string actual;
+                try
+                {
+                    int val = 0;
+                    std::any dt = &versions;
+                    actual = p.parse_with(test.input, dt, val, options) ? std::to_string(val) : "parse failed";
+                    if (actual == "parse failed" && error_mode == ErrorMode::Throw) {
+                        actual = "no parse_error thrown";
+                    }
+                }
+                catch (const parse_error&)
+                {
+                    actual = error_mode == ErrorMode::Throw ? "parse failed" : "unexpected parse_error";
+                }
+                catch (const std::exception& e)
+                {
+                    actual = e.what();
+                }
+
+                bool logged_as_expected = (logged != 0) == (actual == "parse failed");
+                if (actual != expected || !logged_as_expected) {
+                    if (failures++ < 10) {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cout << "Concurrent test failed for input: " << "\"" << test.input << "\"" << " on thread " << thread_index
+                            << ". Expected: " << expected << ", Got: " << actual << ", logged " << logged << " messages" << std::endl;
+                    }
+                }
+            }
+        }
+        };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return failures == 0;
+}
+
+// A parse that only succeeds through recovery still fails: it logs what
+// was recovered from, and in ErrorMode::Throw throws the first of it.
+bool run_recovered_error_mode_test() {
+    peg::parser p(R"(
+        START       <- STMT+
+        STMT        <- 'a' ';'^semi
+        semi        <- (!';' .)* ';'
+        %whitespace <- [ \t]*
+    )");
+    for (auto error_mode : { ErrorMode::Log, ErrorMode::Throw }) {
+        std::string logged, thrown;
+        ParseOptions options;
+        options.error_mode = error_mode;
+        options.log = [&](size_t line, size_t col, const std::string& msg, const std::string&) {
+            logged += std::to_string(line) + ":" + std::to_string(col) + ": " + msg + "\n";
+            };
+        std::any dt;
+        bool ret = false;
+        try
+        {
+            ret = p.parse_with("a; a x; a;", dt, options);
+        }
+        catch (const parse_error& e)
+        {
+            thrown = e.what();
+        }
+        auto expected_thrown = error_mode == ErrorMode::Throw ? logged.substr(0, logged.find('\n')) : "";
+        if (ret || logged.rfind("1:6: ", 0) != 0 || thrown != expected_thrown) {
+            std::cout << "Recovered error mode test failed. Logged: " << logged << "Thrown: " << thrown << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Once this thread's pool is warm, every parse leases one context and
+// creates none, including parses that throw and a parse started from an
+// action, which leases a second one.
+bool run_context_pool_test(const parser& p, const std::vector<TestCase>& test_cases, const FileVersionStore& fileVersions) {
+    peg::parser outer("LIST <- NAME (',' NAME)*\nNAME <- < [a-z]+ >\n%whitespace <- [ \\t]*");
+    peg::parser inner("WORD <- [a-z]+");
+    outer["NAME"] = [&](const SemanticValues& vs) { return inner.parse(vs.token()); };
+
+    for (int round = 0; round < 2; round++) {
+        auto before = ContextPool::stats();
+        for (const auto& test : test_cases) {
+            int val = 0;
+            std::any dt = &fileVersions;
+            try
+            {
+                p.parse_with(test.input, dt, val, ParseOptions());
+            }
+            catch (const std::exception&)
+            {
+            }
+        }
+        outer.parse("ab, cd, ef");
+        auto after = ContextPool::stats();
+        auto acquired = after.acquired - before.acquired;
+        auto created = after.created - before.created;
+        // The first round may still fill the pool
+        if (round == 1 && (created != 0 || acquired != test_cases.size() + 4)) {
+            std::cout << "Context pool test failed: " << acquired << " contexts leased, " << created << " created" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_compiled_test(const QueryCompiler& compiler, const TestCase& test, const FileVersionStore& fileVersions) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        if (test.expect_parse_success) {
+            std::cout << "Unexpected compile failure. Compiled test failed for input: " << "\"" << test.input << "\"" << std::endl;
+            return false;
+        }
+        // The query is left empty, and an empty query matches nothing
+        if (!query.empty() || query.evaluate(fileVersions) != 0 || query.evaluate_short_circuit(fileVersions) != 0) {
+            std::cout << "Failed compile left a query that matches. Compiled test failed for input: " << "\"" << test.input << "\"" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (!test.expect_parse_success) {
+        std::cout << "Unexpected compile success. Compiled test failed for input: " << "\"" << test.input << "\"" << std::endl;
+        return false;
+    }
+
+    int val = 0;
+    try
+    {
+        val = query.evaluate(fileVersions);
+    }
+    catch (const std::exception& e)
+    {
+        if (!test.expect_exception) {
+            std::cout << "Unexpected evaluation failure. Compiled test failed for input: " << "\"" << test.input << "\"" << " with error: " << e.what() << std::endl;
+        }
+        return test.expect_exception;
+    }
+
+    if (test.expect_exception || val != test.expected) {
+        std::cout << "Compiled test failed for input: " << "\"" << test.input << "\"" << ". Expected: " << test.expected << ", Got: " << val << std::endl;
+        return false;
+    }
+
+    // Whatever evaluates without error must not change under short-circuiting
+    int short_circuit_val = 0;
+    try
+    {
+        short_circuit_val = query.evaluate_short_circuit(fileVersions);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Unexpected short-circuit failure. Compiled test failed for input: " << "\"" << test.input << "\"" << " with error: " << e.what() << std::endl;
+        return false;
+    }
+
+    if (short_circuit_val != val) {
+        std::cout << "Short-circuit test failed for input: " << "\"" << test.input << "\"" << ". Expected: " << val << ", Got: " << short_circuit_val << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool run_short_circuit_test(const QueryCompiler& compiler, const TestCase& test, const FileVersionStore& fileVersions) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        std::cout << "Unexpected compile failure. Short-circuit test failed for input: " << "\"" << test.input << "\"" << std::endl;
+        return false;
+    }
+
+    int val = 0;
+    try
+    {
+        val = query.evaluate_short_circuit(fileVersions);
+    }
+    catch (const std::exception& e)
+    {
+        if (!test.expect_exception) {
+            std::cout << "Unexpected evaluation failure. Short-circuit test failed for input: " << "\"" << test.input << "\"" << " with error: " << e.what() << std::endl;
+        }
+        return test.expect_exception;
+    }
+
+    if (test.expect_exception || val != test.expected) {
+        std::cout << "Short-circuit test failed for input: " << "\"" << test.input << "\"" << ". Expected: " << test.expected << ", Got: " << val << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Builds a table whose first file holds `fileVersions` and whose remaining
+// files get pseudo-random versions, some of them missing or zero sized.
+FileTable make_test_table(const FileVersionStore& fileVersions, size_t file_count) {
+    FileTable table(file_count);
+    for (size_t slot = 0; slot < fileVersions.slot_count(); slot++) {
+        if (fileVersions.contains(static_cast<int>(slot))) {
+            table.set(0, static_cast<int>(slot), fileVersions.get(static_cast<int>(slot)));
+        }
+    }
+
+    uint32_t seed = 12345;
+    auto next = [&seed](uint32_t bound) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) % bound);
+        };
+
+    for (size_t file = 1; file < file_count; file++) {
+        for (int slot = 0; slot < 4; slot++) {
+            if (next(4) == 0) {
+                continue;
+            }
+            table.set(file, slot, FileVersion{ next(4), next(3) * 100, 900 + next(40), 980 + next(4) });
+        }
+    }
+    return table;
+}
+
+bool run_batch_test(const QueryCompiler& compiler, const TestCase& test, const FileTable& table, SimdLevel level) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        return true;
+    }
+
+    auto result = evaluate_batch(query, table, level);
+    for (size_t file = 0; file < table.file_count(); file++) {
+        bool expected_match = false;
+        bool expected_error = false;
+        try
+        {
+            expected_match = query.evaluate(table.versions_of(file)) != 0;
+        }
+        catch (const std::exception&)
+        {
+            expected_error = true;
+        }
+
+        bool match = (result.matches[file / 64] >> (file % 64)) & 1;
+        bool error = (result.errors[file / 64] >> (file % 64)) & 1;
+        if (match != expected_match || error != expected_error) {
+            std::cout << "Batch test failed for input: " << "\"" << test.input << "\"" << " at file " << file
+                << (level == SimdLevel::Avx2 ? " (avx2)" : " (scalar)") << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_bytecode_test(const QueryCompiler& compiler, const TestCase& test, const FileTable& table) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        return true;
+    }
+
+    BytecodeProgram program(query);
+    for (size_t file = 0; file < table.file_count(); file++) {
+        auto versions = table.versions_of(file);
+        auto expected = outcome_of([&] { return query.evaluate_short_circuit(versions); });
+        auto actual = outcome_of([&] { return program.evaluate(versions); });
+        if (actual != expected) {
+            std::cout << "Bytecode test failed for input: " << "\"" << test.input << "\"" << " at file " << file
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_jit_test(const QueryCompiler& compiler, const TestCase& test, const FileTable& table) {
+    CompiledQuery query;
+    if (!compiler.compile(test.input, query)) {
+        return true;
+    }
+
+    JitQuery jit(query);
+    if (jit_supported() && !jit.native()) {
+        std::cout << "JIT test failed for input: " << "\"" << test.input << "\"" << ". No native code was generated" << std::endl;
+        return false;
+    }
+
+    for (size_t file = 0; file < table.file_count(); file++) {
+        auto versions = table.versions_of(file);
+        auto expected = outcome_of([&] { return query.evaluate(versions); });
+        auto actual = outcome_of([&] { return jit.evaluate(versions); });
+        if (actual != expected) {
+            std::cout << "JIT test failed for input: " << "\"" << test.input << "\"" << " at file " << file
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(std::is_same_v<StaticQuery<"size0 > 100">::expression,
+    expr::Binary<OpCode::Greater, expr::Field<OpCode::Size, 0>, expr::Constant<100>>>);
+
+// A query parsed at compile time must agree with the same text compiled at
+// run time on every file.
+template <fixed_string Text>
+bool run_static_test(const QueryCompiler& compiler, const FileTable& table) {
+    CompiledQuery query;
+    if (!compiler.compile(Text.view(), query)) {
+        std::cout << "Static test failed for input: " << "\"" << Text.view() << "\"" << ". It does not compile at run time" << std::endl;
+        return false;
+    }
+
+    for (size_t file = 0; file < table.file_count(); file++) {
+        auto versions = table.versions_of(file);
+        auto expected = outcome_of([&] { return query.evaluate(versions); });
+        auto actual = outcome_of([&] { return StaticQuery<Text>::evaluate(versions); });
+        if (actual != expected) {
+            std::cout << "Static test failed for input: " << "\"" << Text.view() << "\"" << " at file " << file
+                << ". Expected: " << expected << ", Got: " << actual << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+template <fixed_string... Texts>
+bool run_static_tests(const QueryCompiler& compiler, const FileTable& table) {
+    return (run_static_test<Texts>(compiler, table) & ...);
+}
+
+// Parses every test input once with all rules memoized, counting memo hits
+// and misses per rule into `stats`.
+template <typename Parser>
+void profile_packrat(Parser& parser, const std::vector<TestCase>& test_cases, const FileVersionStore& fileVersions, PackratStats& stats) {
+    parser.enable_packrat_parsing(PackratMode::All);
+
+    ParseOptions options;
+    options.packrat_stats = &stats;
+    for (const auto& test : test_cases) {
+        int val = 0;
+        std::any dt = &fileVersions;
+        try
+        {
+            parser.parse_with(test.input, dt, val, options);
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+}
+
+// Average nanoseconds per call of `evaluate(versions)` over `rows`.
+template <typename Evaluate>
+double time_per_evaluation(const std::vector<FileVersionStore>& rows, Evaluate evaluate) {
+    const int rounds = 200;
+    int sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (const auto& versions : rows) {
+            sink += evaluate(versions);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    volatile int keep = sink;
+    (void)keep;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (double(rounds) * rows.size());
+}
+
+void run_benchmarks(parser& parser, const typed_parser<int>& typed, const peg::parser& shared_ast, const arena_ast_parser& arena_ast, const peg::parser& recognizer, const peg::parser& precedence, const PegProgram& program, const QueryCompiler& compiler, const std::vector<TestCase>& test_cases, const FileTable& table, const PackratStats& packrat_stats) {
+    std::vector<FileVersionStore> rows;
+    for (size_t file = 0; file < 256 && file < table.file_count(); file++) {
+        rows.push_back(table.versions_of(file));
+    }
+
+    // Only queries that evaluate without error on every row
+    std::vector<std::pair<std::string, CompiledQuery>> queries;
+    for (const auto& test : test_cases) {
+        CompiledQuery query;
+        if (!test.expect_parse_success || test.expect_exception || !compiler.compile(test.input, query)) {
+            continue;
+        }
+        bool clean = true;
+        for (const auto& versions : rows) {
+            try
+            {
+                query.evaluate(versions);
+            }
+            catch (const std::exception&)
+            {
+                clean = false;
+                break;
+            }
+        }
+        if (clean) {
+            queries.emplace_back(test.input, std::move(query));
+        }
+    }
+
+    auto time_parse = [&](const auto& p, const std::string& input) {
+        auto start = std::chrono::steady_clock::now();
+        const int parses = 200;
+        for (int i = 0; i < parses; i++) {
+            int val = 0;
+            std::any dt = static_cast<const FileVersionStore*>(&rows[i % rows.size()]);
+            p.parse(input, dt, val);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / parses;
+        };
+
+    ParseOptions quiet;
+    ParseOptions lazy;
+    lazy.log = [](size_t, size_t, const std::string&, const std::string&) {};
+    lazy.lazy_errors = true;
+    auto time_parse_with = [&](const auto& p, const std::string& input, const ParseOptions& options) {
+        auto start = std::chrono::steady_clock::now();
+        const int parses = 200;
+        for (int i = 0; i < parses; i++) {
+            int val = 0;
+            std::any dt = static_cast<const FileVersionStore*>(&rows[i % rows.size()]);
+            p.parse_with(input, dt, val, options);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / parses;
+        };
+
+    GeneratedQueryParser generated;
+    auto time_generated = [&](const std::string& input) {
+        auto start = std::chrono::steady_clock::now();
+        const int parses = 200;
+        for (int i = 0; i < parses; i++) {
+            int val = 0;
+            QueryActions actions{ &rows[i % rows.size()] };
+            generated.parse(input, actions, val);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / parses;
+        };
+
+    // The cascade with the same actions but nothing memoized, to compare
+    // against the precedence-climbing grammar
+    peg::parser cascade(query_grammar);
+    for (const auto& [name, rule] : parser.get_grammar()) {
+        cascade[name.c_str()].action = rule.action;
+    }
+
+    // And once more without the grammar optimizations
+    peg::parser plain(query_grammar);
+    for (const auto& [name, rule] : parser.get_grammar()) {
+        plain[name.c_str()].action = rule.action;
+    }
+    plain.enable_grammar_optimizations(false);
+
+    double parse_all_ns = 0, parse_ns = 0, quiet_ns = 0, lazy_ns = 0, typed_ns = 0, generated_ns = 0, cascade_ns = 0, plain_ns = 0, precedence_ns = 0, tree_ns = 0, short_circuit_ns = 0, bytecode_ns = 0, jit_ns = 0;
+    for (const auto& [input, query] : queries) {
+        parser.enable_packrat_parsing(PackratMode::All);
+        parse_all_ns += time_parse(parser, input);
+        parser.enable_packrat_parsing(PackratMode::Selected);
+        parse_ns += time_parse(parser, input);
+        quiet_ns += time_parse_with(parser, input, quiet);
+        lazy_ns += time_parse_with(parser, input, lazy);
+        typed_ns += time_parse(typed, input);
+        generated_ns += time_generated(input);
+        cascade_ns += time_parse_with(cascade, input, quiet);
+        plain_ns += time_parse_with(plain, input, quiet);
+        precedence_ns += time_parse_with(precedence, input, quiet);
+
+        tree_ns += time_per_evaluation(rows, [&](const FileVersionStore& v) { return query.evaluate(v); });
+        short_circuit_ns += time_per_evaluation(rows, [&](const FileVersionStore& v) { return query.evaluate_short_circuit(v); });
+        BytecodeProgram program(query);
+        bytecode_ns += time_per_evaluation(rows, [&](const FileVersionStore& v) { return program.evaluate(v); });
+        JitQuery jit(query);
+        jit_ns += time_per_evaluation(rows, [&](const FileVersionStore& v) { return jit.evaluate(v); });
+    }
+
+    // Parse contexts leased and newly created, and heap allocations, per
+    // parse once this thread's pool is warm
+    struct PerParse {
+        double acquired;
+        double created;
+        double allocations;
+    };
+    auto per_parse = [&](auto parse) {
+        for (const auto& [input, query] : queries) {
+            parse(input);
+        }
+        auto pool_before = ContextPool::stats();
+        auto allocations_before = allocation_count;
+        for (const auto& [input, query] : queries) {
+            parse(input);
+        }
+        auto pool_after = ContextPool::stats();
+        auto n = static_cast<double>(queries.size());
+        return PerParse{ (pool_after.acquired - pool_before.acquired) / n,
+            (pool_after.created - pool_before.created) / n,
+            (allocation_count - allocations_before) / n };
+        };
+    auto quiet_parse = per_parse([&](const std::string& input) {
+        int val = 0;
+        std::any dt = static_cast<const FileVersionStore*>(&rows[0]);
+        parser.parse_with(input, dt, val, quiet);
+        });
+    auto logged_parse = per_parse([&](const std::string& input) {
+        int val = 0;
+        std::any dt = static_cast<const FileVersionStore*>(&rows[0]);
+        parser.parse(input, dt, val);
+        });
+
+    // Deepest nesting of rule invocations per parse, averaged over the queries
+    auto rule_depth = [&](const char* grammar) {
+        peg::parser p(grammar);
+        size_t depth = 0, deepest = 0, total = 0;
+        for (const auto& [name, rule] : p.get_grammar()) {
+            p[name.c_str()].enter = [&](const Context&, const char*, size_t, std::any&) {
+                deepest = std::max(deepest, ++depth);
+                };
+            p[name.c_str()].leave = [&](const Context&, const char*, size_t, size_t, std::any&, std::any&) {
+                depth--;
+                };
+        }
+        for (const auto& [input, query] : queries) {
+            std::any dt;
+            deepest = 0;
+            p.parse_with(input, dt, quiet);
+            total += deepest;
+        }
+        return static_cast<double>(total) / queries.size();
+        };
+    auto cascade_depth = rule_depth(query_grammar);
+    auto precedence_depth = rule_depth(query_precedence_grammar);
+
+    // Operators invoked per parse, as a verbose trace sees them
+    auto operators_per_parse = [&](const peg::parser& p) {
+        size_t operators = 0;
+        ParseOptions counted;
+        counted.tracer_enter = [&](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&, std::any&) {
+            operators++;
+            };
+        counted.tracer_leave = [](const Ope&, const char*, size_t, const SemanticValues&, const Context&, const std::any&, size_t, std::any&) {};
+        counted.verbose_trace = true;
+        for (const auto& [input, query] : queries) {
+            int val = 0;
+            std::any dt = static_cast<const FileVersionStore*>(&rows[0]);
+            p.parse_with(input, dt, val, counted);
+        }
+        return static_cast<double>(operators) / queries.size();
+        };
+    auto optimized_operators = operators_per_parse(cascade);
+    auto plain_operators = operators_per_parse(plain);
+
+    // Building and optimizing the syntax tree, then dropping it
+    ArenaAst ast;
+    auto build_shared_ast = [&](const std::string& input) {
+        std::shared_ptr<Ast> tree;
+        if (shared_ast.parse_with(input, tree, quiet)) {
+            tree = shared_ast.optimize_ast(tree);
+        }
+        };
+    auto build_arena_ast = [&](const std::string& input) {
+        if (arena_ast.parse_with(input, ast, quiet)) {
+            arena_ast.optimize_ast(ast);
+        }
+        };
+    auto time_ast = [&](auto build) {
+        auto start = std::chrono::steady_clock::now();
+        const int parses = 200;
+        for (int i = 0; i < parses; i++) {
+            for (const auto& [input, query] : queries) {
+                build(input);
+            }
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (double(parses) * queries.size());
+        };
+    auto shared_ast_ns = time_ast(build_shared_ast);
+    auto arena_ast_ns = time_ast(build_arena_ast);
+
+    // Shared nodes per parse, optimized tree included, each its own heap
+    // block. The arena holds all of them in storage it reuses.
+    std::function<size_t(const Ast&)> count_nodes = [&](const Ast& node) {
+        size_t count = 1;
+        for (const auto& child : node.nodes) {
+            count += count_nodes(*child);
+        }
+        return count;
+        };
+    size_t shared_ast_nodes = 0;
+    for (const auto& [input, query] : queries) {
+        std::shared_ptr<Ast> tree;
+        if (shared_ast.parse_with(input, tree, quiet)) {
+            shared_ast_nodes += count_nodes(*tree);
+            shared_ast_nodes += count_nodes(*shared_ast.optimize_ast(tree));
+        }
+    }
+
+    // Recognizing the input only, with no actions
+    size_t input_bytes = 0;
+    for (const auto& [input, query] : queries) {
+        input_bytes += input.size();
+    }
+    auto recognize_ns = time_ast([&](const std::string& input) {
+        std::any dt;
+        recognizer.parse_with(input, dt, quiet);
+        });
+    auto program_ns = time_ast([&](const std::string& input) {
+        program.match(input);
+        });
+    auto mb_per_s = [&](double ns) { return input_bytes / (ns * queries.size()) * 1000; };
+
+    // The keywords and a larger field-name vocabulary as one dictionary and
+    // as a choice of literals, over a line of the words in mixed case
+    std::vector<std::string> vocabulary = { "hash", "size", "fname0", "fname1", "fname", "exists", "and", "or", "not" };
+    for (int i = 0; i < 40; i++) {
+        vocabulary.push_back("field" + std::to_string(i));
+    }
+    std::string dictionary_rule, choice_rule, line;
+    for (size_t i = 0; i < vocabulary.size(); i++) {
+        dictionary_rule += (i ? " | '" : "'") + vocabulary[i] + "'i";
+        choice_rule += (i ? " / '" : "'") + vocabulary[i] + "'i";
+    }
+    for (size_t i = 0; i < 200; i++) {
+        auto word = vocabulary[(i * 7) % vocabulary.size()];
+        if (i % 3 == 0) { word[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(word[0]))); }
+        line += word + " ";
+    }
+    auto time_words = [&](const std::string& rule) {
+        peg::parser words("WORDS <- WORD*\nWORD <- " + rule + "\n%whitespace <- [ \\t]*\n%word <- [a-zA-Z0-9]+");
+        auto start = std::chrono::steady_clock::now();
+        const int parses = 200;
+        for (int i = 0; i < parses; i++) {
+            words.parse(line);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (parses * 200.0);
+        };
+    auto dictionary_ns = time_words(dictionary_rule);
+    auto choice_ns = time_words(choice_rule);
+
+    // Grammar setup, by the generator and from a saved image
+    std::string grammar_image;
+    parser.save_grammar_image(grammar_image);
+    auto time_setup = [&](auto load) {
+        auto start = std::chrono::steady_clock::now();
+        const int loads = 50;
+        for (int i = 0; i < loads; i++) {
+            peg::parser p;
+            load(p);
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / loads;
+        };
+    auto generator_ns = time_setup([&](peg::parser& p) { p.load_grammar(query_grammar); });
+    auto image_ns = time_setup([&](peg::parser& p) { p.load_grammar_image(query_grammar, grammar_image); });
+
+    auto n = static_cast<double>(queries.size());
+    std::cout << "Benchmark over " << queries.size() << " queries, " << rows.size() << " files (ns per evaluation):" << std::endl;
+    std::cout << "  parse, every rule memoized:  " << parse_all_ns / n << std::endl;
+    std::cout << "  parse, selected rules only:  " << parse_ns / n << std::endl;
+    std::cout << "  parse, no error tracking:    " << quiet_ns / n << std::endl;
+    std::cout << "  parse, lazy error tracking:  " << lazy_ns / n << std::endl;
+    std::cout << "  parse, unboxed int values:   " << typed_ns / n << std::endl;
+    std::cout << "  parse, generated parser:     " << generated_ns / n << std::endl;
+    std::cout << "  parse, cascade, unmemoized:  " << cascade_ns / n << " (rules nested " << cascade_depth << " deep)" << std::endl;
+    std::cout << "  parse, no grammar passes:    " << plain_ns / n << " (" << plain_operators << " operators, " << optimized_operators << " with the passes)" << std::endl;
+    std::cout << "  parse, precedence climbing:  " << precedence_ns / n << " (rules nested " << precedence_depth << " deep)" << std::endl;
+    std::cout << "  parse contexts per parse:    " << quiet_parse.created << " created, " << quiet_parse.acquired << " leased from the pool" << std::endl;
+    if (counts_allocations) {
+        std::cout << "  heap allocations per parse:  " << quiet_parse.allocations << " (" << logged_parse.allocations << " with the parser's logger tracking errors)" << std::endl;
+    }
+    else {
+        std::cout << "  heap allocations per parse:  not counted, build with GWMB_COUNT_ALLOCATIONS" << std::endl;
+    }
+    std::cout << "  syntax tree, shared nodes:   " << shared_ast_ns << " (" << shared_ast_nodes / n << " nodes, a heap block each)" << std::endl;
+    std::cout << "  syntax tree, arena nodes:    " << arena_ast_ns << " (all nodes in one reused arena)" << std::endl;
+    std::cout << "  recognize, tree-walking:     " << recognize_ns << " (" << mb_per_s(recognize_ns) << " MB/s)" << std::endl;
+    std::cout << "  recognize, flat program:     " << program_ns << " (" << mb_per_s(program_ns) << " MB/s)" << std::endl;
+    std::cout << "  keyword, dictionary:         " << dictionary_ns << " per word (" << choice_ns << " as a choice of " << vocabulary.size() << " literals)" << std::endl;
+    std::cout << "  compiled tree, eager:        " << tree_ns / n << std::endl;
+    std::cout << "  compiled tree, short-circuit: " << short_circuit_ns / n << std::endl;
+    std::cout << "  bytecode:                    " << bytecode_ns / n << std::endl;
+    std::cout << "  native JIT:                  " << jit_ns / n << (jit_supported() ? "" : " (interpreter fallback)") << std::endl;
+    std::cout << "  grammar setup, generator:    " << generator_ns << std::endl;
+    std::cout << "  grammar setup, saved image:  " << image_ns << " (" << grammar_image.size() << " bytes)" << std::endl;
+
+    std::cout << "Packrat memo hit rates over the test corpus:" << std::endl;
+    for (const auto& [name, stats] : parser.packrat_report(packrat_stats)) {
+        std::cout << "  " << name << ": " << stats.hits << " hits, " << stats.misses << " misses ("
+            << static_cast<int>(stats.hit_rate() * 100) << "%)"
+            << (parser.get_grammar().at(name).memoize ? ", memoized" : "") << std::endl;
     }
-
-    std::cout << "Test passed for input: " << "\"" << input << "\"" << std::endl;
-    return true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     // Define the grammar
-    auto grammar = R"(
-    EXPR          <- OR_OP
-    OR_OP         <- AND_OP ('or'i AND_OP)*
-    AND_OP        <- COMP ('and'i COMP)*
-    COMP          <- NOT_OP (COMP_OP NOT_OP)?
-    NOT_OP        <- ARITHMETIC / 'not'i COMP
-    ARITHMETIC    <- TERM (ADD_SUB_OP TERM)*
-    TERM          <- FACTOR (MUL_DIV_OP FACTOR)*
-    FACTOR        <- PRIMARY / NUMBER
-    PRIMARY       <- (EXISTS  / COMPARE_TYPE / '(' EXPR ')' ) WHITESPACE
-    ADD_SUB_OP    <- '+' / '-'
-    MUL_DIV_OP    <- '*' / '/' / '%'
-    EXISTS        <- 'exists'i '(' HASH NUMBER (',' HASH NUMBER)* ')'
-    COMP_OP       <- '==' / '!=' / '>=' / '<=' / '>' / '<'
-    COMPARE_TYPE  <- HASH NUMBER / SIZE NUMBER / FNAME0 NUMBER / FNAME1 NUMBER / FNAME NUMBER
-    ~HASH         <- 'hash'i
-    ~SIZE         <- 'size'i
-    ~FNAME        <- 'fname'i
-    ~FNAME0       <- 'fname0'i
-    ~FNAME1       <- 'fname1'i
-    NUMBER        <- HEX_NUMBER / DEC_NUMBER
-    HEX_NUMBER    <- '0x'i [a-fA-F0-9]+
-    DEC_NUMBER    <- < [0-9]+ >
-    ~WHITESPACE   <- SPACE
-    ~SPACE        <- (' ' / '\t')*
-    %whitespace   <- [ \t]*
-)";
-
-    // Create a parser
-    parser parser(grammar);
-    parser.enable_packrat_parsing();
+    auto grammar = query_grammar;
+
+    // Create a parser, with the logger in place for the grammar's own messages
+    parser parser;
 
     parser.set_logger([](size_t line, size_t col, const std::string& msg, const std::string& rule) {
         std::cerr << line << ":" << col << ": " << msg << " in rule: " << rule << "\n";
@@ -112,176 +1528,61 @@ int main() {
     auto ok = parser.load_grammar(grammar);
     assert(ok);
 
+    // Writes the standalone parser for the grammar; query_parser.h is its
+    // output, regenerate it after changing the grammar
+    if (argc > 1 && std::string(argv[1]) == "--emit-parser") {
+        std::string source;
+        if (!parser.generate_parser_source("gwmb", "QueryParser", source)) {
+            std::cerr << "The grammar cannot be written as a standalone parser." << std::endl;
+            return 1;
+        }
+        std::cout << source;
+        return 0;
+    }
+
     // Sample data for tests
-    std::unordered_map<std::string, FileVersion> fileVersions = {
-        {"v0", {0, 150, 900, 980}},  // v0 exists with size 150
-        {"v1", {1, 0, 911, 981}},   // v1 does not exist
-        {"v2", {2, 200, 922, 982}}   // v2 exists with size 200
+    FileVersionStore fileVersions = {
+        {0, {0, 150, 900, 980}},  // v0 exists with size 150
+        {1, {1, 0, 911, 981}},   // v1 does not exist
+        {2, {2, 200, 922, 982}}   // v2 exists with size 200
     };
 
     std::set<int> hashes;
 
-    // Define semantic actions
-    parser["COMPARE_TYPE"] = [&](const SemanticValues& sv) {
-        auto num = any_cast<int>(sv[0]);
-        auto val = "v" + std::to_string(num);
-        if (fileVersions.contains(val)) {
-            switch (sv.choice())
-            {
-            case 0:
-                return fileVersions[val].hash;
-            case 1:
-                return fileVersions[val].size;
-            case 2:
-                return fileVersions[val].fname0;
-            case 3:
-                return fileVersions[val].fname1;
-            case 4:
-                return ((fileVersions[val].fname0 & 0xFFFF) << 16) | fileVersions[val].fname1 & 0xFFFF;
-            default:
-                break;
-            }
-        }
-
-        return num;
+    // Define semantic actions. The versions to evaluate against are passed
+    // per parse call through `dt` as a `const FileVersionStore*`.
+    parser["COMPARE_TYPE"] = [](const SemanticValues& sv, std::any& dt) {
+        const auto& fileVersions = *any_cast<const FileVersionStore*>(dt);
+        return semantics::compare_type(fileVersions, sv.choice(), any_cast<int>(sv[0]));
         };
 
     parser["NOT_OP"] = [&](const SemanticValues& sv) {
-        if (sv.choice() == 0) {
-            return any_cast<int>(sv[0]);
-        }
-
-        return static_cast<int>(!static_cast<bool>(any_cast<int>(sv[0])));
+        return semantics::not_op(sv.choice(), any_cast<int>(sv[0]));
         };
 
     parser["OR_OP"] = [&](const SemanticValues& sv) {
-        if (sv.size() == 1) {
-            return any_cast<int>(sv[0]);
-        }
-
-        bool result = false;
-        for (const auto& value : sv) {
-            int val = any_cast<int>(value);
-            result = result || (val != 0);
-            if (result) break; // Short-circuit evaluation
-        }
-        return static_cast<int>(result);
+        return semantics::logic(OpCode::Or, BoxedInts{ sv });
         };
 
     parser["AND_OP"] = [&](const SemanticValues& sv) {
-        if (sv.size() == 1) {
-            return any_cast<int>(sv[0]);
-        }
-
-        bool result = true;
-        for (const auto& value : sv) {
-            int val = any_cast<int>(value);
-            result = result && (val != 0);
-            if (!result) break; // Short-circuit evaluation
-        }
-        return static_cast<int>(result);
+        return semantics::logic(OpCode::And, BoxedInts{ sv });
         };
 
-    parser["EXISTS"] = [&](const SemanticValues& sv) {
-        bool allExist = true;
-
-        for (const auto& value : sv) {
-            int num = any_cast<int>(value);
-            auto val = "v" + std::to_string(num);
-            if (!fileVersions.contains(val)) {
-                allExist = false;
-                break;
-            }
-        }
-
-        return static_cast<int>(allExist);
+    parser["EXISTS"] = [](const SemanticValues& sv, std::any& dt) {
+        const auto& fileVersions = *any_cast<const FileVersionStore*>(dt);
+        return semantics::exists(fileVersions, BoxedInts{ sv });
         };
 
     parser["COMP"] = [&](const SemanticValues& sv) {
-        if (sv.size() == 1) {
-            return any_cast<int>(sv[0]);
-        }
-
-        auto left = any_cast<int>(sv[0]);
-        auto right = any_cast<int>(sv[2]);
-        auto op_choice = any_cast<int>(sv[1]);
-
-        switch (op_choice) {
-        case 0: // '=='
-            return static_cast<int>(left == right);
-        case 1: // '!='
-            return static_cast<int>(left != right);
-        case 2: // '>='
-            return static_cast<int>(left >= right);
-        case 3: // '<='
-            return static_cast<int>(left <= right);
-        case 4: // '>'
-            return static_cast<int>(left > right);
-        case 5: // '<'
-            return static_cast<int>(left < right);
-        default:
-            break;
-        }
-        return 0;
+        return semantics::comp(BoxedInts{ sv });
         };
 
     parser["ARITHMETIC"] = [&](const SemanticValues& sv) {
-        if (sv.size() == 1) {
-            return any_cast<int>(sv[0]);
-        }
-
-        int result = any_cast<int>(sv[0]);
-        for (int i = 1; i < sv.size(); i += 2) {
-            auto op_choice = any_cast<int>(sv[i]);
-            auto val = any_cast<int>(sv[i + 1]);
-
-            switch (op_choice) {
-            case 0: // '+'
-                result += val;
-                break;
-            case 1: // '-'
-                result -= val;
-                break;
-            default:
-                break;
-            }
-        }
-
-        return result;
+        return semantics::chain(add_sub_ops, BoxedInts{ sv });
         };
 
     parser["TERM"] = [&](const SemanticValues& sv) {
-        if (sv.size() == 1) {
-            return any_cast<int>(sv[0]);
-        }
-
-        int result = any_cast<int>(sv[0]);
-        for (int i = 1; i < sv.size(); i += 2) {
-            auto op_choice = any_cast<int>(sv[i]);
-            auto val = any_cast<int>(sv[i + 1]);
-
-            switch (op_choice) {
-            case 0: // '*'
-                result *= val;
-                break;
-            case 1: // '/'
-                if (val != 0)
-                    result /= val;
-                else
-                    throw std::runtime_error("Division by zero");
-                break;
-            case 2: // '%'
-                if (val != 0)
-                    result %= val;
-                else
-                    throw std::runtime_error("Modulo by zero");
-                break;
-            default:
-                break;
-            }
-        }
-
-        return result;
+        return semantics::chain(mul_div_ops, BoxedInts{ sv });
         };
 
     // For FACTOR (Basically, returns the value of the factor)
@@ -312,12 +1613,12 @@ int main() {
         };
 
     parser["HEX_NUMBER"] = [](const SemanticValues& sv) {
-        const auto number = std::stoi(sv.token_to_string(), nullptr, 16);
+        const auto number = sv.token_to_integer<int>(16);
         return number;
         };
 
     parser["DEC_NUMBER"] = [](const SemanticValues& sv) {
-        const auto number = sv.token_to_number<int>();
+        const auto number = sv.token_to_integer<int>();
         return number;
         };
 
@@ -487,8 +1788,17 @@ int main() {
         { "0 / 1 == 0", 1, true, false },
         { "0 % 1 == 0", 1, true, false },
         { "size0 / size1 == size2", 1, true, true },
+        { "(0 - 2147483647 - 1) / (0 - 1) == 0 - 2147483647 - 1", 1 },
+        { "(0 - 2147483647 - 1) % (0 - 1) == 0", 1 },
     };
 
+    // Memoize only the rules that are re-entered at the same position often
+    // enough to pay for their memo slots
+    PackratStats packrat_stats;
+    profile_packrat(parser, test_cases, fileVersions, packrat_stats);
+    parser.select_packrat_rules(packrat_stats, 0.1);
+    parser.enable_packrat_parsing(PackratMode::Selected);
+
     // Run the tests
     bool all_passed = true;
     for (const auto& test : test_cases) {
@@ -503,5 +1813,563 @@ int main() {
         std::cout << "Some tests failed." << std::endl;
     }
 
+    // Every rule memoized against none. The long inputs make the memo table
+    // grow several times within one parse.
+    peg::parser memoized(grammar), unmemoized(grammar);
+    for (const auto& [name, rule] : parser.get_grammar()) {
+        memoized[name.c_str()].action = rule.action;
+        unmemoized[name.c_str()].action = rule.action;
+    }
+    memoized.enable_packrat_parsing();
+    std::string long_sum = "size0", long_nesting = "size1";
+    for (int i = 0; i < 60; i++) {
+        long_sum += " + size" + std::to_string(i % 3) + " * 2";
+        long_nesting = "(" + long_nesting + " - 1)";
+    }
+    std::vector<TestCase> packrat_cases = {
+        { long_sum + " > 0", 1 },
+        { long_nesting + " < 0 or " + long_sum + " / 0", 1 },
+    };
+
+    bool all_packrat_passed = run_packrat_memo_table_test();
+    for (const auto* cases : { &test_cases, &packrat_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_packrat_test(memoized, unmemoized, test, fileVersions);
+            all_packrat_passed = all_packrat_passed && result;
+        }
+    }
+
+    if (all_packrat_passed) {
+        std::cout << "All packrat tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some packrat tests failed." << std::endl;
+    }
+
+    if (run_memoize_annotation_test()) {
+        std::cout << "All memoize annotation tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some memoize annotation tests failed." << std::endl;
+    }
+
+    // Run the tests again through queries compiled once up front
+    QueryCompiler compiler;
+    compiler.set_logger([](size_t, size_t, const std::string&, const std::string&) {
+        });
+
+    bool all_compiled_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_compiled_test(compiler, test, fileVersions);
+        all_compiled_passed = all_compiled_passed && result;
+    }
+
+    if (all_compiled_passed) {
+        std::cout << "All compiled query tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some compiled query tests failed." << std::endl;
+    }
+
+    auto table = make_test_table(fileVersions, 1000);
+
+    // The same parser evaluated against other files, passed per call
+    parser.set_logger([](size_t, size_t, const std::string&, const std::string&) {
+        });
+
+    bool all_dataset_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_dataset_test(parser, compiler, test, table);
+        all_dataset_passed = all_dataset_passed && result;
+    }
+
+    if (all_dataset_passed) {
+        std::cout << "All dataset tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some dataset tests failed." << std::endl;
+    }
+
+    // The same grammar with its values stored unboxed
+    typed_parser<int> typed(grammar);
+    set_typed_actions(typed);
+    PackratStats typed_packrat_stats;
+    profile_packrat(typed, test_cases, fileVersions, typed_packrat_stats);
+    typed.select_packrat_rules(typed_packrat_stats, 0.1);
+    typed.enable_packrat_parsing(PackratMode::Selected);
+
+    bool all_typed_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_typed_test(parser, typed, test, table);
+        all_typed_passed = all_typed_passed && result;
+    }
+
+    if (all_typed_passed) {
+        std::cout << "All typed parser tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some typed parser tests failed." << std::endl;
+    }
+
+    // Number literals convert in place and reject values that do not fit in an int
+    std::vector<TestCase> number_cases = {
+        { "size2 < 0x7fffffff", 1 },
+        { "size2 < 2147483647", 1 },
+        { "size0 == 0x 96", 0 },
+        { "size2 < 0x80000000", 0, true, true },
+        { "size2 < 2147483648", 0, true, true },
+        { "exists(hash0x" + std::string(40, 'f') + ")", 0, true, true },
+    };
+
+    bool all_number_passed = true;
+    for (const auto& test : number_cases) {
+        bool result = run_number_test(parser, typed, compiler, test, fileVersions);
+        all_number_passed = all_number_passed && result;
+    }
+
+    if (all_number_passed) {
+        std::cout << "All number tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some number tests failed." << std::endl;
+    }
+
+    // The standalone parser generated from the grammar, with the query
+    // semantics as hooks. query_parser.h must be generated from this grammar.
+    GeneratedQueryParser generated;
+    std::string generated_source;
+    bool all_generated_passed = GeneratedQueryParser::grammar_source == grammar &&
+        parser.generate_parser_source("gwmb", "QueryParser", generated_source);
+    for (const auto* cases : { &test_cases, &number_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_generated_test(typed, generated, test, table);
+            all_generated_passed = all_generated_passed && result;
+        }
+    }
+
+    if (all_generated_passed) {
+        std::cout << "All generated parser tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some generated parser tests failed." << std::endl;
+    }
+
+    // The same language with `or`/`and` and the arithmetic operators parsed by
+    // precedence climbing. The rules it shares with the cascade keep their
+    // actions; the two climbing rules reduce one operator at a time.
+    peg::parser precedence(query_precedence_grammar);
+    for (const auto& [name, rule] : parser.get_grammar()) {
+        if (precedence.get_grammar().count(name)) {
+            precedence[name.c_str()].action = rule.action;
+        }
+    }
+
+    precedence["LOGIC_OP"] = [](const SemanticValues& sv) {
+        return static_cast<int>(sv.choice());
+        };
+
+    precedence["ARITH_OP"] = [](const SemanticValues& sv) {
+        return static_cast<int>(sv.choice());
+        };
+
+    precedence["EXPR"] = [](const SemanticValues& sv) {
+        return apply_binary(logic_ops[any_cast<int>(sv[1])], any_cast<int>(sv[0]), any_cast<int>(sv[2]));
+        };
+
+    precedence["ARITHMETIC"] = [](const SemanticValues& sv) {
+        return apply_binary(arith_ops[any_cast<int>(sv[1])], any_cast<int>(sv[0]), any_cast<int>(sv[2]));
+        };
+
+    // Chains that only an operator table gets wrong: associativity, mixed
+    // levels, operators in any case, and comparisons, which do not chain
+    std::vector<TestCase> precedence_cases = {
+        { "size2 - size0 - 25", 25 },
+        { "size2 / 10 / 5", 4 },
+        { "size2 - size0 * 2 + 100", 0 },
+        { "size2 % 7 * 3", 12 },
+        { "(size2 - size0) * 2", 100 },
+        { "size0 + size2 / 0", 0, true, true },
+        { "size0 % 0 + size2 / 0", 0, true, true },
+        { "hash0 OR size1 And size2", 0 },
+        { "size1 or size0 and size2 or hash0", 1 },
+        { "not size1 and size0 or hash0", 1 },
+        { "size0 == size0 == size0", 0, false },
+        { "size0 + not size1", 0, false },
+        { "size0 == 150 or", 0, false },
+    };
+
+    bool all_precedence_passed = true;
+    for (const auto* cases : { &test_cases, &number_cases, &precedence_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_precedence_test(parser, precedence, test, table);
+            all_precedence_passed = all_precedence_passed && result;
+        }
+    }
+    for (const auto& test : precedence_cases) {
+        bool result = run_test(precedence, test.input, test.expected, fileVersions, test.expect_parse_success, test.expect_exception);
+        all_precedence_passed = all_precedence_passed && result;
+    }
+    all_precedence_passed = run_precedence_case_test() && all_precedence_passed;
+
+    if (all_precedence_passed) {
+        std::cout << "All precedence climbing tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some precedence climbing tests failed." << std::endl;
+    }
+
+    // The grammar parsed operator by operator as written, against `parser`,
+    // which inlines the `~` keyword and WHITESPACE rules and the EXPR alias
+    // and checks the leading keywords of COMPARE_TYPE's alternatives
+    peg::parser plain(grammar);
+    for (const auto& [name, rule] : parser.get_grammar()) {
+        plain[name.c_str()].action = rule.action;
+    }
+    plain.enable_grammar_optimizations(false);
+
+    bool all_optimization_passed = true;
+    for (const auto* cases : { &test_cases, &number_cases, &precedence_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_optimization_test(parser, plain, test, table);
+            all_optimization_passed = all_optimization_passed && result;
+        }
+    }
+
+    // An action bound to an inlined rule after loading still runs
+    {
+        peg::parser keywords(grammar);
+        int size_keywords = 0;
+        keywords["SIZE"] = [&](const SemanticValues&) { size_keywords++; };
+        std::any dt;
+        all_optimization_passed = all_optimization_passed &&
+            keywords.parse_with("size0 > size1 or hash2", dt, ParseOptions()) && size_keywords == 2;
+    }
+
+    // What an inlined body leaves behind stays out of the caller's values:
+    // SIGN's token, and NUM's tag on the value of the VALUE alias
+    for (auto optimize : { true, false }) {
+        peg::parser scoped(R"(
+            PAIR   <- SIGN VALUE
+            VALUE  <- NUM
+            NUM    <- < [0-9]+ >
+            ~SIGN  <- < '+' / '-' >
+        )");
+        scoped.enable_grammar_optimizations(optimize);
+        scoped["PAIR"] = [](const SemanticValues& sv) {
+            return sv.tokens.empty() && sv.tags.size() == 1 && sv.tags[0] == str2tag("VALUE");
+            };
+        bool scoped_values = false;
+        all_optimization_passed = all_optimization_passed &&
+            scoped.parse("-12", scoped_values) && scoped_values;
+    }
+
+    if (all_optimization_passed) {
+        std::cout << "All grammar optimization tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some grammar optimization tests failed." << std::endl;
+    }
+
+    // The grammar saved as an image and restored without the generator. The
+    // image must round-trip byte for byte and reject a truncated or damaged
+    // copy or another source, and reloading the same grammar must keep the
+    // actions.
+    std::string grammar_image, restored_image;
+    peg::parser restored;
+    bool all_image_passed = parser.save_grammar_image(grammar_image) &&
+        restored.load_grammar_image(grammar, grammar_image) &&
+        restored.save_grammar_image(restored_image) && restored_image == grammar_image;
+    for (size_t len = 0; all_image_passed && len < grammar_image.size(); len++) {
+        auto damaged = grammar_image;
+        damaged[len] ^= 0x20;
+        all_image_passed = !peg::parser().load_grammar_image(grammar, std::string_view(grammar_image).substr(0, len)) &&
+            !peg::parser().load_grammar_image(grammar, damaged);
+    }
+    all_image_passed = all_image_passed && !restored.load_grammar_image(std::string(grammar) + " ", grammar_image);
+    const auto* loaded_grammar = &parser.get_grammar();
+    all_image_passed = all_image_passed && parser.load_grammar(grammar) && &parser.get_grammar() == loaded_grammar;
+    if (all_image_passed) {
+        for (const auto& [name, rule] : parser.get_grammar()) {
+            restored[name.c_str()].action = rule.action;
+        }
+        restored.enable_packrat_parsing(PackratMode::Selected);
+        for (const auto& test : test_cases) {
+            bool result = run_image_test(parser, restored, test, table);
+            all_image_passed = all_image_passed && result;
+        }
+    }
+
+    all_image_passed = all_image_passed && run_image_feature_test();
+
+    if (all_image_passed) {
+        std::cout << "All grammar image tests passed! (" << grammar_image.size() << " bytes)" << std::endl;
+    }
+    else {
+        std::cout << "Some grammar image tests failed." << std::endl;
+    }
+
+    // The grammar's syntax tree, as shared nodes and in an arena
+    peg::parser shared_ast(grammar);
+    shared_ast.enable_ast();
+    shared_ast.enable_packrat_parsing();
+    arena_ast_parser arena_ast(grammar);
+    arena_ast.enable_packrat_parsing();
+
+    bool all_arena_ast_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_arena_ast_test(shared_ast, arena_ast, test);
+        all_arena_ast_passed = all_arena_ast_passed && result;
+    }
+
+    if (all_arena_ast_passed) {
+        std::cout << "All arena AST tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some arena AST tests failed." << std::endl;
+    }
+
+    // First-byte dispatch must agree with trying every alternative
+    bool all_dispatch_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_dispatch_test(parser, test, table);
+        all_dispatch_passed = all_dispatch_passed && result;
+    }
+
+    if (all_dispatch_passed) {
+        std::cout << "All dispatch tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some dispatch tests failed." << std::endl;
+    }
+
+    // Errors located after a failure must match errors tracked throughout
+    bool all_lazy_error_passed = true;
+    for (const auto& test : test_cases) {
+        bool result = run_lazy_error_test(parser, test, table);
+        all_lazy_error_passed = all_lazy_error_passed && result;
+    }
+
+    // and after a parse that only succeeds through recovery
+    peg::parser recovery(R"(
+        START       <- STMT+
+        STMT        <- 'a' ';'^semi
+        semi        <- (!';' .)* ';'
+        %whitespace <- [ \t]*
+    )");
+    recovery["START"] = [](const SemanticValues& vs) { return static_cast<int>(vs.size()); };
+    for (const auto& test : { TestCase("a; a x; a;", 0, false), TestCase("a; a; a x", 0, false) }) {
+        bool result = run_lazy_error_test(recovery, test, table);
+        all_lazy_error_passed = all_lazy_error_passed && result;
+    }
+
+    if (all_lazy_error_passed) {
+        std::cout << "All lazy error tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some lazy error tests failed." << std::endl;
+    }
+
+    if (run_span_tests()) {
+        std::cout << "All span tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some span tests failed." << std::endl;
+    }
+
+    if (run_dictionary_tests()) {
+        std::cout << "All dictionary tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some dictionary tests failed." << std::endl;
+    }
+
+    // The grammar lowered to a flat instruction program
+    peg::parser recognizer(grammar);
+    PegProgram program;
+    bool all_program_passed = recognizer.compile_program(program);
+    std::vector<TestCase> long_run_cases = {
+        { "hash0" + std::string(40, ' ') + "==\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t hash0", 1 },
+        { "size0 < " + std::string(70, '9'), 1 },
+        { "size0 < 0x" + std::string(40, 'f') + "0123456789abcdefABCDEF", 1 },
+        { "size0 < 0x" + std::string(40, 'f') + " " + std::string(30, ' '), 1 },
+        { "size0 < " + std::string(40, '1') + "\xc3\xa9", 0, false },
+    };
+    for (const auto* cases : { &test_cases, &long_run_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_program_test(recognizer, program, test);
+            all_program_passed = all_program_passed && result;
+        }
+    }
+
+    if (all_program_passed) {
+        std::cout << "All program tests passed! (" << program.code().size() << " instructions)" << std::endl;
+    }
+    else {
+        std::cout << "Some program tests failed." << std::endl;
+    }
+
+    if (run_context_pool_test(parser, test_cases, fileVersions)) {
+        std::cout << "All context pool tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some context pool tests failed." << std::endl;
+    }
+
+    // The shared parser and compiler hammered from many threads at once
+    auto thread_count = (std::max)(8u, std::thread::hardware_concurrency());
+    if (run_concurrent_tests(parser, compiler, test_cases, table, thread_count, 3) &&
+        run_recovered_error_mode_test()) {
+        std::cout << "All concurrent tests passed! (" << thread_count << " threads)" << std::endl;
+    }
+    else {
+        std::cout << "Some concurrent tests failed." << std::endl;
+    }
+
+    // Operands skipped by short-circuiting must not be evaluated at all
+    std::vector<TestCase> short_circuit_cases = {
+        { "0 and 1 / 0", 0 },
+        { "1 or 1 % 0", 1 },
+        { "exists(hash7) and size7 / 0 > 1", 0 },
+        { "exists(hash0) or size0 % 0", 1 },
+        { "not (0 and 1 / 0)", 1 },
+        { "(size1 or 1 / 0) and 1", 0, true, true },
+        { "size0 / 0 > 1 or 1", 0, true, true },
+        { "hash1 + hash2 + hash0 > 2 and exists(hash1)", 1 },
+        { "size0 / 3 > 40 or size1 / 0", 1 },
+    };
+
+    bool all_short_circuit_passed = true;
+    for (const auto& test : short_circuit_cases) {
+        bool result = run_short_circuit_test(compiler, test, fileVersions);
+        all_short_circuit_passed = all_short_circuit_passed && result;
+    }
+
+    if (all_short_circuit_passed) {
+        std::cout << "All short-circuit tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some short-circuit tests failed." << std::endl;
+    }
+
+    // Bytecode must agree with short-circuit evaluation on every file
+    bool all_bytecode_passed = true;
+    for (const auto* cases : { &test_cases, &short_circuit_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_bytecode_test(compiler, test, table);
+            all_bytecode_passed = all_bytecode_passed && result;
+        }
+    }
+
+    if (all_bytecode_passed) {
+        std::cout << "All bytecode tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some bytecode tests failed." << std::endl;
+    }
+
+    // Native code must agree with the eager tree interpreter on every file,
+    // including which division fails
+    bool all_jit_passed = true;
+    for (const auto* cases : { &test_cases, &short_circuit_cases }) {
+        for (const auto& test : *cases) {
+            bool result = run_jit_test(compiler, test, table);
+            all_jit_passed = all_jit_passed && result;
+        }
+    }
+
+    if (all_jit_passed) {
+        std::cout << "All JIT tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some JIT tests failed." << std::endl;
+    }
+
+    bool all_static_passed = run_static_tests<
+        "hash0 == 0",
+        "  HASH1 == 1 AND Size1 == 0",
+        "exists(hash0, hash1, hash2)",
+        "EXISTS(HASH0,HASH3) or not exists(hash2)",
+        "size2 <= 0XC8",
+        "(size0 > 0x10)and hash0x1 == 1",
+        "0x1+1 == exists(hash0x1,hash2) + 1",
+        "fname0 + fname1 * 2 - fname2",
+        "fname2 == fname2 and fname0 == 0x384",
+        "fname0 == 0x384+fname1 - fname1",
+        "not size1",
+        "not hash0 == hash1",
+        "size0 / size1",
+        "size2 % (hash1 - 1) != 0",
+        "(size0 + size2) * 2 % 7 >= 3",
+        "((hash0 or hash1) and (size2 > size0))",
+        "hash7 == 7 and size3 < 0x0">(compiler, table);
+
+    if (all_static_passed) {
+        std::cout << "All static query tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some static query tests failed." << std::endl;
+    }
+
+    // Evaluate every query over a whole table and check each row against the
+    // per-file evaluator
+    std::vector<SimdLevel> levels = { SimdLevel::Scalar };
+    if (best_simd_level() == SimdLevel::Avx2) {
+        levels.push_back(SimdLevel::Avx2);
+    }
+
+    bool all_batch_passed = true;
+    for (const auto& test : test_cases) {
+        for (auto level : levels) {
+            bool result = run_batch_test(compiler, test, table, level);
+            all_batch_passed = all_batch_passed && result;
+        }
+    }
+
+    if (all_batch_passed) {
+        std::cout << "All batch tests passed!" << std::endl;
+    }
+    else {
+        std::cout << "Some batch tests failed." << std::endl;
+    }
+
+    // Evaluate all queries together as one rule set; each rule must agree
+    // with evaluating its query alone
+    RuleSet rules;
+    std::vector<CompiledQuery> rule_queries;
+    size_t unshared_nodes = 0;
+    for (const auto& test : test_cases) {
+        CompiledQuery query;
+        if (compiler.compile(test.input, query)) {
+            rules.add(query);
+            unshared_nodes += query.nodes().size();
+            rule_queries.push_back(std::move(query));
+        }
+    }
+
+    bool all_rule_set_passed = true;
+    for (auto level : levels) {
+        auto results = rules.evaluate(table, level);
+        for (size_t rule = 0; rule < rule_queries.size(); rule++) {
+            auto expected = evaluate_batch(rule_queries[rule], table, level);
+            if (results[rule].matches != expected.matches || results[rule].errors != expected.errors) {
+                std::cout << "Rule set test failed for rule " << rule
+                    << (level == SimdLevel::Avx2 ? " (avx2)" : " (scalar)") << std::endl;
+                all_rule_set_passed = false;
+            }
+        }
+    }
+
+    if (all_rule_set_passed) {
+        std::cout << "All rule set tests passed! (" << rules.size() << " rules, "
+            << rules.node_count() << " shared nodes out of " << unshared_nodes << ")" << std::endl;
+    }
+    else {
+        std::cout << "Some rule set tests failed." << std::endl;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        run_benchmarks(parser, typed, shared_ast, arena_ast, recognizer, precedence, program, compiler, test_cases, table, packrat_stats);
+    }
+
     return 0;
 }
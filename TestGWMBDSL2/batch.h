@@ -0,0 +1,447 @@
+//
+//  batch.h
+//
+//  Column-at-a-time evaluation of a compiled query over a whole FileTable.
+//
+
+#pragma once
+
+#include "query.h"
+#include "version_store.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GWMB_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(GWMB_X86) && (defined(__GNUC__) || defined(__clang__))
+#define GWMB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define GWMB_TARGET_AVX2
+#endif
+
+namespace gwmb {
+
+    using Bitmap = std::vector<uint64_t>;
+
+    // One bit per file. A file whose evaluation divides or takes a modulo by
+    // zero (where CompiledQuery::evaluate would throw) is reported in `errors`
+    // and never in `matches`.
+    struct BatchResult {
+        Bitmap matches;
+        Bitmap errors;
+    };
+
+    enum class SimdLevel { Scalar, Avx2 };
+
+    // Uses peglib's detector, which also serves its character class scans
+    inline SimdLevel best_simd_level() {
+#if defined(GWMB_X86) && defined(CPPPEGLIB_AVX2)
+        return peg::cpu_supports_avx2() ? SimdLevel::Avx2 : SimdLevel::Scalar;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }
+
+    namespace detail {
+
+        // Rows evaluated per pass; every node keeps one block of values.
+        constexpr size_t batch_block_size = 512;
+
+        inline bool present_at(const uint64_t* present, size_t i) {
+            return (present[i / 64] >> (i % 64)) & 1;
+        }
+
+        // Division has no vector instruction, so both kernel sets share it.
+        inline void divide(OpCode op, int* out, const int* a, const int* b,
+            size_t n, uint64_t* errors) {
+            for (size_t i = 0; i < n; i++) {
+                if (b[i] == 0) {
+                    out[i] = 0;
+                    errors[i / 64] |= uint64_t(1) << (i % 64);
+                }
+                else {
+                    out[i] = op == OpCode::Div ? wrap_div(a[i], b[i]) : wrap_mod(a[i], b[i]);
+                }
+            }
+        }
+
+        // All kernels take `n` as a multiple of 64 and `present` pointing at the
+        // bitmap word of the block's first row.
+        struct ScalarKernels {
+            static void fill(int* out, int value, size_t n) {
+                std::fill(out, out + n, value);
+            }
+
+            static void load(int* out, const int* column, const uint64_t* present,
+                int missing, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i] = present_at(present, i) ? column[i] : missing;
+                }
+            }
+
+            static void load_fname(int* out, const int* fname0, const int* fname1,
+                const uint64_t* present, int missing, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i] = present_at(present, i) ? fname_of(fname0[i], fname1[i]) : missing;
+                }
+            }
+
+            static void exists(int* out, const uint64_t* present, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i] = static_cast<int>(present_at(present, i));
+                }
+            }
+
+            static void logical_not(int* out, const int* a, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i] = static_cast<int>(a[i] == 0);
+                }
+            }
+
+            static void binary(OpCode op, int* out, const int* a, const int* b,
+                size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i] = apply_binary(op, a[i], b[i]);
+                }
+            }
+
+            static void to_bits(const int* a, uint64_t* bits, size_t n) {
+                for (size_t w = 0; w < n / 64; w++) {
+                    uint64_t word = 0;
+                    for (size_t i = 0; i < 64; i++) {
+                        word |= uint64_t(a[w * 64 + i] != 0) << i;
+                    }
+                    bits[w] = word;
+                }
+            }
+        };
+
+#if defined(GWMB_X86)
+        struct Avx2Kernels {
+            GWMB_TARGET_AVX2 static void fill(int* out, int value, size_t n) {
+                auto v = _mm256_set1_epi32(value);
+                for (size_t i = 0; i < n; i += 8) {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void load(int* out, const int* column,
+                const uint64_t* present, int missing, size_t n) {
+                auto lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+                auto otherwise = _mm256_set1_epi32(missing);
+                for (size_t i = 0; i < n; i += 8) {
+                    auto byte = static_cast<int>((present[i / 64] >> (i % 64)) & 0xFF);
+                    auto mask = _mm256_cmpeq_epi32(
+                        _mm256_and_si256(_mm256_set1_epi32(byte), lanes), lanes);
+                    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(column + i));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_blendv_epi8(otherwise, v, mask));
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void load_fname(int* out, const int* fname0,
+                const int* fname1, const uint64_t* present, int missing, size_t n) {
+                auto lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+                auto otherwise = _mm256_set1_epi32(missing);
+                auto low = _mm256_set1_epi32(0xFFFF);
+                for (size_t i = 0; i < n; i += 8) {
+                    auto byte = static_cast<int>((present[i / 64] >> (i % 64)) & 0xFF);
+                    auto mask = _mm256_cmpeq_epi32(
+                        _mm256_and_si256(_mm256_set1_epi32(byte), lanes), lanes);
+                    auto hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fname0 + i));
+                    auto lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fname1 + i));
+                    auto v = _mm256_or_si256(
+                        _mm256_slli_epi32(_mm256_and_si256(hi, low), 16),
+                        _mm256_and_si256(lo, low));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_blendv_epi8(otherwise, v, mask));
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void exists(int* out, const uint64_t* present,
+                size_t n) {
+                auto lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+                auto one = _mm256_set1_epi32(1);
+                for (size_t i = 0; i < n; i += 8) {
+                    auto byte = static_cast<int>((present[i / 64] >> (i % 64)) & 0xFF);
+                    auto mask = _mm256_cmpeq_epi32(
+                        _mm256_and_si256(_mm256_set1_epi32(byte), lanes), lanes);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_and_si256(mask, one));
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void logical_not(int* out, const int* a, size_t n) {
+                auto zero = _mm256_setzero_si256();
+                auto one = _mm256_set1_epi32(1);
+                for (size_t i = 0; i < n; i += 8) {
+                    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_and_si256(_mm256_cmpeq_epi32(x, zero), one));
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void binary(OpCode op, int* out, const int* a,
+                const int* b, size_t n) {
+                auto zero = _mm256_setzero_si256();
+                auto one = _mm256_set1_epi32(1);
+                for (size_t i = 0; i < n; i += 8) {
+                    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+                    auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+                    __m256i r;
+                    switch (op) {
+                    case OpCode::Or:
+                        r = _mm256_andnot_si256(
+                            _mm256_cmpeq_epi32(_mm256_or_si256(x, y), zero), one);
+                        break;
+                    case OpCode::And:
+                        r = _mm256_andnot_si256(
+                            _mm256_or_si256(_mm256_cmpeq_epi32(x, zero),
+                                _mm256_cmpeq_epi32(y, zero)),
+                            one);
+                        break;
+                    case OpCode::Equal:
+                        r = _mm256_and_si256(_mm256_cmpeq_epi32(x, y), one);
+                        break;
+                    case OpCode::NotEqual:
+                        r = _mm256_andnot_si256(_mm256_cmpeq_epi32(x, y), one);
+                        break;
+                    case OpCode::GreaterEqual:
+                        r = _mm256_andnot_si256(_mm256_cmpgt_epi32(y, x), one);
+                        break;
+                    case OpCode::LessEqual:
+                        r = _mm256_andnot_si256(_mm256_cmpgt_epi32(x, y), one);
+                        break;
+                    case OpCode::Greater:
+                        r = _mm256_and_si256(_mm256_cmpgt_epi32(x, y), one);
+                        break;
+                    case OpCode::Less:
+                        r = _mm256_and_si256(_mm256_cmpgt_epi32(y, x), one);
+                        break;
+                    case OpCode::Add: r = _mm256_add_epi32(x, y); break;
+                    case OpCode::Sub: r = _mm256_sub_epi32(x, y); break;
+                    case OpCode::Mul: r = _mm256_mullo_epi32(x, y); break;
+                    default: r = zero; break;
+                    }
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), r);
+                }
+            }
+
+            GWMB_TARGET_AVX2 static void to_bits(const int* a, uint64_t* bits, size_t n) {
+                auto zero = _mm256_setzero_si256();
+                for (size_t w = 0; w < n / 64; w++) {
+                    uint64_t word = 0;
+                    for (size_t k = 0; k < 8; k++) {
+                        auto x = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(a + w * 64 + k * 8));
+                        auto is_zero = _mm256_movemask_ps(
+                            _mm256_castsi256_ps(_mm256_cmpeq_epi32(x, zero)));
+                        word |= uint64_t(~is_zero & 0xFF) << (k * 8);
+                    }
+                    bits[w] = word;
+                }
+            }
+        };
+#endif
+
+        // Storage for evaluating a node DAG one block at a time.
+        struct BatchPlan {
+            std::vector<uint32_t> block_of;  // value block of each node
+            uint32_t block_count = 0;
+            std::vector<uint32_t> error_of;  // error slot of each Div/Mod node
+            uint32_t error_count = 0;
+        };
+
+        // A node takes over the value block of any node whose last consumer
+        // has already run, so the working set follows the width of the DAG
+        // rather than its size.
+        inline BatchPlan make_plan(const std::vector<QueryNode>& nodes) {
+            std::vector<size_t> last_use(nodes.size());
+            for (size_t id = 0; id < nodes.size(); id++) {
+                const auto& node = nodes[id];
+                last_use[id] = id;
+                if (node.op == OpCode::Not || is_binary(node.op)) {
+                    last_use[node.lhs] = id;
+                }
+                if (is_binary(node.op)) {
+                    last_use[node.rhs] = id;
+                }
+            }
+
+            BatchPlan plan;
+            plan.block_of.resize(nodes.size());
+            plan.error_of.resize(nodes.size());
+            std::vector<uint32_t> free_blocks;
+
+            for (size_t id = 0; id < nodes.size(); id++) {
+                const auto& node = nodes[id];
+                if (free_blocks.empty()) {
+                    plan.block_of[id] = plan.block_count++;
+                }
+                else {
+                    plan.block_of[id] = free_blocks.back();
+                    free_blocks.pop_back();
+                }
+                if (node.op == OpCode::Div || node.op == OpCode::Mod) {
+                    plan.error_of[id] = plan.error_count++;
+                }
+
+                auto release = [&](size_t operand) {
+                    if (last_use[operand] == id) {
+                        free_blocks.push_back(plan.block_of[operand]);
+                    }
+                    };
+                if (node.op == OpCode::Not || is_binary(node.op)) {
+                    release(node.lhs);
+                }
+                if (is_binary(node.op) && node.rhs != node.lhs) {
+                    release(node.rhs);
+                }
+                release(id);
+            }
+            return plan;
+        }
+
+        constexpr size_t batch_error_words = batch_block_size / 64;
+
+        // Computes every node of `nodes` (in post-order) for rows
+        // [first, first + n). `on_node(id, values)` is called right after each
+        // node, while its values are still in place; `errors` receives one
+        // block of bits per error slot of the plan.
+        template <typename Kernels, typename OnNode>
+        void evaluate_block(const std::vector<QueryNode>& nodes,
+            const BatchPlan& plan, const FileTable& files, size_t first,
+            size_t n, int* values, uint64_t* errors, OnNode&& on_node) {
+            for (size_t id = 0; id < nodes.size(); id++) {
+                const auto& node = nodes[id];
+                auto out = values + plan.block_of[id] * batch_block_size;
+                auto lhs = values + plan.block_of[node.lhs] * batch_block_size;
+                auto rhs = values + plan.block_of[node.rhs] * batch_block_size;
+
+                switch (node.op) {
+                case OpCode::Constant:
+                    Kernels::fill(out, node.value, n);
+                    break;
+                case OpCode::Hash:
+                case OpCode::Size:
+                case OpCode::Fname0:
+                case OpCode::Fname1:
+                case OpCode::Fname: {
+                    auto columns = files.find(node.value);
+                    if (!columns) {
+                        Kernels::fill(out, node.value, n);
+                        break;
+                    }
+                    auto present = columns->present.data() + first / 64;
+                    if (node.op == OpCode::Fname) {
+                        Kernels::load_fname(out, columns->fname0.data() + first,
+                            columns->fname1.data() + first, present, node.value, n);
+                        break;
+                    }
+                    const auto& column =
+                        node.op == OpCode::Hash ? columns->hash
+                        : node.op == OpCode::Size ? columns->size
+                        : node.op == OpCode::Fname0 ? columns->fname0
+                        : columns->fname1;
+                    Kernels::load(out, column.data() + first, present, node.value, n);
+                    break;
+                }
+                case OpCode::Exists: {
+                    auto columns = files.find(node.value);
+                    if (!columns) {
+                        Kernels::fill(out, 0, n);
+                        break;
+                    }
+                    Kernels::exists(out, columns->present.data() + first / 64, n);
+                    break;
+                }
+                case OpCode::Not:
+                    Kernels::logical_not(out, lhs, n);
+                    break;
+                case OpCode::Div:
+                case OpCode::Mod: {
+                    auto node_errors = errors + plan.error_of[id] * batch_error_words;
+                    std::fill(node_errors, node_errors + batch_error_words, 0);
+                    divide(node.op, out, lhs, rhs, n, node_errors);
+                    break;
+                }
+                default:
+                    Kernels::binary(node.op, out, lhs, rhs, n);
+                    break;
+                }
+
+                on_node(id, out);
+            }
+        }
+
+        inline void merge_errors(const uint64_t* errors, uint32_t slot,
+            uint64_t* out, size_t n) {
+            auto slot_errors = errors + slot * batch_error_words;
+            for (size_t w = 0; w < n / 64; w++) {
+                out[w] |= slot_errors[w];
+            }
+        }
+
+        // Clears bits of padding rows and of rows that failed.
+        inline void finish_bitmaps(size_t file_count, Bitmap& matches,
+            Bitmap& errors) {
+            if (file_count % 64) {
+                auto mask = (uint64_t(1) << (file_count % 64)) - 1;
+                matches.back() &= mask;
+                errors.back() &= mask;
+            }
+            for (size_t w = 0; w < matches.size(); w++) {
+                matches[w] &= ~errors[w];
+            }
+        }
+
+        template <typename Kernels>
+        BatchResult evaluate_batch(const CompiledQuery& query, const FileTable& files) {
+            auto rows = files.padded_count();
+            BatchResult result{ Bitmap(rows / 64), Bitmap(rows / 64) };
+            if (query.empty() || rows == 0) { return result; }
+
+            const auto& nodes = query.nodes();
+            auto plan = make_plan(nodes);
+            std::vector<int> values(plan.block_count * batch_block_size);
+            std::vector<uint64_t> errors(plan.error_count * batch_error_words);
+
+            for (size_t first = 0; first < rows; first += batch_block_size) {
+                auto n = (std::min)(batch_block_size, rows - first);
+                auto matches = result.matches.data() + first / 64;
+                evaluate_block<Kernels>(nodes, plan, files, first, n, values.data(),
+                    errors.data(), [&](size_t id, const int* out) {
+                        if (id == query.root()) {
+                            Kernels::to_bits(out, matches, n);
+                        }
+                    });
+                for (uint32_t slot = 0; slot < plan.error_count; slot++) {
+                    merge_errors(errors.data(), slot, result.errors.data() + first / 64, n);
+                }
+            }
+
+            finish_bitmaps(files.file_count(), result.matches, result.errors);
+            return result;
+        }
+
+    } // namespace detail
+
+    // Evaluates `query` against every file of `files`, one column block at a
+    // time. `and`/`or` evaluate both operands, as CompiledQuery::evaluate does.
+    inline BatchResult evaluate_batch(const CompiledQuery& query,
+        const FileTable& files,
+        SimdLevel level = best_simd_level()) {
+#if defined(GWMB_X86)
+        if (level == SimdLevel::Avx2) {
+            return detail::evaluate_batch<detail::Avx2Kernels>(query, files);
+        }
+#endif
+        return detail::evaluate_batch<detail::ScalarKernels>(query, files);
+    }
+
+} // namespace gwmb
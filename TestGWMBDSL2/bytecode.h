@@ -0,0 +1,316 @@
+//
+//  bytecode.h
+//
+//  Stack bytecode for compiled queries and its interpreter.
+//
+
+#pragma once
+
+#include "query.h"
+#include "version_store.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define GWMB_COMPUTED_GOTO 1
+#endif
+
+namespace gwmb {
+
+    /*
+     * Instructions
+     */
+    enum class Instr : uint8_t {
+        Const,      // push operand
+        Hash,       // push field of slot `operand` (the slot itself if missing)
+        Size,
+        Fname0,
+        Fname1,
+        Fname,
+        Exists,     // push whether slot `operand` is present
+        ExistsSet,  // push whether every slot of mask `operand` is present
+        Not,
+        Bool,       // top = top != 0
+        Equal,
+        NotEqual,
+        GreaterEqual,
+        LessEqual,
+        Greater,
+        Less,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Mod,
+        OrJump,     // if top != 0: top = 1, jump to `operand`; else pop
+        AndJump,    // if top == 0: jump to `operand`; else pop
+        Return,
+    };
+
+    struct Instruction {
+        Instr op;
+        int operand = 0;
+    };
+
+    /*
+     * Bytecode program
+     */
+
+    // Lowered from a CompiledQuery with the same semantics as
+    // CompiledQuery::evaluate_short_circuit: `and`/`or` jump over the operand
+    // they do not need, in the operand order chosen by the compiler. An `and`
+    // of `exists` tests on slots below 64 becomes a single mask test.
+    class BytecodeProgram {
+    public:
+        BytecodeProgram() = default;
+
+        explicit BytecodeProgram(const CompiledQuery& query) {
+            if (query.empty()) { return; }
+            size_t depth = 0;
+            lower(query, query.root(), depth);
+            code_.push_back(Instruction{ Instr::Return });
+        }
+
+        bool empty() const { return code_.empty(); }
+
+        const std::vector<Instruction>& code() const { return code_; }
+
+        // Deepest operand stack the program needs
+        size_t max_depth() const { return max_depth_; }
+
+        int evaluate(const FileVersionStore& versions) const {
+            if (code_.empty()) { return 0; }
+
+            int local[32];
+            std::vector<int> heap;
+            int* sp = local;
+            if (max_depth_ > sizeof(local) / sizeof(local[0])) {
+                heap.resize(max_depth_);
+                sp = heap.data();
+            }
+
+            const auto* code = code_.data();
+            const auto* pc = code;
+            const Instruction* ip = nullptr;
+
+#if defined(GWMB_COMPUTED_GOTO)
+            static const void* const labels[] = {
+                &&op_Const, &&op_Hash, &&op_Size, &&op_Fname0, &&op_Fname1,
+                &&op_Fname, &&op_Exists, &&op_ExistsSet, &&op_Not, &&op_Bool,
+                &&op_Equal, &&op_NotEqual, &&op_GreaterEqual, &&op_LessEqual,
+                &&op_Greater, &&op_Less, &&op_Add, &&op_Sub, &&op_Mul, &&op_Div,
+                &&op_Mod, &&op_OrJump, &&op_AndJump, &&op_Return,
+            };
+            static_assert(sizeof(labels) / sizeof(labels[0]) ==
+                static_cast<size_t>(Instr::Return) + 1, "one label per instruction");
+#define GWMB_OP(name) op_##name:
+#define GWMB_NEXT() do { ip = pc++; goto *labels[static_cast<size_t>(ip->op)]; } while (0)
+            GWMB_NEXT();
+#else
+#define GWMB_OP(name) case Instr::name:
+#define GWMB_NEXT() break
+            for (;;) {
+                ip = pc++;
+                switch (ip->op) {
+#endif
+                GWMB_OP(Const)
+                    *sp++ = ip->operand;
+                    GWMB_NEXT();
+                GWMB_OP(Hash) {
+                    auto slot = ip->operand;
+                    *sp++ = versions.contains(slot) ? versions.hash(slot) : slot;
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Size) {
+                    auto slot = ip->operand;
+                    *sp++ = versions.contains(slot) ? versions.size(slot) : slot;
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Fname0) {
+                    auto slot = ip->operand;
+                    *sp++ = versions.contains(slot) ? versions.fname0(slot) : slot;
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Fname1) {
+                    auto slot = ip->operand;
+                    *sp++ = versions.contains(slot) ? versions.fname1(slot) : slot;
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Fname) {
+                    auto slot = ip->operand;
+                    *sp++ = versions.contains(slot) ? versions.fname(slot) : slot;
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Exists)
+                    *sp++ = static_cast<int>(versions.contains(ip->operand));
+                    GWMB_NEXT();
+                GWMB_OP(ExistsSet) {
+                    auto mask = masks_[static_cast<size_t>(ip->operand)];
+                    *sp++ = static_cast<int>((versions.presence(0) & mask) == mask);
+                    GWMB_NEXT();
+                }
+                GWMB_OP(Not)
+                    sp[-1] = static_cast<int>(sp[-1] == 0);
+                    GWMB_NEXT();
+                GWMB_OP(Bool)
+                    sp[-1] = static_cast<int>(sp[-1] != 0);
+                    GWMB_NEXT();
+                GWMB_OP(Equal)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] == sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(NotEqual)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] != sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(GreaterEqual)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] >= sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(LessEqual)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] <= sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Greater)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] > sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Less)
+                    sp--;
+                    sp[-1] = static_cast<int>(sp[-1] < sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Add)
+                    sp--;
+                    sp[-1] = wrap_add(sp[-1], sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Sub)
+                    sp--;
+                    sp[-1] = wrap_sub(sp[-1], sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Mul)
+                    sp--;
+                    sp[-1] = wrap_mul(sp[-1], sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Div)
+                    sp--;
+                    if (sp[0] == 0) { throw std::runtime_error("Division by zero"); }
+                    sp[-1] = wrap_div(sp[-1], sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(Mod)
+                    sp--;
+                    if (sp[0] == 0) { throw std::runtime_error("Modulo by zero"); }
+                    sp[-1] = wrap_mod(sp[-1], sp[0]);
+                    GWMB_NEXT();
+                GWMB_OP(OrJump)
+                    if (sp[-1] != 0) {
+                        sp[-1] = 1;
+                        pc = code + ip->operand;
+                    }
+                    else {
+                        sp--;
+                    }
+                    GWMB_NEXT();
+                GWMB_OP(AndJump)
+                    if (sp[-1] == 0) {
+                        pc = code + ip->operand;
+                    }
+                    else {
+                        sp--;
+                    }
+                    GWMB_NEXT();
+                GWMB_OP(Return)
+                    return sp[-1];
+#if !defined(GWMB_COMPUTED_GOTO)
+                }
+            }
+#endif
+#undef GWMB_OP
+#undef GWMB_NEXT
+        }
+
+    private:
+        void emit(Instr op, int operand, size_t& depth, int effect) {
+            code_.push_back(Instruction{ op, operand });
+            depth = static_cast<size_t>(static_cast<int>(depth) + effect);
+            if (depth > max_depth_) { max_depth_ = depth; }
+        }
+
+        // Collects the slots of an `and` tree made only of `exists` tests.
+        static bool collect_exists(const CompiledQuery& query, NodeId id, uint64_t& mask) {
+            const auto& node = query.nodes()[id];
+            if (node.op == OpCode::Exists) {
+                if (node.value < 0 || node.value >= 64) { return false; }
+                mask |= uint64_t(1) << node.value;
+                return true;
+            }
+            return node.op == OpCode::And &&
+                collect_exists(query, node.lhs, mask) &&
+                collect_exists(query, node.rhs, mask);
+        }
+
+        void lower(const CompiledQuery& query, NodeId id, size_t& depth) {
+            static const Instr fields[] = { Instr::Hash, Instr::Size,
+                Instr::Fname0, Instr::Fname1, Instr::Fname };
+            static const Instr binaries[] = { Instr::Equal, Instr::NotEqual,
+                Instr::GreaterEqual, Instr::LessEqual, Instr::Greater, Instr::Less,
+                Instr::Add, Instr::Sub, Instr::Mul, Instr::Div, Instr::Mod };
+
+            const auto& node = query.nodes()[id];
+            switch (node.op) {
+            case OpCode::Constant:
+                emit(Instr::Const, node.value, depth, 1);
+                break;
+            case OpCode::Hash:
+            case OpCode::Size:
+            case OpCode::Fname0:
+            case OpCode::Fname1:
+            case OpCode::Fname:
+                emit(fields[static_cast<size_t>(node.op) - static_cast<size_t>(OpCode::Hash)],
+                    node.value, depth, 1);
+                break;
+            case OpCode::Exists:
+                emit(Instr::Exists, node.value, depth, 1);
+                break;
+            case OpCode::Not:
+                lower(query, node.lhs, depth);
+                emit(Instr::Not, 0, depth, 0);
+                break;
+            case OpCode::Or:
+            case OpCode::And: {
+                uint64_t mask = 0;
+                if (node.op == OpCode::And && collect_exists(query, id, mask)) {
+                    masks_.push_back(mask);
+                    emit(Instr::ExistsSet, static_cast<int>(masks_.size() - 1), depth, 1);
+                    break;
+                }
+
+                auto first = node.lhs;
+                auto second = node.rhs;
+                if (query.rhs_first(id)) { std::swap(first, second); }
+
+                lower(query, first, depth);
+                auto jump = code_.size();
+                emit(node.op == OpCode::Or ? Instr::OrJump : Instr::AndJump, 0, depth, -1);
+                lower(query, second, depth);
+                emit(Instr::Bool, 0, depth, 0);
+                code_[jump].operand = static_cast<int>(code_.size());
+                break;
+            }
+            default:
+                lower(query, node.lhs, depth);
+                lower(query, node.rhs, depth);
+                emit(binaries[static_cast<size_t>(node.op) - static_cast<size_t>(OpCode::Equal)],
+                    0, depth, -1);
+                break;
+            }
+        }
+
+        std::vector<Instruction> code_;
+        std::vector<uint64_t> masks_;
+        size_t max_depth_ = 0;
+    };
+
+} // namespace gwmb
@@ -0,0 +1,417 @@
+//
+//  jit.h
+//
+//  Native x86-64 code generation for compiled queries.
+//
+
+#pragma once
+
+#include "query.h"
+#include "version_store.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if !defined(GWMB_NO_JIT) && (defined(__x86_64__) || defined(_M_X64))
+#define GWMB_JIT 1
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace gwmb {
+
+    // What generated code reads: the columns of one FileVersionStore. The
+    // code reports a failed division through `error` instead of throwing.
+    struct JitFrame {
+        const int* hash;
+        const int* size;
+        const int* fname0;
+        const int* fname1;
+        const uint64_t* present;
+        uint64_t slot_count;
+        int error;
+    };
+
+    static_assert(offsetof(JitFrame, error) < 128, "frame fields use 8-bit displacements");
+
+    inline constexpr bool jit_supported() {
+#if defined(GWMB_JIT)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /*
+     * x86-64 emitter
+     */
+
+    // Just the instructions the query code generator needs. The frame
+    // pointer lives in rbx; eax holds the value of the node being generated
+    // and ecx the right operand of a binary node.
+    class X86Emitter {
+    public:
+        const std::vector<uint8_t>& bytes() const { return bytes_; }
+
+        size_t size() const { return bytes_.size(); }
+
+        void emit(std::initializer_list<uint8_t> bytes) {
+            bytes_.insert(bytes_.end(), bytes);
+        }
+
+        void emit32(int32_t value) {
+            uint8_t raw[4];
+            std::memcpy(raw, &value, sizeof(raw));
+            bytes_.insert(bytes_.end(), raw, raw + sizeof(raw));
+        }
+
+        // Emits a rel32 jump or conditional jump (0x0F 0x8x) and returns the
+        // position of its displacement, to be set by `bind`.
+        size_t jump() {
+            emit({ 0xE9 });
+            return placeholder();
+        }
+
+        size_t jump_if(uint8_t condition) {
+            emit({ 0x0F, condition });
+            return placeholder();
+        }
+
+        void bind(size_t at, size_t target) {
+            auto rel = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+            std::memcpy(&bytes_[at], &rel, sizeof(rel));
+        }
+
+        void bind(size_t at) { bind(at, bytes_.size()); }
+
+    private:
+        size_t placeholder() {
+            auto at = bytes_.size();
+            emit32(0);
+            return at;
+        }
+
+        std::vector<uint8_t> bytes_;
+    };
+
+    /*
+     * JIT query
+     */
+
+    // A compiled query turned into a native function. `evaluate` matches
+    // CompiledQuery::evaluate: `and`/`or` combine both operands without
+    // branching, and a division or modulo by zero anywhere throws. When the
+    // platform has no JIT, or it is disabled, the tree interpreter runs
+    // instead.
+    class JitQuery {
+    public:
+        JitQuery() = default;
+
+        explicit JitQuery(const CompiledQuery& query, bool enable = jit_supported())
+            : query_(query) {
+            if (enable && !query.empty()) {
+                install(generate(query));
+            }
+        }
+
+        JitQuery(const JitQuery&) = delete;
+        JitQuery& operator=(const JitQuery&) = delete;
+
+        JitQuery(JitQuery&& other) noexcept
+            : query_(std::move(other.query_)),
+            code_(std::exchange(other.code_, nullptr)),
+            code_size_(std::exchange(other.code_size_, 0)) {}
+
+        JitQuery& operator=(JitQuery&& other) noexcept {
+            if (this != &other) {
+                release();
+                query_ = std::move(other.query_);
+                code_ = std::exchange(other.code_, nullptr);
+                code_size_ = std::exchange(other.code_size_, 0);
+            }
+            return *this;
+        }
+
+        ~JitQuery() { release(); }
+
+        // Whether native code is in use
+        bool native() const { return code_ != nullptr; }
+
+        size_t code_size() const { return code_size_; }
+
+        int evaluate(const FileVersionStore& versions) const {
+            if (!code_) { return query_.evaluate(versions); }
+
+            JitFrame frame{ versions.hash_data(), versions.size_data(),
+                versions.fname0_data(), versions.fname1_data(),
+                versions.presence_data(), versions.slot_count(), 0 };
+            auto result = reinterpret_cast<int (*)(JitFrame*)>(code_)(&frame);
+            if (frame.error == 1) { throw std::runtime_error("Division by zero"); }
+            if (frame.error == 2) { throw std::runtime_error("Modulo by zero"); }
+            return result;
+        }
+
+    private:
+        static uint8_t frame_offset(size_t offset) { return static_cast<uint8_t>(offset); }
+
+        static std::vector<uint8_t> generate(const CompiledQuery& query) {
+            X86Emitter x;
+            std::vector<size_t> div_errors;
+            std::vector<size_t> mod_errors;
+
+            // push rbp; mov rbp, rsp; push rbx; mov rbx, <first argument>
+            x.emit({ 0x55, 0x48, 0x89, 0xE5, 0x53 });
+#if defined(_WIN32)
+            x.emit({ 0x48, 0x89, 0xCB });
+#else
+            x.emit({ 0x48, 0x89, 0xFB });
+#endif
+            generate_node(x, query, query.root(), div_errors, mod_errors);
+            emit_epilogue(x);
+
+            auto error_stub = [&](const std::vector<size_t>& jumps, int32_t code) {
+                if (jumps.empty()) { return; }
+                for (auto at : jumps) { x.bind(at); }
+                // mov dword [rbx + error], code; xor eax, eax
+                x.emit({ 0xC7, 0x43, frame_offset(offsetof(JitFrame, error)) });
+                x.emit32(code);
+                x.emit({ 0x31, 0xC0 });
+                emit_epilogue(x);
+                };
+            error_stub(div_errors, 1);
+            error_stub(mod_errors, 2);
+            return x.bytes();
+        }
+
+        static void emit_epilogue(X86Emitter& x) {
+            // lea rsp, [rbp - 8]; pop rbx; pop rbp; ret
+            x.emit({ 0x48, 0x8D, 0x65, 0xF8, 0x5B, 0x5D, 0xC3 });
+        }
+
+        // Leaves rcx = slot and the slot's presence bit in CF. Jumps recorded
+        // in `missing` are taken when the slot is past the end of the store.
+        // Clobbers rax and rdx.
+        static void emit_presence_check(X86Emitter& x, int slot, std::vector<size_t>& missing) {
+            // mov ecx, slot; cmp rcx, [rbx + slot_count]; jae missing
+            x.emit({ 0xB9 });
+            x.emit32(slot);
+            x.emit({ 0x48, 0x3B, 0x4B, frame_offset(offsetof(JitFrame, slot_count)) });
+            missing.push_back(x.jump_if(0x83));
+            // mov rdx, rcx; shr rdx, 6; mov rax, [rbx + present];
+            // mov rdx, [rax + rdx * 8]; bt rdx, rcx
+            x.emit({ 0x48, 0x89, 0xCA, 0x48, 0xC1, 0xEA, 0x06 });
+            x.emit({ 0x48, 0x8B, 0x43, frame_offset(offsetof(JitFrame, present)) });
+            x.emit({ 0x48, 0x8B, 0x14, 0xD0, 0x48, 0x0F, 0xA3, 0xCA });
+        }
+
+        static void emit_column_load(X86Emitter& x, size_t column, bool into_edx) {
+            // mov rdx, [rbx + column]; mov eax|edx, [rdx + rcx * 4]
+            x.emit({ 0x48, 0x8B, 0x53, frame_offset(column) });
+            x.emit({ 0x8B, static_cast<uint8_t>(into_edx ? 0x14 : 0x04), 0x8A });
+        }
+
+        static void emit_bool(X86Emitter& x, uint8_t setcc) {
+            // setcc al; movzx eax, al
+            x.emit({ 0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0 });
+        }
+
+        static void generate_node(X86Emitter& x, const CompiledQuery& query, NodeId id,
+            std::vector<size_t>& div_errors, std::vector<size_t>& mod_errors) {
+            const auto& node = query.nodes()[id];
+            switch (node.op) {
+            case OpCode::Constant:
+                x.emit({ 0xB8 });
+                x.emit32(node.value);
+                return;
+            case OpCode::Hash:
+            case OpCode::Size:
+            case OpCode::Fname0:
+            case OpCode::Fname1:
+            case OpCode::Fname: {
+                // A negative slot is never present (it would be slot 2^31+)
+                if (node.value < 0) {
+                    x.emit({ 0xB8 });
+                    x.emit32(node.value);
+                    return;
+                }
+
+                std::vector<size_t> missing;
+                emit_presence_check(x, node.value, missing);
+                // jnc missing
+                missing.push_back(x.jump_if(0x83));
+                if (node.op == OpCode::Fname) {
+                    // eax = ((fname0 & 0xFFFF) << 16) | (fname1 & 0xFFFF)
+                    emit_column_load(x, offsetof(JitFrame, fname0), false);
+                    x.emit({ 0x25 });
+                    x.emit32(0xFFFF);
+                    x.emit({ 0xC1, 0xE0, 0x10 });
+                    emit_column_load(x, offsetof(JitFrame, fname1), true);
+                    x.emit({ 0x81, 0xE2 });
+                    x.emit32(0xFFFF);
+                    x.emit({ 0x09, 0xD0 });
+                }
+                else {
+                    auto column =
+                        node.op == OpCode::Hash ? offsetof(JitFrame, hash)
+                        : node.op == OpCode::Size ? offsetof(JitFrame, size)
+                        : node.op == OpCode::Fname0 ? offsetof(JitFrame, fname0)
+                        : offsetof(JitFrame, fname1);
+                    emit_column_load(x, column, false);
+                }
+                auto done = x.jump();
+                for (auto at : missing) { x.bind(at); }
+                x.emit({ 0xB8 });
+                x.emit32(node.value);
+                x.bind(done);
+                return;
+            }
+            case OpCode::Exists: {
+                // xor eax, eax
+                x.emit({ 0x31, 0xC0 });
+                if (node.value < 0) { return; }
+                std::vector<size_t> missing;
+                emit_presence_check(x, node.value, missing);
+                // setc al; movzx eax, al
+                emit_bool(x, 0x92);
+                for (auto at : missing) { x.bind(at); }
+                return;
+            }
+            case OpCode::Not:
+                generate_node(x, query, node.lhs, div_errors, mod_errors);
+                x.emit({ 0x85, 0xC0 });
+                emit_bool(x, 0x94);
+                return;
+            default:
+                break;
+            }
+
+            // Binary: eax = lhs, ecx = rhs
+            generate_node(x, query, node.lhs, div_errors, mod_errors);
+            const auto& rhs = query.nodes()[node.rhs];
+            if (rhs.op == OpCode::Constant) {
+                x.emit({ 0xB9 });
+                x.emit32(rhs.value);
+            }
+            else {
+                x.emit({ 0x50 });
+                generate_node(x, query, node.rhs, div_errors, mod_errors);
+                // mov ecx, eax; pop rax
+                x.emit({ 0x89, 0xC1, 0x58 });
+            }
+
+            switch (node.op) {
+            case OpCode::Or:
+                // or eax, ecx; setne al
+                x.emit({ 0x09, 0xC8 });
+                emit_bool(x, 0x95);
+                break;
+            case OpCode::And:
+                // test eax, eax; setne al; test ecx, ecx; setne cl; and al, cl
+                x.emit({ 0x85, 0xC0, 0x0F, 0x95, 0xC0, 0x85, 0xC9, 0x0F, 0x95, 0xC1, 0x20, 0xC8 });
+                x.emit({ 0x0F, 0xB6, 0xC0 });
+                break;
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::GreaterEqual:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::Less: {
+                static const uint8_t setcc[] = { 0x94, 0x95, 0x9D, 0x9E, 0x9F, 0x9C };
+                // cmp eax, ecx
+                x.emit({ 0x39, 0xC8 });
+                emit_bool(x, setcc[static_cast<size_t>(node.op) - static_cast<size_t>(OpCode::Equal)]);
+                break;
+            }
+            case OpCode::Add:
+                x.emit({ 0x01, 0xC8 });
+                break;
+            case OpCode::Sub:
+                x.emit({ 0x29, 0xC8 });
+                break;
+            case OpCode::Mul:
+                x.emit({ 0x0F, 0xAF, 0xC1 });
+                break;
+            case OpCode::Div:
+            case OpCode::Mod: {
+                auto is_div = node.op == OpCode::Div;
+                // test ecx, ecx; jz error
+                x.emit({ 0x85, 0xC9 });
+                (is_div ? div_errors : mod_errors).push_back(x.jump_if(0x84));
+                // cmp ecx, -1; jne divide; INT_MIN / -1 would trap, so negate
+                x.emit({ 0x83, 0xF9, 0xFF });
+                auto divide = x.jump_if(0x85);
+                if (is_div) {
+                    x.emit({ 0xF7, 0xD8 });
+                }
+                else {
+                    x.emit({ 0x31, 0xC0 });
+                }
+                auto done = x.jump();
+                x.bind(divide);
+                // cdq; idiv ecx
+                x.emit({ 0x99, 0xF7, 0xF9 });
+                if (!is_div) {
+                    x.emit({ 0x89, 0xD0 });
+                }
+                x.bind(done);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        void install(const std::vector<uint8_t>& bytes) {
+#if defined(GWMB_JIT) && defined(_WIN32)
+            auto memory = VirtualAlloc(nullptr, bytes.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (!memory) { return; }
+            std::memcpy(memory, bytes.data(), bytes.size());
+            DWORD old_protect = 0;
+            if (!VirtualProtect(memory, bytes.size(), PAGE_EXECUTE_READ, &old_protect)) {
+                VirtualFree(memory, 0, MEM_RELEASE);
+                return;
+            }
+            FlushInstructionCache(GetCurrentProcess(), memory, bytes.size());
+            code_ = memory;
+            code_size_ = bytes.size();
+#elif defined(GWMB_JIT)
+            auto memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) { return; }
+            std::memcpy(memory, bytes.data(), bytes.size());
+            if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, bytes.size());
+                return;
+            }
+            code_ = memory;
+            code_size_ = bytes.size();
+#else
+            (void)bytes;
+#endif
+        }
+
+        void release() {
+            if (!code_) { return; }
+#if defined(GWMB_JIT) && defined(_WIN32)
+            VirtualFree(code_, 0, MEM_RELEASE);
+#elif defined(GWMB_JIT)
+            munmap(code_, code_size_);
+#endif
+            code_ = nullptr;
+            code_size_ = 0;
+        }
+
+        CompiledQuery query_;
+        void* code_ = nullptr;
+        size_t code_size_ = 0;
+    };
+
+} // namespace gwmb
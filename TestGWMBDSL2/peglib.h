@@ -17,11 +17,14 @@
 
 #include <algorithm>
 #include <any>
+#include <array>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
+#include <cstddef>
 #include <cstring>
 #include <functional>
 #include <initializer_list>
@@ -32,11 +35,29 @@
 #include <mutex>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPPPEGLIB_SSE2 1
+#include <emmintrin.h>
+#define CPPPEGLIB_AVX2 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define CPPPEGLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CPPPEGLIB_TARGET_AVX2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
 #if !defined(__cplusplus) || __cplusplus < 201703L
 #error "Requires complete C++17 support"
 #endif
@@ -386,62 +407,147 @@ namespace peg {
         return n;
         }
 
+    /*-----------------------------------------------------------------------------
+     *  token_to_integer_
+     *---------------------------------------------------------------------------*/
+
+    // Reads the base 10 or 16 digits at the front of `sv` straight from the
+    // input. Base 16 skips a "0x" or "0X" that is followed by a digit, as
+    // std::stoi does. Returns the number of characters read, 0 if there are no
+    // digits, or -1 if the value does not fit in T. `n` is only set on success.
+    template <typename T>
+    std::ptrdiff_t token_to_integer_(std::string_view sv, T& n, int base = 10) {
+        static_assert(std::is_integral<T>::value, "token_to_integer_ needs an integer type");
+        constexpr auto max = (std::numeric_limits<T>::max)();
+        size_t i = 0;
+        int v = 0;
+        if (base == 16 && sv.size() > 2 && sv[0] == '0' && (sv[1] == 'x' || sv[1] == 'X') &&
+            is_hex(sv[2], v)) {
+            i = 2;
+        }
+        auto start = i;
+        T r = 0;
+        while (i < sv.size() && (base == 16 ? is_hex(sv[i], v) : is_digit(sv[i], v))) {
+            if (r > (max - v) / base) { return -1; }
+            r = static_cast<T>(r * base + v);
+            i++;
+        }
+        if (i == start) { return 0; }
+        n = r;
+        return static_cast<std::ptrdiff_t>(i);
+    }
+
+    // The error for an integer token that token_to_integer_ cannot fit, at
+    // the token's line and column.
+    inline std::out_of_range integer_out_of_range(std::pair<size_t, size_t> line,
+        std::string_view token) {
+        return std::out_of_range(std::to_string(line.first) + ":" +
+            std::to_string(line.second) + ": number '" + std::string(token) +
+            "' is out of range.");
+    }
+
     /*-----------------------------------------------------------------------------
      *  Trie
      *---------------------------------------------------------------------------*/
 
+    // A double-array trie: the states live in one flat array, and the state
+    // after byte `ch` is `base + ch` of the current state if that unit's check
+    // names the current state. Matching is one array step per input byte, with
+    // the bytes folded to lower case first when the trie ignores case.
     class Trie {
     public:
         Trie() = default;
         Trie(const Trie&) = default;
 
-        Trie(const std::vector<std::string>& items) {
+        Trie(const std::vector<std::string>& items, bool ignore_case = false)
+            : ignore_case_(ignore_case) {
+            // The prefix tree of the items, with each node's children by byte
+            std::vector<std::map<unsigned char, size_t>> children(1);
+            std::vector<bool> accept(1, false);
             for (const auto& item : items) {
-                for (size_t len = 1; len <= item.size(); len++) {
-                    auto last = len == item.size();
-                    std::string_view sv(item.data(), len);
-                    auto it = dic_.find(sv);
-                    if (it == dic_.end()) {
-                        dic_.emplace(sv, Info{ last, last });
+                size_t node = 0;
+                for (auto ch : item) {
+                    auto [it, inserted] = children[node].emplace(fold(ch), children.size());
+                    if (inserted) {
+                        children.emplace_back();
+                        accept.push_back(false);
                     }
-                    else if (last) {
-                        it->second.match = true;
-                    }
-                    else {
-                        it->second.done = false;
+                    node = it->second;
+                }
+                if (node != 0) { accept[node] = true; }
+            }
+
+            // Place each node's children at the first base where all of their
+            // units are free, breadth first from the root at unit 0
+            units_.resize(1);
+            std::vector<std::pair<size_t, uint32_t>> queue = { {0, 0} };
+            size_t first_free = 1;
+            for (size_t i = 0; i < queue.size(); i++) {
+                auto node = queue[i].first;
+                auto state = queue[i].second;
+                if (children[node].empty()) { continue; }
+
+                auto lowest = children[node].begin()->first;
+                size_t base = first_free > lowest ? first_free - lowest : 0;
+                auto fits = [&](size_t at) {
+                    for (const auto& [ch, child] : children[node]) {
+                        auto next = at + ch;
+                        if (next == 0) { return false; }
+                        if (next < units_.size() && units_[next].check != unused) {
+                            return false;
+                        }
                     }
+                    return true;
+                    };
+                while (!fits(base)) { base++; }
+
+                units_[state].base = static_cast<uint32_t>(base);
+                units_.resize(std::max(units_.size(),
+                    base + children[node].rbegin()->first + 1));
+                for (const auto& [ch, child] : children[node]) {
+                    auto next = base + ch;
+                    units_[next].check = state;
+                    units_[next].accept = accept[child];
+                    queue.emplace_back(child, static_cast<uint32_t>(next));
+                }
+                while (first_free < units_.size() && units_[first_free].check != unused) {
+                    first_free++;
                 }
             }
         }
 
         size_t match(const char* text, size_t text_len) const {
+            if (units_.empty()) { return 0; }
+
             size_t match_len = 0;
-            auto done = false;
-            size_t len = 1;
-            while (!done && len <= text_len) {
-                std::string_view sv(text, len);
-                auto it = dic_.find(sv);
-                if (it == dic_.end()) {
-                    done = true;
-                }
-                else {
-                    if (it->second.match) { match_len = len; }
-                    if (it->second.done) { done = true; }
-                }
-                len += 1;
+            uint32_t state = 0;
+            for (size_t len = 0; len < text_len; len++) {
+                size_t next = size_t(units_[state].base) + fold(text[len]);
+                if (next >= units_.size() || units_[next].check != state) { break; }
+                state = static_cast<uint32_t>(next);
+                if (units_[state].accept) { match_len = len + 1; }
             }
             return match_len;
         }
 
+        bool ignore_case() const { return ignore_case_; }
+
     private:
-        struct Info {
-            bool done;
-            bool match;
+        static constexpr uint32_t unused = std::numeric_limits<uint32_t>::max();
+
+        struct Unit {
+            uint32_t base = 0;
+            uint32_t check = unused;
+            bool accept = false;
         };
 
-        // TODO: Use unordered_map when heterogeneous lookup is supported in C++20
-        // std::unordered_map<std::string, Info> dic_;
-        std::map<std::string, Info, std::less<>> dic_;
+        unsigned char fold(char ch) const {
+            auto b = static_cast<unsigned char>(ch);
+            return ignore_case_ ? static_cast<unsigned char>(std::tolower(b)) : b;
+        }
+
+        std::vector<Unit> units_;
+        bool ignore_case_ = false;
     };
 
     /*-----------------------------------------------------------------------------
@@ -496,6 +602,28 @@ namespace peg {
      */
     class Context;
 
+    // Largest value a typed_parser stores unboxed
+    inline constexpr size_t max_typed_value_size = 16;
+
+    // Unboxed semantic values of a typed_parser, in the order of the rules
+    // that produced them
+    template <typename T> class TypedValues {
+    public:
+        TypedValues(const T* data, size_t size) : data_(data), size_(size) {}
+
+        const T* begin() const { return data_; }
+        const T* end() const { return data_ + size_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const T& operator[](size_t i) const { return data_[i]; }
+        const T& front() const { return data_[0]; }
+        const T& back() const { return data_[size_ - 1]; }
+
+    private:
+        const T* data_;
+        size_t size_;
+    };
+
     struct SemanticValues : protected std::vector<std::any> {
         SemanticValues() = default;
         SemanticValues(Context* c) : c_(c) {}
@@ -539,6 +667,16 @@ namespace peg {
             return token_to_number_<T>(token());
         }
 
+        // Converts a base 10 or 16 integer token without copying it. Throws
+        // std::out_of_range, with the line and column, if it does not fit in T.
+        template <typename T> T token_to_integer(int base = 10, size_t id = 0) const {
+            T n = 0;
+            if (token_to_integer_(token(id), n, base) < 0) {
+                throw integer_out_of_range(line_info(), token(id));
+            }
+            return n;
+        }
+
         // Transform the semantic value vector to another vector
         template <typename T>
         std::vector<T> transform(size_t beg = 0,
@@ -551,11 +689,20 @@ namespace peg {
             return r;
         }
 
+        // Values stored unboxed by a typed_parser<T>
+        template <typename T> TypedValues<T> typed_values() const {
+            return TypedValues<T>(reinterpret_cast<const T*>(typed_.data()),
+                typed_.size() / sizeof(T));
+        }
+
         void append(SemanticValues& chvs) {
             sv_ = chvs.sv_;
             for (auto& v : chvs) {
                 emplace_back(std::move(v));
             }
+            if (!chvs.typed_.empty()) {
+                typed_.insert(typed_.end(), chvs.typed_.begin(), chvs.typed_.end());
+            }
             for (auto& tag : chvs.tags) {
                 tags.emplace_back(std::move(tag));
             }
@@ -593,13 +740,20 @@ namespace peg {
         friend class PrioritizedChoice;
         friend class Repetition;
         friend class Holder;
+        friend class Reference;
         friend class PrecedenceClimbing;
 
+        void push_typed(const void* value, size_t size) {
+            auto bytes = static_cast<const unsigned char*>(value);
+            typed_.insert(typed_.end(), bytes, bytes + size);
+        }
+
         Context* c_ = nullptr;
         std::string_view sv_;
         size_t choice_count_ = 0;
         size_t choice_ = 0;
         std::string name_;
+        std::vector<unsigned char> typed_;
     };
 
     /*
@@ -661,6 +815,11 @@ namespace peg {
         Fty fn_;
     };
 
+    // Action of a typed_parser rule: writes its value to `value`, which has
+    // room for max_typed_value_size bytes
+    using TypedAction =
+        std::function<void(SemanticValues& vs, std::any& dt, void* value)>;
+
     /*
      * Parse result helper
      */
@@ -758,11 +917,192 @@ namespace peg {
 
     using TracerStartOrEnd = std::function<void(std::any& trace_data)>;
 
+    /*
+     * Packrat statistics
+     */
+    enum class PackratMode {
+        All,       // memoize every rule
+        Selected,  // memoize only rules with Definition::memoize set
+    };
+
+    struct PackratRuleStats {
+        size_t hits = 0;    // results served from the memo table
+        size_t misses = 0;  // results parsed and then stored
+
+        double hit_rate() const {
+            auto total = hits + misses;
+            return total ? static_cast<double>(hits) / static_cast<double>(total) : 0.0;
+        }
+    };
+
+    // Indexed by Definition::id. Rules that are not memoized are not counted.
+    using PackratStats = std::vector<PackratRuleStats>;
+
+    /*
+     * ParseOptions
+     */
+    enum class ErrorMode {
+        Log,    // report a failed parse to `log`, if set
+        Throw,  // report it to `log`, if set, then throw parse_error
+    };
+
+    // Per-call settings for parser::parse_with. Unset members do not fall back
+    // to the parser's own logger or tracer.
+    struct ParseOptions {
+        const char* path = nullptr;
+        Log log;
+        ErrorMode error_mode = ErrorMode::Log;
+        TracerEnter tracer_enter;
+        TracerLeave tracer_leave;
+        TracerStartOrEnd tracer_start;
+        TracerStartOrEnd tracer_end;
+        bool verbose_trace = false;
+        PackratStats* packrat_stats = nullptr;
+        // Parse without error tracking, and repeat the parse with it only when
+        // a failure has to be reported to `log` or thrown. The actions of a
+        // failed parse then run twice.
+        bool lazy_errors = false;
+    };
+
+    class parse_error : public std::runtime_error {
+    public:
+        parse_error(size_t line, size_t col, const std::string& msg)
+            : std::runtime_error(std::to_string(line) + ":" + std::to_string(col) +
+                ": " + msg),
+            line(line), col(col) {}
+
+        size_t line;
+        size_t col;
+    };
+
+    /*
+     * Packrat memo
+     */
+
+    // Parse results keyed by `def_count * col + def_id`. Open addressing with
+    // linear probing keeps the length and value in the slot itself, so a hit
+    // is a single probe into one contiguous array. Failures are stored with
+    // a length of -1.
+    class PackratMemo {
+    public:
+        struct Entry {
+            size_t key = empty_key;
+            size_t len = 0;
+            std::any val;
+        };
+
+        // nullptr if the key has not been stored yet
+        const Entry* find(size_t key) const {
+            if (entries_.empty()) { return nullptr; }
+            auto mask = entries_.size() - 1;
+            for (auto i = slot_of(key);; i = (i + 1) & mask) {
+                const auto& entry = entries_[i];
+                if (entry.key == key) { return &entry; }
+                if (entry.key == empty_key) { return nullptr; }
+            }
+        }
+
+        // Unboxed value of a typed_parser stored along with `entry`
+        const void* typed_of(const Entry* entry) const {
+            return typed_[static_cast<size_t>(entry - entries_.data())].bytes;
+        }
+
+        void insert(size_t key, size_t len, const std::any& val,
+            const void* typed = nullptr, size_t typed_size = 0) {
+            if ((size_ + 1) * 2 > entries_.size()) { grow(); }
+            if (typed_size && typed_.size() != entries_.size()) {
+                typed_.resize(entries_.size());
+            }
+            auto& entry = probe(key);
+            if (entry.key == empty_key) {
+                used_.push_back(static_cast<size_t>(&entry - entries_.data()));
+                size_++;
+            }
+            entry.key = key;
+            entry.len = len;
+            entry.val = val;
+            if (typed_size) {
+                std::memcpy(typed_slot(&entry), typed, typed_size);
+            }
+        }
+
+        size_t size() const { return size_; }
+
+        // Forgets every entry but keeps the storage for the next parse. Only
+        // the occupied slots are reset, so a table grown by one long input
+        // costs later short parses nothing.
+        void clear() {
+            for (auto i : used_) {
+                entries_[i].key = empty_key;
+                entries_[i].val.reset();
+            }
+            used_.clear();
+            size_ = 0;
+        }
+
+    private:
+        static constexpr size_t empty_key = static_cast<size_t>(-1);
+        static constexpr size_t initial_capacity = 64;
+
+        struct TypedSlot {
+            alignas(std::max_align_t) unsigned char bytes[max_typed_value_size];
+        };
+
+        void* typed_slot(const Entry* entry) {
+            return typed_[static_cast<size_t>(entry - entries_.data())].bytes;
+        }
+
+        size_t slot_of(size_t key) const {
+            // Fibonacci hashing spreads neighbouring columns across the table
+            return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> shift_);
+        }
+
+        Entry& probe(size_t key) {
+            auto mask = entries_.size() - 1;
+            auto i = slot_of(key);
+            while (entries_[i].key != key && entries_[i].key != empty_key) {
+                i = (i + 1) & mask;
+            }
+            return entries_[i];
+        }
+
+        void grow() {
+            auto old = std::move(entries_);
+            auto old_typed = std::move(typed_);
+            auto capacity = old.empty() ? initial_capacity : old.size() * 2;
+            entries_ = std::vector<Entry>(capacity);
+            if (!old_typed.empty()) { typed_.resize(capacity); }
+            shift_ = 64;
+            for (auto n = capacity; n > 1; n >>= 1) { shift_--; }
+            used_.clear();
+            for (size_t i = 0; i < old.size(); i++) {
+                auto& entry = old[i];
+                if (entry.key != empty_key) {
+                    auto& slot = probe(entry.key);
+                    used_.push_back(static_cast<size_t>(&slot - entries_.data()));
+                    slot.key = entry.key;
+                    slot.len = entry.len;
+                    slot.val = std::move(entry.val);
+                    if (!old_typed.empty()) {
+                        typed_[static_cast<size_t>(&slot - entries_.data())] = old_typed[i];
+                    }
+                }
+            }
+        }
+
+        std::vector<Entry> entries_;
+        std::vector<TypedSlot> typed_;
+        // Indices of the occupied entries
+        std::vector<size_t> used_;
+        size_t size_ = 0;
+        unsigned shift_ = 64;
+    };
+
     class Context {
     public:
-        const char* path;
-        const char* s;
-        const size_t l;
+        const char* path = nullptr;
+        const char* s = nullptr;
+        size_t l = 0;
 
         ErrorInfo error_info;
         bool recovered = false;
@@ -785,43 +1125,94 @@ namespace peg {
 
         std::vector<bool> cut_stack;
 
-        const size_t def_count;
-        const bool enablePackratParsing;
-        std::vector<bool> cache_registered;
-        std::vector<bool> cache_success;
+        size_t def_count = 0;
+        bool enablePackratParsing = false;
+        PackratMode packrat_mode = PackratMode::All;
+        PackratMemo cache;
+        PackratStats* packrat_stats = nullptr;
+
+        // Size of the unboxed values of a typed_parser; 0 for std::any values
+        size_t typed_size = 0;
 
-        std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
-            cache_values;
+        // Whether references inline trivial rules and choices check leading
+        // literals, see InlineTrivialRules and FactorChoicePrefixes
+        bool grammar_optimizations = true;
 
         TracerEnter tracer_enter;
         TracerLeave tracer_leave;
         std::any trace_data;
-        const bool verbose_trace;
+        bool verbose_trace = false;
 
         Log log;
 
+        Context() = default;
+
         Context(const char* path, const char* s, size_t l, size_t def_count,
             std::shared_ptr<Ope> whitespaceOpe, std::shared_ptr<Ope> wordOpe,
             bool enablePackratParsing, TracerEnter tracer_enter,
             TracerLeave tracer_leave, std::any trace_data, bool verbose_trace,
-            Log log)
-            : path(path), s(s), l(l), whitespaceOpe(whitespaceOpe), wordOpe(wordOpe),
-            def_count(def_count), enablePackratParsing(enablePackratParsing),
-            cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
-            cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
-            tracer_enter(tracer_enter), tracer_leave(tracer_leave),
-            trace_data(trace_data), verbose_trace(verbose_trace), log(log) {
+            Log log) {
+            reset(path, s, l, def_count, std::move(whitespaceOpe), std::move(wordOpe),
+                enablePackratParsing, std::move(tracer_enter), std::move(tracer_leave),
+                std::move(trace_data), verbose_trace, std::move(log));
+        }
+
+        // Prepares the context for a new parse. Stacks and tables keep their
+        // storage, so a reused context does not allocate once warmed up.
+        void reset(const char* a_path, const char* a_s, size_t a_l,
+            size_t a_def_count, std::shared_ptr<Ope> a_whitespaceOpe,
+            std::shared_ptr<Ope> a_wordOpe, bool a_enablePackratParsing,
+            TracerEnter a_tracer_enter, TracerLeave a_tracer_leave,
+            std::any a_trace_data, bool a_verbose_trace, Log a_log) {
+            clear();
+
+            path = a_path;
+            s = a_s;
+            l = a_l;
+            def_count = a_def_count;
+            whitespaceOpe = std::move(a_whitespaceOpe);
+            wordOpe = std::move(a_wordOpe);
+            enablePackratParsing = a_enablePackratParsing;
+            tracer_enter = std::move(a_tracer_enter);
+            tracer_leave = std::move(a_tracer_leave);
+            trace_data = std::move(a_trace_data);
+            verbose_trace = a_verbose_trace;
+            log = std::move(a_log);
 
             push_args({});
             push_capture_scope();
         }
 
-        ~Context() {
-            pop_capture_scope();
-
-            assert(!value_stack_size);
-            assert(!capture_scope_stack_size);
-            assert(cut_stack.empty());
+        // Drops the state of the last parse, including one abandoned by an
+        // exception, and the references it held to the grammar and callbacks.
+        void clear() {
+            error_info.clear();
+            error_info.label.clear();
+            error_info.last_output_pos = nullptr;
+            error_info.keep_previous_token = false;
+            recovered = false;
+            value_stack_size = 0;
+            rule_stack.clear();
+            args_stack.clear();
+            in_token_boundary_count = 0;
+            whitespaceOpe.reset();
+            in_whitespace = false;
+            wordOpe.reset();
+            capture_scope_stack_size = 0;
+            cut_stack.clear();
+            packrat_mode = PackratMode::All;
+            cache.clear();
+            packrat_stats = nullptr;
+            typed_size = 0;
+            grammar_optimizations = true;
+            tracer_enter = nullptr;
+            tracer_leave = nullptr;
+            trace_data.reset();
+            log = nullptr;
+            next_trace_id = 0;
+            trace_ids.clear();
+            ignore_trace_state = false;
+            source_line_index.clear();
         }
 
         Context(const Context&) = delete;
@@ -829,9 +1220,10 @@ namespace peg {
         Context operator=(const Context&) = delete;
 
         template <typename T>
-        void packrat(const char* a_s, size_t def_id, size_t& len, std::any& val,
-            T fn) {
-            if (!enablePackratParsing) {
+        void packrat(const char* a_s, size_t def_id, bool memoize, size_t& len,
+            std::any& val, void* typed, T fn) {
+            if (!enablePackratParsing ||
+                (packrat_mode == PackratMode::Selected && !memoize)) {
                 fn(val);
                 return;
             }
@@ -839,24 +1231,27 @@ namespace peg {
             auto col = a_s - s;
             auto idx = def_count * static_cast<size_t>(col) + def_id;
 
-            if (cache_registered[idx]) {
-                if (cache_success[idx]) {
-                    auto key = std::pair(col, def_id);
-                    std::tie(len, val) = cache_values[key];
-                    return;
-                }
-                else {
-                    len = static_cast<size_t>(-1);
-                    return;
+            if (auto entry = cache.find(idx)) {
+                if (packrat_stats) { (*packrat_stats)[def_id].hits++; }
+                len = entry->len;
+                if (success(len)) {
+                    if (typed_size) {
+                        std::memcpy(typed, cache.typed_of(entry), typed_size);
+                    }
+                    else {
+                        val = entry->val;
+                    }
                 }
+                return;
             }
             else {
                 fn(val);
-                cache_registered[idx] = true;
-                cache_success[idx] = success(len);
+                if (packrat_stats) { (*packrat_stats)[def_id].misses++; }
                 if (success(len)) {
-                    auto key = std::pair(col, def_id);
-                    cache_values[key] = std::pair(len, val);
+                    cache.insert(idx, len, val, typed, typed_size);
+                }
+                else {
+                    cache.insert(idx, static_cast<size_t>(-1), std::any());
                 }
                 return;
             }
@@ -880,14 +1275,13 @@ namespace peg {
             }
             else {
                 auto& vs = *value_stack[value_stack_size];
-                if (!vs.empty()) {
-                    vs.clear();
-                    if (!vs.tags.empty()) { vs.tags.clear(); }
-                }
+                if (!vs.empty()) { vs.clear(); }
+                if (!vs.tags.empty()) { vs.tags.clear(); }
                 vs.sv_ = std::string_view();
                 vs.choice_count_ = 0;
                 vs.choice_ = 0;
                 if (!vs.tokens.empty()) { vs.tokens.clear(); }
+                if (!vs.typed_.empty()) { vs.typed_.clear(); }
             }
 
             auto& vs = *value_stack[value_stack_size++];
@@ -946,12 +1340,12 @@ namespace peg {
 
         // Line info
         std::pair<size_t, size_t> line_info(const char* cur) const {
-            std::call_once(source_line_index_init_, [this]() {
+            if (source_line_index.empty()) {
                 for (size_t pos = 0; pos < l; pos++) {
                     if (s[pos] == '\n') { source_line_index.push_back(pos); }
                 }
                 source_line_index.push_back(l);
-                });
+            }
 
             auto pos = static_cast<size_t>(std::distance(s, cur));
 
@@ -967,10 +1361,61 @@ namespace peg {
         size_t next_trace_id = 0;
         std::vector<size_t> trace_ids;
         bool ignore_trace_state = false;
-        mutable std::once_flag source_line_index_init_;
         mutable std::vector<size_t> source_line_index;
     };
 
+    /*
+     * Context pool
+     */
+
+    // Contexts are kept per thread and reset between parses instead of being
+    // rebuilt. A parse started from an action of another parse on the same
+    // thread simply takes a second context.
+    class ContextPool {
+    public:
+        struct Release {
+            void operator()(Context* c) const {
+                c->clear();
+                contexts().emplace_back(c);
+            }
+        };
+
+        using Lease = std::unique_ptr<Context, Release>;
+
+        // Leases handed out on this thread, and how many of them needed a
+        // new context because the pool was empty
+        struct Stats {
+            size_t acquired = 0;
+            size_t created = 0;
+        };
+
+        static Lease acquire() {
+            auto& pool = contexts();
+            auto& counters = stats_of_thread();
+            counters.acquired++;
+            if (pool.empty()) {
+                counters.created++;
+                return Lease(new Context());
+            }
+            auto c = pool.back().release();
+            pool.pop_back();
+            return Lease(c);
+        }
+
+        static Stats stats() { return stats_of_thread(); }
+
+    private:
+        static Stats& stats_of_thread() {
+            thread_local Stats stats;
+            return stats;
+        }
+
+        static std::vector<std::unique_ptr<Context>>& contexts() {
+            thread_local std::vector<std::unique_ptr<Context>> pool;
+            return pool;
+        }
+    };
+
     /*
      * Parser operators
      */
@@ -1032,8 +1477,28 @@ namespace peg {
                 if (!for_label_) { c.cut_stack.pop_back(); }
                 });
 
+            // Skip alternatives that cannot start with the next byte. They would
+            // only fail, but a failure can add expected tokens to the error
+            // message, so not while error positions are tracked.
+            auto viable = ~uint64_t(0);
+            if (!dispatch_masks_.empty() && n > 0 && !c.log) {
+                viable =
+                    dispatch_masks_[dispatch_index_[static_cast<unsigned char>(s[0])]];
+            }
+
+            // Likewise alternatives whose leading literal is not next
+            auto check_leads = !leads_.empty() && !c.log && c.grammar_optimizations;
+            auto group = static_cast<size_t>(-1);
+            auto group_matched = false;
+
             size_t id = 0;
             for (const auto& ope : opes_) {
+                if ((id < 64 && !((viable >> id) & 1)) ||
+                    (check_leads && !lead_matches(id, s, n, group, group_matched))) {
+                    id++;
+                    continue;
+                }
+
                 if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
 
                 auto& chvs = c.push();
@@ -1068,52 +1533,67 @@ namespace peg {
 
         std::vector<std::shared_ptr<Ope>> opes_;
         bool for_label_ = false;
-    };
 
-    class Repetition : public Ope {
-    public:
-        Repetition(const std::shared_ptr<Ope>& ope, size_t min, size_t max)
-            : ope_(ope), min_(min), max_(max) {}
+        // Bit i of dispatch_masks_[dispatch_index_[b]] is set when alternative i
+        // can match input starting with byte b. Built by BuildChoiceDispatch;
+        // empty means every alternative is tried.
+        std::vector<uint64_t> dispatch_masks_;
+        std::array<uint8_t, 256> dispatch_index_{};
+
+        // The literal each alternative starts with, if any. Neighbours that
+        // share a prefix form a group that compares it once, and each then
+        // compares only its `suffix`. Built by FactorChoicePrefixes; empty
+        // when no alternative starts with a literal.
+        struct PrefixGroup {
+            std::string prefix;
+            bool ignore_case = false;
+        };
 
-        size_t parse_core(const char* s, size_t n, SemanticValues& vs, Context& c,
-            std::any& dt) const override {
-            size_t count = 0;
-            size_t i = 0;
-            while (count < min_) {
-                auto& chvs = c.push();
-                auto se = scope_exit([&]() { c.pop(); });
+        struct Lead {
+            size_t group = static_cast<size_t>(-1);
+            std::string suffix;
+        };
 
-                auto len = ope_->parse(s + i, n - i, chvs, c, dt);
+        std::vector<PrefixGroup> prefix_groups_;
+        std::vector<Lead> leads_;
 
-                if (success(len)) {
-                    vs.append(chvs);
-                    c.shift_capture_values();
-                }
-                else {
-                    return len;
+    private:
+        bool lead_matches(size_t id, const char* s, size_t n, size_t& group,
+            bool& group_matched) const {
+            const auto& lead = leads_[id];
+            if (lead.group == static_cast<size_t>(-1)) { return true; }
+
+            const auto& g = prefix_groups_[lead.group];
+            if (lead.group != group) {
+                group = lead.group;
+                group_matched = starts_with(s, n, g.prefix, g.ignore_case);
+            }
+            return group_matched && starts_with(s + g.prefix.size(),
+                n - g.prefix.size(), lead.suffix, g.ignore_case);
+        }
+
+        static bool starts_with(const char* s, size_t n, std::string_view lit,
+            bool ignore_case) {
+            if (n < lit.size()) { return false; }
+            for (size_t i = 0; i < lit.size(); i++) {
+                if (ignore_case ? std::tolower(static_cast<unsigned char>(s[i])) !=
+                    std::tolower(static_cast<unsigned char>(lit[i]))
+                    : s[i] != lit[i]) {
+                    return false;
                 }
-                i += len;
-                count++;
             }
+            return true;
+        }
+    };
 
-            while (count < max_) {
-                auto& chvs = c.push();
-                auto se = scope_exit([&]() { c.pop(); });
+    class CharacterClass;
 
-                auto len = ope_->parse(s + i, n - i, chvs, c, dt);
+    class Repetition : public Ope {
+    public:
+        Repetition(const std::shared_ptr<Ope>& ope, size_t min, size_t max);
 
-                if (success(len)) {
-                    vs.append(chvs);
-                    c.shift_capture_values();
-                }
-                else {
-                    break;
-                }
-                i += len;
-                count++;
-            }
-            return i;
-        }
+        size_t parse_core(const char* s, size_t n, SemanticValues& vs, Context& c,
+            std::any& dt) const override;
 
         void accept(Visitor& v) override;
 
@@ -1138,6 +1618,10 @@ namespace peg {
         std::shared_ptr<Ope> ope_;
         size_t min_;
         size_t max_;
+
+    private:
+        // ope_ when it is a character class
+        const CharacterClass* class_;
     };
 
     class AndPredicate : public Ope {
@@ -1189,7 +1673,8 @@ namespace peg {
 
     class Dictionary : public Ope, public std::enable_shared_from_this<Dictionary> {
     public:
-        Dictionary(const std::vector<std::string>& v) : trie_(v) {}
+        Dictionary(const std::vector<std::string>& v, bool ignore_case = false)
+            : trie_(v, ignore_case), items_(v), ignore_case_(ignore_case) {}
 
         size_t parse_core(const char* s, size_t n, SemanticValues& vs, Context& c,
             std::any& dt) const override;
@@ -1197,6 +1682,8 @@ namespace peg {
         void accept(Visitor& v) override;
 
         Trie trie_;
+        std::vector<std::string> items_;
+        bool ignore_case_;
     };
 
     class LiteralString : public Ope,
@@ -1219,6 +1706,91 @@ namespace peg {
         mutable bool is_word_;
     };
 
+    /*
+     * Character span scanning
+     */
+
+    // Up to this many runs of consecutive ASCII members let a class scan
+    // spans a vector at a time
+    inline constexpr size_t max_span_runs = 4;
+
+    struct SpanRuns {
+        unsigned char lo[max_span_runs];
+        unsigned char width[max_span_runs];
+        size_t count = 0;
+    };
+
+#if defined(CPPPEGLIB_SSE2)
+    inline unsigned count_trailing_zeros(unsigned mask) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+
+    // Bytes before the first one outside all runs, 16 at a time; stops at the
+    // last whole block
+    inline size_t scan_span_sse2(const char* s, size_t n, const SpanRuns& runs) {
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            auto in = _mm_setzero_si128();
+            for (size_t r = 0; r < runs.count; r++) {
+                // x - lo <= width, unsigned, for lo <= x <= lo + width
+                auto d = _mm_sub_epi8(x, _mm_set1_epi8(static_cast<char>(runs.lo[r])));
+                auto w = _mm_set1_epi8(static_cast<char>(runs.width[r]));
+                in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, w), d));
+            }
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(in));
+            if (mask != 0xFFFFu) { return i + count_trailing_zeros(~mask); }
+        }
+        return i;
+    }
+#endif
+
+#if defined(CPPPEGLIB_AVX2)
+    // Whether both the CPU and the OS support AVX2, checked once
+    inline bool cpu_supports_avx2() {
+        static const bool supported = [] {
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7) { return false; }
+            __cpuid(info, 1);
+            auto osxsave = (info[2] & (1 << 27)) != 0;
+            auto avx = (info[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) { return false; }
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2") != 0;
+#endif
+            }();
+        return supported;
+    }
+
+    CPPPEGLIB_TARGET_AVX2 inline size_t scan_span_avx2(const char* s, size_t n,
+        const SpanRuns& runs) {
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            auto in = _mm256_setzero_si256();
+            for (size_t r = 0; r < runs.count; r++) {
+                auto d =
+                    _mm256_sub_epi8(x, _mm256_set1_epi8(static_cast<char>(runs.lo[r])));
+                auto w = _mm256_set1_epi8(static_cast<char>(runs.width[r]));
+                in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(d, w), d));
+            }
+            auto mask = static_cast<unsigned>(_mm256_movemask_epi8(in));
+            if (mask != 0xFFFFFFFFu) { return i + count_trailing_zeros(~mask); }
+        }
+        return i;
+    }
+#endif
+
     class CharacterClass : public Ope,
         public std::enable_shared_from_this<CharacterClass> {
     public:
@@ -1240,12 +1812,14 @@ namespace peg {
                 }
             }
             assert(!ranges_.empty());
+            init_ascii();
         }
 
         CharacterClass(const std::vector<std::pair<char32_t, char32_t>>& ranges,
             bool negated, bool ignore_case)
             : ranges_(ranges), negated_(negated), ignore_case_(ignore_case) {
             assert(!ranges_.empty());
+            init_ascii();
         }
 
         size_t parse_core(const char* s, size_t n, SemanticValues& /*vs*/,
@@ -1255,22 +1829,17 @@ namespace peg {
                 return static_cast<size_t>(-1);
             }
 
+            auto ch = static_cast<unsigned char>(s[0]);
+            if (ch < 0x80) {
+                if (contains_ascii(ch)) { return 1; }
+                c.set_error_pos(s);
+                return static_cast<size_t>(-1);
+            }
+
             char32_t cp = 0;
             auto len = decode_codepoint(s, n, cp);
 
-            for (const auto& range : ranges_) {
-                if (in_range(range, cp)) {
-                    if (negated_) {
-                        c.set_error_pos(s);
-                        return static_cast<size_t>(-1);
-                    }
-                    else {
-                        return len;
-                    }
-                }
-            }
-
-            if (negated_) {
+            if (contains(cp)) {
                 return len;
             }
             else {
@@ -1281,30 +1850,91 @@ namespace peg {
 
         void accept(Visitor& v) override;
 
-    private:
-        bool in_range(const std::pair<char32_t, char32_t>& range, char32_t cp) const {
-            if (ignore_case_) {
-                auto cpl = std::tolower(cp);
-                return std::tolower(range.first) <= cpl &&
-                    cpl <= std::tolower(range.second);
-            }
-            else {
-                return range.first <= cp && cp <= range.second;
+        // Whether the class accepts `cp`, negation included
+        bool contains(char32_t cp) const {
+            for (const auto& range : ranges_) {
+                if (in_range(range, cp)) { return !negated_; }
             }
+            return negated_;
         }
 
-        std::vector<std::pair<char32_t, char32_t>> ranges_;
-        bool negated_;
-        bool ignore_case_;
-    };
-
-    class Character : public Ope, public std::enable_shared_from_this<Character> {
-    public:
-        Character(char ch) : ch_(ch) {}
+        // Whether the class accepts the byte as an ASCII character; false for
+        // every byte that starts a multibyte codepoint
+        bool contains_ascii(unsigned char ch) const {
+            return (ascii_[ch >> 6] >> (ch & 63)) & 1;
+        }
 
-        size_t parse_core(const char* s, size_t n, SemanticValues& /*vs*/,
-            Context& c, std::any& /*dt*/) const override {
-            if (n < 1 || s[0] != ch_) {
+        // Length of the longest prefix of s[0, n) made of ASCII members
+        size_t scan_span(const char* s, size_t n) const {
+            size_t i = 0;
+#if defined(CPPPEGLIB_SSE2)
+            if (runs_.count) {
+#if defined(CPPPEGLIB_AVX2)
+                if (n >= 32 && cpu_supports_avx2()) { i = scan_span_avx2(s, n, runs_); }
+#endif
+                if (n - i >= 16) { i += scan_span_sse2(s + i, n - i, runs_); }
+            }
+#endif
+            while (i < n && contains_ascii(static_cast<unsigned char>(s[i]))) {
+                i++;
+            }
+            return i;
+        }
+
+    private:
+        friend struct GrammarImageWriter;
+        friend struct GenerateParserSource;
+
+        void init_ascii() {
+            for (char32_t cp = 0; cp < 0x80; cp++) {
+                if (contains(cp)) { ascii_[cp >> 6] |= uint64_t(1) << (cp & 63); }
+            }
+
+            size_t runs = 0;
+            unsigned ch = 0;
+            while (ch < 0x80) {
+                if (!contains_ascii(static_cast<unsigned char>(ch))) {
+                    ch++;
+                    continue;
+                }
+                auto lo = ch;
+                while (ch < 0x80 && contains_ascii(static_cast<unsigned char>(ch))) {
+                    ch++;
+                }
+                if (runs < max_span_runs) {
+                    runs_.lo[runs] = static_cast<unsigned char>(lo);
+                    runs_.width[runs] = static_cast<unsigned char>(ch - 1 - lo);
+                }
+                runs++;
+            }
+            runs_.count = runs <= max_span_runs ? runs : 0;
+        }
+
+        bool in_range(const std::pair<char32_t, char32_t>& range, char32_t cp) const {
+            if (ignore_case_) {
+                auto cpl = std::tolower(cp);
+                return std::tolower(range.first) <= cpl &&
+                    cpl <= std::tolower(range.second);
+            }
+            else {
+                return range.first <= cp && cp <= range.second;
+            }
+        }
+
+        std::vector<std::pair<char32_t, char32_t>> ranges_;
+        bool negated_;
+        bool ignore_case_;
+        uint64_t ascii_[4] = {};
+        SpanRuns runs_;
+    };
+
+    class Character : public Ope, public std::enable_shared_from_this<Character> {
+    public:
+        Character(char ch) : ch_(ch) {}
+
+        size_t parse_core(const char* s, size_t n, SemanticValues& /*vs*/,
+            Context& c, std::any& /*dt*/) const override {
+            if (n < 1 || s[0] != ch_) {
                 c.set_error_pos(s);
                 return static_cast<size_t>(-1);
             }
@@ -1439,6 +2069,8 @@ namespace peg {
         void accept(Visitor& v) override;
 
         std::any reduce(SemanticValues& vs, std::any& dt) const;
+        void reduce_typed(SemanticValues& vs, std::any& dt, void* value,
+            size_t size) const;
 
         const std::string& name() const;
         const std::string& trace_name() const;
@@ -1476,6 +2108,13 @@ namespace peg {
 
         Definition* rule_;
         size_t iarg_;
+
+        // Set by InlineTrivialRules when the rule's body can stand in for it
+        bool inline_ = false;
+
+    private:
+        size_t parse_inline(const char* s, size_t n, SemanticValues& vs,
+            Context& c, std::any& dt) const;
     };
 
     class Whitespace : public Ope {
@@ -1513,10 +2152,19 @@ namespace peg {
     public:
         using BinOpeInfo = std::map<std::string_view, std::pair<size_t, char>>;
 
+        // With `ignore_case`, as for an operator rule of 'and'i literals, an
+        // operator matches its table entry in any case.
         PrecedenceClimbing(const std::shared_ptr<Ope>& atom,
             const std::shared_ptr<Ope>& binop, const BinOpeInfo& info,
-            const Definition& rule)
-            : atom_(atom), binop_(binop), info_(info), rule_(rule) {}
+            const Definition& rule, bool ignore_case = false)
+            : atom_(atom), binop_(binop), info_(info), rule_(rule),
+            ignore_case_(ignore_case) {
+            if (ignore_case_) {
+                for (const auto& [op, level_assoc] : info_) {
+                    folded_info_.emplace(fold_case(op), level_assoc);
+                }
+            }
+        }
 
         size_t parse_core(const char* s, size_t n, SemanticValues& vs, Context& c,
             std::any& dt) const override {
@@ -1529,12 +2177,26 @@ namespace peg {
         std::shared_ptr<Ope> binop_;
         BinOpeInfo info_;
         const Definition& rule_;
+        bool ignore_case_;
 
     private:
+        static std::string fold_case(std::string_view op) {
+            std::string folded(op);
+            for (auto& ch : folded) {
+                ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+            }
+            return folded;
+        }
+
         size_t parse_expression(const char* s, size_t n, SemanticValues& vs,
             Context& c, std::any& dt, size_t min_prec) const;
 
         Definition& get_reference_for_binop(Context& c) const;
+
+        const std::pair<size_t, char>* find_binop(const std::string& tok) const;
+
+        // The entries of info_ by their operator in lower case, with ignore_case_
+        std::map<std::string, std::pair<size_t, char>> folded_info_;
     };
 
     class Recovery : public Ope {
@@ -1602,8 +2264,9 @@ namespace peg {
         return std::make_shared<NotPredicate>(ope);
     }
 
-    inline std::shared_ptr<Ope> dic(const std::vector<std::string> &v) {
-        return std::make_shared<Dictionary>(v);
+    inline std::shared_ptr<Ope> dic(const std::vector<std::string> &v,
+        bool ignore_case = false) {
+        return std::make_shared<Dictionary>(v, ignore_case);
     }
 
     inline std::shared_ptr<Ope> lit(std::string && s) {
@@ -1681,8 +2344,9 @@ namespace peg {
     inline std::shared_ptr<Ope> pre(const std::shared_ptr<Ope> &atom,
         const std::shared_ptr<Ope> &binop,
         const PrecedenceClimbing::BinOpeInfo & info,
-        const Definition & rule) {
-        return std::make_shared<PrecedenceClimbing>(atom, binop, info, rule);
+        const Definition & rule, bool ignore_case = false) {
+        return std::make_shared<PrecedenceClimbing>(atom, binop, info, rule,
+            ignore_case);
     }
 
     inline std::shared_ptr<Ope> rec(const std::shared_ptr<Ope> &ope) {
@@ -1811,6 +2475,36 @@ namespace peg {
         bool result_ = false;
     };
 
+    // Whether an operator rule matches one of its own literals in any case
+    struct HasIgnoreCaseLiteral : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(Holder& ope) override { ope.ope_->accept(*this); }
+        void visit(Dictionary& ope) override { result_ = result_ || ope.ignore_case_; }
+        void visit(LiteralString& ope) override { result_ = result_ || ope.ignore_case_; }
+
+        static bool check(Ope& ope) {
+            HasIgnoreCaseLiteral vis;
+            ope.accept(vis);
+            return vis.result_;
+        }
+
+    private:
+        bool result_ = false;
+    };
+
     struct TokenChecker : public Ope::Visitor {
         using Ope::Visitor::visit;
 
@@ -2121,6 +2815,313 @@ namespace peg {
         const std::vector<std::string>& params_;
     };
 
+    struct FirstSet {
+        std::bitset<256> bytes;
+        bool nullable = false;
+    };
+
+    // The bytes an operator can start a match with, and whether it can match
+    // empty. Operators that cannot be analysed may start with anything.
+    struct ComputeFirstSet : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        FirstSet first_of(Ope& ope) {
+            auto save = first_;
+            ope.accept(*this);
+            std::swap(first_, save);
+            return save;
+        }
+
+        void visit(Sequence& ope) override {
+            FirstSet first;
+            first.nullable = true;
+            for (auto op : ope.opes_) {
+                auto f = first_of(*op);
+                first.bytes |= f.bytes;
+                if (!f.nullable) {
+                    first.nullable = false;
+                    break;
+                }
+            }
+            first_ = first;
+        }
+        void visit(PrioritizedChoice& ope) override {
+            FirstSet first;
+            for (auto op : ope.opes_) {
+                auto f = first_of(*op);
+                first.bytes |= f.bytes;
+                first.nullable = first.nullable || f.nullable;
+            }
+            first_ = first;
+        }
+        void visit(Repetition& ope) override {
+            first_ = first_of(*ope.ope_);
+            if (ope.min_ == 0) { first_.nullable = true; }
+        }
+        void visit(AndPredicate&) override { first_ = empty(); }
+        void visit(NotPredicate&) override { first_ = empty(); }
+        void visit(Dictionary&) override {
+            first_ = anything();
+            first_.nullable = false;
+        }
+        void visit(LiteralString& ope) override {
+            FirstSet first;
+            if (ope.lit_.empty()) {
+                first.nullable = true;
+            }
+            else {
+                auto lead = static_cast<unsigned char>(ope.lit_[0]);
+                auto lead_lower = std::tolower(lead);
+                for (size_t b = 0; b < 256; b++) {
+                    if (ope.ignore_case_ ? std::tolower(static_cast<int>(b)) == lead_lower
+                        : b == lead) {
+                        first.bytes.set(b);
+                    }
+                }
+            }
+            first_ = first;
+        }
+        void visit(CharacterClass& ope) override {
+            FirstSet first;
+            for (size_t b = 0; b < 256; b++) {
+                // Bytes above ASCII start a multibyte codepoint
+                if (b >= 0x80 || ope.contains(static_cast<char32_t>(b))) {
+                    first.bytes.set(b);
+                }
+            }
+            first_ = first;
+        }
+        void visit(Character& ope) override {
+            first_ = FirstSet();
+            first_.bytes.set(static_cast<unsigned char>(ope.ch_));
+        }
+        void visit(AnyCharacter&) override {
+            first_ = anything();
+            first_.nullable = false;
+        }
+        void visit(CaptureScope& ope) override { first_ = first_of(*ope.ope_); }
+        void visit(Capture& ope) override { first_ = first_of(*ope.ope_); }
+        void visit(TokenBoundary& ope) override { first_ = first_of(*ope.ope_); }
+        void visit(Ignore& ope) override { first_ = first_of(*ope.ope_); }
+        void visit(User&) override { first_ = anything(); }
+        void visit(WeakHolder& ope) override { first_ = first_of(*ope.weak_.lock()); }
+        void visit(Holder& ope) override;
+        void visit(Reference& ope) override;
+        void visit(Whitespace& ope) override {
+            first_ = first_of(*ope.ope_);
+            first_.nullable = true;
+        }
+        void visit(BackReference&) override { first_ = anything(); }
+        void visit(PrecedenceClimbing& ope) override { first_ = first_of(*ope.atom_); }
+        void visit(Recovery&) override { first_ = anything(); }
+        void visit(Cut&) override { first_ = empty(); }
+
+    private:
+        static FirstSet empty() {
+            FirstSet first;
+            first.nullable = true;
+            return first;
+        }
+
+        static FirstSet anything() {
+            FirstSet first;
+            first.bytes.set();
+            first.nullable = true;
+            return first;
+        }
+
+        FirstSet first_of_rule(const Definition& rule);
+
+        FirstSet first_;
+        std::unordered_map<const Definition*, FirstSet> rules_;
+        std::unordered_set<const Definition*> active_;
+    };
+
+    // Gives each ordered choice a table of the alternatives that can match
+    // at each first byte of input.
+    struct BuildChoiceDispatch : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override;
+        void visit(Repetition& ope) override { ope.ope_->accept(*this); }
+        void visit(AndPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(NotPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override { ope.ope_->accept(*this); }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(Holder& ope) override { ope.ope_->accept(*this); }
+        void visit(Reference& ope) override {
+            for (auto arg : ope.args_) {
+                arg->accept(*this);
+            }
+        }
+        void visit(Whitespace& ope) override { ope.ope_->accept(*this); }
+        void visit(PrecedenceClimbing& ope) override {
+            ope.atom_->accept(*this);
+            ope.binop_->accept(*this);
+        }
+        void visit(Recovery& ope) override { ope.ope_->accept(*this); }
+
+    private:
+        ComputeFirstSet first_;
+        std::unordered_set<const PrioritizedChoice*> done_;
+    };
+
+    // Whether an operator only matches text: it reaches no rule and keeps no
+    // values or captures.
+    struct IsTerminal : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(Repetition& ope) override { ope.ope_->accept(*this); }
+        void visit(AndPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(NotPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(CaptureScope&) override { result_ = false; }
+        void visit(Capture&) override { result_ = false; }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(User&) override { result_ = false; }
+        void visit(WeakHolder&) override { result_ = false; }
+        void visit(Holder&) override { result_ = false; }
+        void visit(Reference&) override { result_ = false; }
+        void visit(Whitespace&) override { result_ = false; }
+        void visit(BackReference&) override { result_ = false; }
+        void visit(PrecedenceClimbing&) override { result_ = false; }
+        void visit(Recovery&) override { result_ = false; }
+        void visit(Cut&) override { result_ = false; }
+
+        static bool check(Ope& ope) {
+            IsTerminal vis;
+            ope.accept(vis);
+            return vis.result_;
+        }
+
+    private:
+        bool result_ = true;
+    };
+
+    // Marks the references to rules whose body can be parsed in place of the
+    // call: `~` rules that only match text, and rules that only name another
+    // rule with the same `~`. Actions and hooks are bound after the grammar
+    // is generated, so a marked reference still makes the call while the
+    // rule has any, see Definition::is_unobserved.
+    struct InlineTrivialRules : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(Repetition& ope) override { ope.ope_->accept(*this); }
+        void visit(AndPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(NotPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override { ope.ope_->accept(*this); }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(Holder& ope) override { ope.ope_->accept(*this); }
+        void visit(Reference& ope) override;
+        void visit(Whitespace& ope) override { ope.ope_->accept(*this); }
+        void visit(PrecedenceClimbing& ope) override {
+            ope.atom_->accept(*this);
+            ope.binop_->accept(*this);
+        }
+        void visit(Recovery& ope) override { ope.ope_->accept(*this); }
+
+        static bool is_trivial(const Definition& rule);
+    };
+
+    // The literal every match of an operator starts with, looking through
+    // the first operator of a sequence and into rules; null if there is none.
+    struct FindLeadingLiteral : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            if (!ope.opes_.empty()) { ope.opes_[0]->accept(*this); }
+        }
+        void visit(LiteralString& ope) override {
+            if (!ope.lit_.empty()) { literal_ = &ope; }
+        }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override { ope.ope_->accept(*this); }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(Holder& ope) override { visit_rule(*ope.outer_); }
+        void visit(Reference& ope) override {
+            if (ope.rule_ && !ope.is_macro_) { visit_rule(*ope.rule_); }
+        }
+
+        static const LiteralString* literal(Ope& ope) {
+            FindLeadingLiteral vis;
+            ope.accept(vis);
+            return vis.literal_;
+        }
+
+    private:
+        void visit_rule(const Definition& rule);
+
+        const LiteralString* literal_ = nullptr;
+        std::unordered_set<const Definition*> active_;
+    };
+
+    // Groups the alternatives of each ordered choice by the literal prefix
+    // they start with, so that a failing prefix is compared once for the
+    // group rather than once per alternative. The alternatives themselves
+    // and so the choice numbers actions see are left as they are.
+    struct FactorChoicePrefixes : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override;
+        void visit(Repetition& ope) override { ope.ope_->accept(*this); }
+        void visit(AndPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(NotPredicate& ope) override { ope.ope_->accept(*this); }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override { ope.ope_->accept(*this); }
+        void visit(TokenBoundary& ope) override { ope.ope_->accept(*this); }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(Holder& ope) override { ope.ope_->accept(*this); }
+        void visit(Reference& ope) override {
+            for (auto arg : ope.args_) {
+                arg->accept(*this);
+            }
+        }
+        void visit(Whitespace& ope) override { ope.ope_->accept(*this); }
+        void visit(PrecedenceClimbing& ope) override {
+            ope.atom_->accept(*this);
+            ope.binop_->accept(*this);
+        }
+        void visit(Recovery& ope) override { ope.ope_->accept(*this); }
+
+    private:
+        std::unordered_set<const PrioritizedChoice*> done_;
+    };
+
     struct FindReference : public Ope::Visitor {
         using Ope::Visitor::visit;
 
@@ -2222,6 +3223,8 @@ namespace peg {
             bool recovered;
             size_t len;
             ErrorInfo error_info;
+            // What recovery logged, kept only when errors are thrown
+            std::vector<parse_error> recovered_errors;
         };
 
         Definition() : holder_(std::make_shared<Holder>(this)) {}
@@ -2246,9 +3249,8 @@ namespace peg {
 
         Result parse(const char* s, size_t n, const char* path = nullptr,
             Log log = nullptr) const {
-            SemanticValues vs;
             std::any dt;
-            return parse_core(s, n, vs, dt, path, log);
+            return parse(s, n, dt, default_options(path, std::move(log)));
         }
 
         Result parse(const char* s, const char* path = nullptr,
@@ -2259,8 +3261,7 @@ namespace peg {
 
         Result parse(const char* s, size_t n, std::any& dt,
             const char* path = nullptr, Log log = nullptr) const {
-            SemanticValues vs;
-            return parse_core(s, n, vs, dt, path, log);
+            return parse(s, n, dt, default_options(path, std::move(log)));
         }
 
         Result parse(const char* s, std::any& dt, const char* path = nullptr,
@@ -2273,13 +3274,9 @@ namespace peg {
         Result parse_and_get_value(const char* s, size_t n, T& val,
             const char* path = nullptr,
             Log log = nullptr) const {
-            SemanticValues vs;
             std::any dt;
-            auto r = parse_core(s, n, vs, dt, path, log);
-            if (r.ret && !vs.empty() && vs.front().has_value()) {
-                val = std::any_cast<T>(vs[0]);
-            }
-            return r;
+            return parse_and_get_value(s, n, dt, val,
+                default_options(path, std::move(log)));
         }
 
         template <typename T>
@@ -2293,12 +3290,8 @@ namespace peg {
         Result parse_and_get_value(const char* s, size_t n, std::any& dt, T& val,
             const char* path = nullptr,
             Log log = nullptr) const {
-            SemanticValues vs;
-            auto r = parse_core(s, n, vs, dt, path, log);
-            if (r.ret && !vs.empty() && vs.front().has_value()) {
-                val = std::any_cast<T>(vs[0]);
-            }
-            return r;
+            return parse_and_get_value(s, n, dt, val,
+                default_options(path, std::move(log)));
         }
 
         template <typename T>
@@ -2309,6 +3302,31 @@ namespace peg {
             return parse_and_get_value(s, n, dt, val, path, log);
         }
 
+        Result parse(const char* s, size_t n, std::any& dt,
+            const ParseOptions& options) const {
+            return parse_core(s, n, dt, options, [](SemanticValues&) {});
+        }
+
+        template <typename T>
+        Result parse_and_get_value(const char* s, size_t n, std::any& dt, T& val,
+            const ParseOptions& options) const {
+            return parse_core(s, n, dt, options, [&](SemanticValues& vs) {
+                if (!vs.empty() && vs.front().has_value()) {
+                    val = std::any_cast<T>(vs[0]);
+                }
+                });
+        }
+
+        // For a rule set up by typed_parser<T>
+        template <typename T>
+        Result parse_and_get_typed_value(const char* s, size_t n, std::any& dt,
+            T& val, const ParseOptions& options) const {
+            return parse_core(s, n, dt, options, [&](SemanticValues& vs) {
+                auto values = vs.typed_values<T>();
+                if (!values.empty()) { val = values[0]; }
+                });
+        }
+
 #if defined(__cpp_lib_char8_t)
         Result parse(const char8_t* s, size_t n, const char* path = nullptr,
             Log log = nullptr) const {
@@ -2370,6 +3388,13 @@ namespace peg {
             return *this;
         }
 
+        // Nothing observes a call of the rule as such, so its body can be
+        // parsed in its place
+        bool is_unobserved() const {
+            return !action && !typed_action && !predicate && !enter && !leave &&
+                error_message.empty() && !memoize;
+        }
+
         Definition& operator~() {
             ignoreSemanticValue = true;
             return *this;
@@ -2405,6 +3430,10 @@ namespace peg {
         std::shared_ptr<Ope> whitespaceOpe;
         std::shared_ptr<Ope> wordOpe;
         bool enablePackratParsing = false;
+        PackratMode packrat_mode = PackratMode::All;
+        bool memoize = false;
+        TypedAction typed_action;
+        size_t typed_size = 0;
         bool is_macro = false;
         std::vector<std::string> params;
         bool disable_action = false;
@@ -2419,6 +3448,7 @@ namespace peg {
         bool no_ast_opt = false;
 
         bool eoi_check = true;
+        bool grammar_optimizations = true;
 
     private:
         friend class Reference;
@@ -2437,21 +3467,82 @@ namespace peg {
                 });
         }
 
-        Result parse_core(const char* s, size_t n, SemanticValues& vs, std::any& dt,
-            const char* path, Log log) const {
-            initialize_definition_ids();
+        ParseOptions default_options(const char* path, Log log) const {
+            ParseOptions options;
+            options.path = path;
+            options.log = std::move(log);
+            options.tracer_enter = tracer_enter;
+            options.tracer_leave = tracer_leave;
+            options.tracer_start = tracer_start;
+            options.tracer_end = tracer_end;
+            options.verbose_trace = verbose_trace;
+            return options;
+        }
 
-            std::shared_ptr<Ope> ope = holder_;
+        // Parses with a context from this thread's pool. `on_values` sees the
+        // semantic values of a successful parse before the context is reused.
+        template <typename F>
+        Result parse_core(const char* s, size_t n, std::any& dt,
+            const ParseOptions& options, F on_values) const {
+            initialize_definition_ids();
 
             std::any trace_data;
-            if (tracer_start) { tracer_start(trace_data); }
+            if (options.tracer_start) { options.tracer_start(trace_data); }
             auto se = scope_exit([&]() {
-                if (tracer_end) { tracer_end(trace_data); }
+                if (options.tracer_end) { options.tracer_end(trace_data); }
                 });
 
-            Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
-                enablePackratParsing, tracer_enter, tracer_leave, trace_data,
-                verbose_trace, log);
+            // Error positions are only tracked while a logger is set. A parse
+            // that throws also collects what recovery logs, to throw the first.
+            auto log = options.log;
+            std::vector<parse_error> recovered_errors;
+            if (options.error_mode == ErrorMode::Throw) {
+                log = [&](size_t line, size_t col, const std::string& msg,
+                    const std::string& rule) {
+                        if (options.log) { options.log(line, col, msg, rule); }
+                        recovered_errors.emplace_back(line, col, msg);
+                    };
+            }
+            auto with_errors = [&](Result result) {
+                result.recovered_errors = std::move(recovered_errors);
+                return result;
+                };
+
+            // A lazy parse only tracks them once it is known to fail, or to
+            // succeed only through recovery. Traced parses are not repeated.
+            if (options.lazy_errors && log && !options.tracer_enter) {
+                auto result = parse_pass(s, n, dt, options, nullptr, trace_data,
+                    options.packrat_stats, on_values);
+                if (result.ret && !result.recovered) { return result; }
+                return with_errors(parse_pass(s, n, dt, options, log, trace_data,
+                    nullptr, on_values));
+            }
+            return with_errors(parse_pass(s, n, dt, options, log, trace_data,
+                options.packrat_stats, on_values));
+        }
+
+        template <typename F>
+        Result parse_pass(const char* s, size_t n, std::any& dt,
+            const ParseOptions& options, Log log, std::any& trace_data,
+            PackratStats* packrat_stats, F& on_values) const {
+            std::shared_ptr<Ope> ope = holder_;
+
+            auto lease = ContextPool::acquire();
+            auto& c = *lease;
+            c.reset(options.path, s, n, definition_ids_.size(), whitespaceOpe,
+                wordOpe, enablePackratParsing, options.tracer_enter,
+                options.tracer_leave, trace_data, options.verbose_trace, log);
+            c.packrat_mode = packrat_mode;
+            c.typed_size = typed_size;
+            c.grammar_optimizations = grammar_optimizations;
+            if (packrat_stats) {
+                if (packrat_stats->size() < definition_ids_.size()) {
+                    packrat_stats->resize(definition_ids_.size());
+                }
+                c.packrat_stats = packrat_stats;
+            }
+
+            auto& vs = c.push_semantic_values_scope();
 
             size_t i = 0;
 
@@ -2462,7 +3553,7 @@ namespace peg {
                     scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
                 auto len = whitespaceOpe->parse(s, n, vs, c, dt);
-                if (fail(len)) { return Result{ false, c.recovered, i, c.error_info }; }
+                if (fail(len)) { return Result{ false, c.recovered, i, c.error_info, {} }; }
 
                 i = len;
             }
@@ -2481,7 +3572,14 @@ namespace peg {
                     }
                 }
             }
-            return Result{ ret, c.recovered, i, c.error_info };
+            if (ret) { on_values(vs); }
+
+            c.pop_semantic_values_scope();
+            assert(!c.value_stack_size);
+            assert(c.capture_scope_stack_size == 1);
+            assert(c.cut_stack.empty());
+
+            return Result{ ret, c.recovered, i, c.error_info, {} };
         }
 
         std::shared_ptr<Holder> holder_;
@@ -2748,6 +3846,65 @@ namespace peg {
         return i;
     }
 
+    inline Repetition::Repetition(const std::shared_ptr<Ope>& ope, size_t min,
+        size_t max)
+        : ope_(ope), min_(min), max_(max),
+        class_(dynamic_cast<const CharacterClass*>(ope.get())) {}
+
+    inline size_t Repetition::parse_core(const char* s, size_t n,
+        SemanticValues & vs, Context & c,
+        std::any & dt) const {
+        size_t count = 0;
+        size_t i = 0;
+
+        // A repeated class takes its run of ASCII members in one scan. The
+        // loops below continue from a multibyte codepoint; otherwise the
+        // next attempt would fail, so fail it here as the class would.
+        if (class_ && !c.tracer_enter) {
+            i = count = class_->scan_span(s, (std::min)(n, max_));
+            if (count == max_) { return i; }
+            if (i == n || static_cast<unsigned char>(s[i]) < 0x80) {
+                c.set_error_pos(s + i);
+                return count < min_ ? static_cast<size_t>(-1) : i;
+            }
+        }
+
+        while (count < min_) {
+            auto& chvs = c.push();
+            auto se = scope_exit([&]() { c.pop(); });
+
+            auto len = ope_->parse(s + i, n - i, chvs, c, dt);
+
+            if (success(len)) {
+                vs.append(chvs);
+                c.shift_capture_values();
+            }
+            else {
+                return len;
+            }
+            i += len;
+            count++;
+        }
+
+        while (count < max_) {
+            auto& chvs = c.push();
+            auto se = scope_exit([&]() { c.pop(); });
+
+            auto len = ope_->parse(s + i, n - i, chvs, c, dt);
+
+            if (success(len)) {
+                vs.append(chvs);
+                c.shift_capture_values();
+            }
+            else {
+                break;
+            }
+            i += len;
+            count++;
+        }
+        return i;
+    }
+
     inline size_t LiteralString::parse_core(const char* s, size_t n,
         SemanticValues & vs, Context & c,
         std::any & dt) const {
@@ -2800,8 +3957,9 @@ namespace peg {
 
         size_t len;
         std::any val;
+        alignas(std::max_align_t) unsigned char typed[max_typed_value_size];
 
-        c.packrat(s, outer_->id, len, val, [&](std::any& a_val) {
+        c.packrat(s, outer_->id, outer_->memoize, len, val, typed, [&](std::any& a_val) {
             if (outer_->enter) { outer_->enter(c, s, n, dt); }
             auto& chvs = c.push_semantic_values_scope();
             auto se = scope_exit([&]() {
@@ -2839,7 +3997,15 @@ namespace peg {
                 }
 
                 if (success(len)) {
-                    if (!c.recovered) { a_val = reduce(chvs, dt); }
+                    if (c.recovered) {
+                        // No value
+                    }
+                    else if (c.typed_size) {
+                        reduce_typed(chvs, dt, typed, c.typed_size);
+                    }
+                    else {
+                        a_val = reduce(chvs, dt);
+                    }
                 }
                 else {
                     if (c.log && !msg.empty() && c.error_info.message_pos < s) {
@@ -2861,7 +4027,12 @@ namespace peg {
 
         if (success(len)) {
             if (!outer_->ignoreSemanticValue) {
-                vs.emplace_back(std::move(val));
+                if (c.typed_size) {
+                    vs.push_typed(typed, c.typed_size);
+                }
+                else {
+                    vs.emplace_back(std::move(val));
+                }
                 vs.tags.emplace_back(str2tag(outer_->name));
             }
         }
@@ -2881,6 +4052,19 @@ namespace peg {
         }
     }
 
+    inline void Holder::reduce_typed(SemanticValues & vs, std::any & dt,
+        void* value, size_t size) const {
+        if (outer_->typed_action && !outer_->disable_action) {
+            outer_->typed_action(vs, dt, value);
+        }
+        else if (vs.typed_.size() < size) {
+            std::memset(value, 0, size);
+        }
+        else {
+            std::memcpy(value, vs.typed_.data(), size);
+        }
+    }
+
     inline const std::string& Holder::name() const { return outer_->name; }
 
     inline const std::string& Holder::trace_name() const {
@@ -2918,6 +4102,10 @@ namespace peg {
             }
             else {
                 // Definition
+                if (inline_ && c.grammar_optimizations && rule_->is_unobserved()) {
+                    return parse_inline(s, n, vs, c, dt);
+                }
+
                 c.push_args(std::vector<std::shared_ptr<Ope>>());
                 auto se = scope_exit([&]() { c.pop_args(); });
                 auto ope = get_core_operator();
@@ -2935,6 +4123,31 @@ namespace peg {
         return rule_->holder_;
     }
 
+    // Parses the body of a trivial rule into the caller's values, undoing
+    // what the rule's own scope would have kept from the caller: the tokens
+    // and choice of a `~` rule's body, and the tag on an alias's value.
+    inline size_t Reference::parse_inline(const char* s, size_t n,
+        SemanticValues & vs, Context & c,
+        std::any & dt) const {
+        auto save_tokens = vs.tokens.size();
+        auto save_choice_count = vs.choice_count_;
+        auto save_choice = vs.choice_;
+
+        c.rule_stack.push_back(rule_);
+        auto len = rule_->get_core_operator()->parse(s, n, vs, c, dt);
+        c.rule_stack.pop_back();
+
+        vs.tokens.resize(save_tokens);
+        vs.choice_count_ = save_choice_count;
+        vs.choice_ = save_choice;
+
+        if (success(len) && !rule_->ignoreSemanticValue) {
+            if (c.recovered && !c.typed_size) { vs.back() = std::any(); }
+            vs.tags.back() = str2tag(rule_->name);
+        }
+        return len;
+    }
+
     inline size_t BackReference::parse_core(const char* s, size_t n,
         SemanticValues & vs, Context & c,
         std::any & dt) const {
@@ -2968,6 +4181,16 @@ namespace peg {
         return *dynamic_cast<Reference&>(*binop_).rule_;
     }
 
+    inline const std::pair<size_t, char>*
+        PrecedenceClimbing::find_binop(const std::string& tok) const {
+        if (ignore_case_) {
+            auto it = folded_info_.find(fold_case(tok));
+            return it != folded_info_.end() ? &it->second : nullptr;
+        }
+        auto it = info_.find(tok);
+        return it != info_.end() ? &it->second : nullptr;
+    }
+
     inline size_t PrecedenceClimbing::parse_expression(const char* s, size_t n,
         SemanticValues & vs,
         Context & c, std::any & dt,
@@ -3002,11 +4225,11 @@ namespace peg {
 
             if (fail(chlen)) { break; }
 
-            auto it = info_.find(tok);
-            if (it == info_.end()) { break; }
+            auto level_assoc = find_binop(tok);
+            if (!level_assoc) { break; }
 
-            auto level = std::get<0>(it->second);
-            auto assoc = std::get<1>(it->second);
+            auto level = level_assoc->first;
+            auto assoc = level_assoc->second;
 
             if (level < min_prec) { break; }
 
@@ -3303,6 +4526,158 @@ namespace peg {
         }
     }
 
+    inline void ComputeFirstSet::visit(Holder & ope) {
+        first_ = first_of_rule(*ope.outer_);
+    }
+
+    inline void ComputeFirstSet::visit(Reference & ope) {
+        first_ = ope.rule_ ? first_of_rule(*ope.rule_) : anything();
+    }
+
+    inline FirstSet ComputeFirstSet::first_of_rule(const Definition & rule) {
+        if (rule.is_macro || active_.count(&rule)) { return anything(); }
+
+        auto it = rules_.find(&rule);
+        if (it != rules_.end()) { return it->second; }
+
+        active_.insert(&rule);
+        auto first = first_of(*rule.get_core_operator());
+        active_.erase(&rule);
+        rules_.emplace(&rule, first);
+        return first;
+    }
+
+    inline void BuildChoiceDispatch::visit(PrioritizedChoice & ope) {
+        if (!done_.insert(&ope).second) { return; }
+
+        for (auto op : ope.opes_) {
+            op->accept(*this);
+        }
+
+        auto count = ope.opes_.size();
+        if (count < 2 || count > 64) { return; }
+
+        std::vector<FirstSet> firsts;
+        for (auto op : ope.opes_) {
+            firsts.push_back(first_.first_of(*op));
+        }
+
+        auto all = count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+        std::vector<uint64_t> masks;
+        std::array<uint8_t, 256> index{};
+        for (size_t b = 0; b < 256; b++) {
+            uint64_t mask = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (firsts[i].nullable || firsts[i].bytes[b]) {
+                    mask |= uint64_t(1) << i;
+                }
+            }
+            auto it = std::find(masks.begin(), masks.end(), mask);
+            index[b] = static_cast<uint8_t>(it - masks.begin());
+            if (it == masks.end()) { masks.push_back(mask); }
+        }
+
+        // Nothing to skip when every alternative is viable on every byte
+        if (masks.size() == 1 && masks[0] == all) { return; }
+
+        ope.dispatch_masks_ = std::move(masks);
+        ope.dispatch_index_ = index;
+    }
+
+    inline void InlineTrivialRules::visit(Reference & ope) {
+        for (auto arg : ope.args_) {
+            arg->accept(*this);
+        }
+        ope.inline_ = ope.rule_ && !ope.is_macro_ && is_trivial(*ope.rule_);
+    }
+
+    inline bool InlineTrivialRules::is_trivial(const Definition & rule) {
+        if (rule.is_macro || !rule.params.empty()) { return false; }
+
+        auto ope = rule.get_core_operator();
+        if (auto ref = dynamic_cast<const Reference*>(ope.get())) {
+            return ref->rule_ && !ref->is_macro_ && !ref->rule_->is_macro &&
+                ref->rule_ != &rule &&
+                ref->rule_->ignoreSemanticValue == rule.ignoreSemanticValue;
+        }
+        return rule.ignoreSemanticValue && IsTerminal::check(*ope);
+    }
+
+    inline void FindLeadingLiteral::visit_rule(const Definition & rule) {
+        if (rule.is_macro || !active_.insert(&rule).second) { return; }
+        rule.get_core_operator()->accept(*this);
+    }
+
+    inline void FactorChoicePrefixes::visit(PrioritizedChoice & ope) {
+        if (!done_.insert(&ope).second) { return; }
+
+        for (auto op : ope.opes_) {
+            op->accept(*this);
+        }
+
+        std::vector<const LiteralString*> literals;
+        for (auto op : ope.opes_) {
+            literals.push_back(FindLeadingLiteral::literal(*op));
+        }
+        if (std::count(literals.begin(), literals.end(), nullptr) ==
+            static_cast<std::ptrdiff_t>(literals.size())) {
+            return;
+        }
+
+        auto same = [](char a, char b, bool ignore_case) {
+            return ignore_case ? std::tolower(static_cast<unsigned char>(a)) ==
+                std::tolower(static_cast<unsigned char>(b))
+                : a == b;
+            };
+
+        std::vector<PrioritizedChoice::PrefixGroup> groups;
+        std::vector<PrioritizedChoice::Lead> leads(literals.size());
+        size_t i = 0;
+        while (i < literals.size()) {
+            if (!literals[i]) {
+                i++;
+                continue;
+            }
+
+            // Extend the group while the next literal shares some prefix
+            PrioritizedChoice::PrefixGroup group{ literals[i]->lit_,
+                literals[i]->ignore_case_ };
+            auto end = i + 1;
+            while (end < literals.size() && literals[end] &&
+                literals[end]->ignore_case_ == group.ignore_case) {
+                const auto& lit = literals[end]->lit_;
+                size_t len = 0;
+                while (len < group.prefix.size() && len < lit.size() &&
+                    same(group.prefix[len], lit[len], group.ignore_case)) {
+                    len++;
+                }
+                if (len == 0) { break; }
+                group.prefix.resize(len);
+                end++;
+            }
+
+            for (auto j = i; j < end; j++) {
+                leads[j].group = groups.size();
+                leads[j].suffix = literals[j]->lit_.substr(group.prefix.size());
+            }
+            groups.push_back(std::move(group));
+            i = end;
+        }
+
+        ope.prefix_groups_ = std::move(groups);
+        ope.leads_ = std::move(leads);
+    }
+
+    // Both passes, run on a grammar whose references are linked
+    inline void optimize_grammar(Grammar& grammar) {
+        InlineTrivialRules inline_rules;
+        FactorChoicePrefixes factor_prefixes;
+        for (auto& [name, rule] : grammar) {
+            rule.accept(inline_rules);
+            rule.accept(factor_prefixes);
+        }
+    }
+
     inline void FindReference::visit(Reference & ope) {
         for (size_t i = 0; i < args_.size(); i++) {
             const auto& name = params_[i];
@@ -3398,7 +4773,7 @@ namespace peg {
                     seq(g["OPEN"], g["Expression"], g["CLOSE"]),
                     seq(g["BeginTok"], g["Expression"], g["EndTok"]), g["CapScope"],
                     seq(g["BeginCap"], g["Expression"], g["EndCap"]), g["BackRef"],
-                    g["LiteralI"], g["Dictionary"], g["Literal"], g["NegatedClassI"],
+                    g["DictionaryI"], g["LiteralI"], g["Dictionary"], g["Literal"], g["NegatedClassI"],
                     g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
 
             g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
@@ -3412,6 +4787,8 @@ namespace peg {
             g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
 
             g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+            g["DictionaryI"] <=
+                seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
 
             auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
                 cls("'"), g["Spacing"]),
@@ -3420,11 +4797,13 @@ namespace peg {
             g["Literal"] <= lit_ope;
             g["LiteralD"] <= lit_ope;
 
-            g["LiteralI"] <=
+            auto lit_i_ope =
                 cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
                     g["Spacing"]),
                     seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
                         g["Spacing"]));
+            g["LiteralI"] <= lit_i_ope;
+            g["LiteralID"] <= lit_i_ope;
 
             // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
             g["Class"] <= seq(chr('['), npd(chr('^')),
@@ -3515,7 +4894,8 @@ namespace peg {
                         g["InstructionItem"])))),
                     g["EndBlacket"]);
             g["InstructionItem"] <=
-                cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
+                cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"],
+                    g["Memoize"]);
             ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
 
             ~g["SpacesZom"] <= zom(g["Space"]);
@@ -3548,6 +4928,9 @@ namespace peg {
             // No Ast node optimazation instruction
             g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
 
+            // Packrat memoization instruction
+            g["Memoize"] <= seq(lit("memoize"), g["SpacesZom"]);
+
             // Set definition names
             for (auto& x : g) {
                 x.second.name = x.first;
@@ -3788,6 +5171,10 @@ namespace peg {
                 auto items = vs.transform<std::string>();
                 return dic(items);
                 };
+            g["DictionaryI"] = [](const SemanticValues& vs) {
+                auto items = vs.transform<std::string>();
+                return dic(items, true);
+                };
 
             g["Literal"] = [](const SemanticValues& vs) {
                 const auto& tok = vs.tokens.front();
@@ -3801,6 +5188,10 @@ namespace peg {
                 auto& tok = vs.tokens.front();
                 return resolve_escape_sequence(tok.data(), tok.size());
                 };
+            g["LiteralID"] = [](const SemanticValues& vs) {
+                auto& tok = vs.tokens.front();
+                return resolve_escape_sequence(tok.data(), tok.size());
+                };
 
             g["Class"] = [](const SemanticValues& vs) {
                 auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
@@ -3964,6 +5355,13 @@ namespace peg {
                 return instruction;
                 };
 
+            g["Memoize"] = [](const SemanticValues& vs) {
+                Instruction instruction;
+                instruction.type = "memoize";
+                instruction.sv = vs.sv();
+                return instruction;
+                };
+
             g["Instruction"] = [](const SemanticValues& vs) {
                 return vs.transform<Instruction>();
                 };
@@ -3995,7 +5393,12 @@ namespace peg {
                     return false;
                 }
 
-                rule.holder_->ope_ = pre(atom, binop, info, rule);
+                // An operator rule of 'and'i literals gives its operators
+                // in any case, so the table must match them the same way.
+                const auto* binop_rule = dynamic_cast<Reference&>(*binop).rule_;
+                auto ignore_case = binop_rule &&
+                    HasIgnoreCaseLiteral::check(*binop_rule->get_core_operator());
+                rule.holder_->ope_ = pre(atom, binop, info, rule, ignore_case);
                 rule.disable_action = true;
             }
             catch (...) {
@@ -4222,6 +5625,20 @@ namespace peg {
                     else if (instruction.type == "no_ast_opt") {
                         rule.no_ast_opt = true;
                     }
+                    else if (instruction.type == "memoize") {
+                        rule.memoize = true;
+                    }
+                }
+            }
+
+            // Trivial rules inlined and choices grouped by leading literal
+            optimize_grammar(grammar);
+
+            // First-byte dispatch for ordered choices
+            {
+                BuildChoiceDispatch vis;
+                for (auto& [name, rule] : grammar) {
+                    rule.accept(vis);
                 }
             }
 
@@ -4549,99 +5966,2039 @@ namespace peg {
   PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
 
     /*-----------------------------------------------------------------------------
-     *  parser
+     *  PegProgram
      *---------------------------------------------------------------------------*/
 
-    class parser {
+    // A grammar lowered to one flat instruction array and run by a single
+    // dispatch loop, in the style of the LPeg parsing machine. Choice points
+    // and rule calls share one backtrack stack instead of recursing through
+    // the Ope graph and its Reference -> Holder indirection.
+    //
+    // The program only recognizes input. It runs no actions or predicates,
+    // keeps no packrat memo and records no error position, so re-run the
+    // parser for values or diagnostics. compile() returns false for grammars
+    // using operators the machine does not model: macros, captures and back
+    // references, cut, user operators, precedence climbing, error recovery
+    // and rules with semantic predicates.
+    class PegProgram {
     public:
-        parser() = default;
+        enum class OpCode : uint8_t {
+            Char,          // match byte `arg`
+            Any,           // match one UTF-8 codepoint
+            Set,           // match a codepoint in sets_[arg]
+            Literal,       // match literals_[arg]
+            Dictionary,    // match the longest word of dictionaries_[arg]
+            Choice,        // push a backtrack entry resuming at `arg`
+            Commit,        // pop the backtrack entry, jump to `arg`
+            PartialCommit, // move the backtrack entry here, jump to `arg`
+            BackCommit,    // pop the backtrack entry and its position, jump to `arg`
+            Fail,          // backtrack
+            FailTwice,     // pop the backtrack entry, then backtrack
+            Call,          // call the subroutine at `arg`
+            Ret,           // return from a subroutine
+            TokenBegin,    // enter a token boundary
+            TokenEnd,      // leave a token boundary
+            SkipWs,        // outside tokens and whitespace, call the whitespace at `arg`
+            End,           // fail unless at the end of input
+            Accept,        // succeed
+        };
 
-        parser(const char* s, size_t n, const Rules& rules) {
-            load_grammar(s, n, rules);
-        }
+        struct Instruction {
+            OpCode op;
+            uint32_t arg;
+        };
 
-        parser(const char* s, size_t n) : parser(s, n, Rules()) {}
+        bool compile(const Definition& start);
 
-        parser(std::string_view sv, const Rules& rules)
-            : parser(sv.data(), sv.size(), rules) {}
+        // Whether `sv` is a sentence of the grammar
+        bool match(std::string_view sv) const;
 
-        parser(std::string_view sv) : parser(sv.data(), sv.size(), Rules()) {}
+        const std::vector<Instruction>& code() const { return code_; }
 
-#if defined(__cpp_lib_char8_t)
-        parser(std::u8string_view sv, const Rules& rules)
-            : parser(reinterpret_cast<const char*>(sv.data()), sv.size(), rules) {}
+    private:
+        friend struct CompilePegProgram;
 
-        parser(std::u8string_view sv)
-            : parser(reinterpret_cast<const char*>(sv.data()), sv.size(), Rules()) {}
-#endif
+        struct CharSet {
+            uint64_t ascii[2];
+            std::shared_ptr<CharacterClass> cls;
+        };
 
-        operator bool() { return grammar_ != nullptr; }
+        struct LiteralData {
+            std::string text;
+            bool ignore_case;
+        };
 
-        bool load_grammar(const char* s, size_t n, const Rules& rules) {
-            grammar_ = ParserGenerator::parse(s, n, rules, start_,
-                enablePackratParsing_, log_);
-            return grammar_ != nullptr;
-        }
+        // A backtrack entry, or a return address when `s` is null
+        struct Entry {
+            const Instruction* pc;
+            const char* s;
+            uint32_t flags;
+        };
 
-        bool load_grammar(const char* s, size_t n) {
-            return load_grammar(s, n, Rules());
-        }
+        static constexpr uint32_t in_whitespace_flag = 0x80000000u;
 
-        bool load_grammar(std::string_view sv, const Rules& rules) {
-            return load_grammar(sv.data(), sv.size(), rules);
+        bool match_set(const CharSet& set, const char* s, const char* e,
+            size_t& len) const {
+            auto ch = static_cast<unsigned char>(*s);
+            if (ch < 0x80) {
+                len = 1;
+                return (set.ascii[ch >> 6] >> (ch & 63)) & 1;
+            }
+            char32_t cp = 0;
+            len = decode_codepoint(s, static_cast<size_t>(e - s), cp);
+            return set.cls->contains(cp);
+        }
+
+        static bool match_literal(const LiteralData& lit, const char* s,
+            const char* e) {
+            if (static_cast<size_t>(e - s) < lit.text.size()) { return false; }
+            for (size_t i = 0; i < lit.text.size(); i++) {
+                if (lit.ignore_case
+                    ? std::tolower(static_cast<unsigned char>(s[i])) !=
+                    std::tolower(static_cast<unsigned char>(lit.text[i]))
+                    : s[i] != lit.text[i]) {
+                    return false;
+                }
+            }
+            return true;
         }
 
-        bool load_grammar(std::string_view sv) {
-            return load_grammar(sv.data(), sv.size());
-        }
+        std::vector<Instruction> code_;
+        std::vector<CharSet> sets_;
+        std::vector<LiteralData> literals_;
+        std::vector<std::shared_ptr<Dictionary>> dictionaries_;
+    };
 
-        bool parse_n(const char* s, size_t n, const char* path = nullptr) const {
-            if (grammar_ != nullptr) {
-                const auto& rule = (*grammar_)[start_];
-                auto result = rule.parse(s, n, path, log_);
-                return post_process(s, n, result);
-            }
-            return false;
-        }
+    struct CompilePegProgram : public Ope::Visitor {
+        using Ope::Visitor::visit;
+        using OpCode = PegProgram::OpCode;
 
-        bool parse_n(const char* s, size_t n, std::any& dt,
-            const char* path = nullptr) const {
-            if (grammar_ != nullptr) {
-                const auto& rule = (*grammar_)[start_];
-                auto result = rule.parse(s, n, dt, path, log_);
-                return post_process(s, n, result);
+        CompilePegProgram(PegProgram& program, const Definition& start)
+            : program_(program), start_(start) {}
+
+        bool compile() {
+            if (start_.whitespaceOpe) {
+                auto ws = dynamic_cast<Whitespace*>(start_.whitespaceOpe.get());
+                if (!ws) { return false; }
+                whitespace_ = ws->ope_;
+                emit_call(OpCode::SkipWs, whitespace_, false);
             }
-            return false;
-        }
+            call_rule(start_);
+            if (start_.eoi_check) { emit(OpCode::End); }
+            emit(OpCode::Accept);
 
-        template <typename T>
-        bool parse_n(const char* s, size_t n, T& val,
-            const char* path = nullptr) const {
-            if (grammar_ != nullptr) {
-                const auto& rule = (*grammar_)[start_];
-                auto result = rule.parse_and_get_value(s, n, val, path, log_);
-                return post_process(s, n, result);
+            for (size_t id = 0; id < subroutines_.size() && supported_; id++) {
+                subroutines_[id].address = here();
+                word_mode_ = subroutines_[id].word_mode;
+                subroutines_[id].ope->accept(*this);
+                emit(OpCode::Ret);
             }
-            return false;
-        }
 
-        template <typename T>
-        bool parse_n(const char* s, size_t n, std::any& dt, T& val,
-            const char* path = nullptr) const {
-            if (grammar_ != nullptr) {
-                const auto& rule = (*grammar_)[start_];
-                auto result = rule.parse_and_get_value(s, n, dt, val, path, log_);
-                return post_process(s, n, result);
+            for (auto [at, id] : calls_) {
+                program_.code_[at].arg = subroutines_[id].address;
             }
-            return false;
+            return supported_;
         }
 
-        bool parse(std::string_view sv, const char* path = nullptr) const {
-            return parse_n(sv.data(), sv.size(), path);
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
         }
-
-        bool parse(std::string_view sv, std::any& dt,
-            const char* path = nullptr) const {
+        void visit(PrioritizedChoice& ope) override {
+            if (ope.opes_.empty()) {
+                emit(OpCode::Fail);
+                return;
+            }
+            std::vector<size_t> commits;
+            for (size_t i = 0; i + 1 < ope.opes_.size(); i++) {
+                auto choice = emit(OpCode::Choice);
+                ope.opes_[i]->accept(*this);
+                commits.push_back(emit(OpCode::Commit));
+                patch(choice);
+            }
+            ope.opes_.back()->accept(*this);
+            for (auto commit : commits) {
+                patch(commit);
+            }
+        }
+        void visit(Repetition& ope) override {
+            auto unbounded = ope.max_ == std::numeric_limits<size_t>::max();
+            if (ope.min_ > max_unrolled ||
+                (!unbounded && ope.max_ - ope.min_ > max_unrolled)) {
+                supported_ = false;
+                return;
+            }
+            for (size_t i = 0; i < ope.min_; i++) {
+                ope.ope_->accept(*this);
+            }
+            if (unbounded) {
+                auto choice = emit(OpCode::Choice);
+                auto loop = here();
+                ope.ope_->accept(*this);
+                emit(OpCode::PartialCommit, loop);
+                patch(choice);
+            }
+            else {
+                std::vector<size_t> choices;
+                for (auto i = ope.min_; i < ope.max_; i++) {
+                    choices.push_back(emit(OpCode::Choice));
+                    ope.ope_->accept(*this);
+                    patch(emit(OpCode::Commit));
+                }
+                for (auto choice : choices) {
+                    patch(choice);
+                }
+            }
+        }
+        void visit(AndPredicate& ope) override {
+            auto choice = emit(OpCode::Choice);
+            ope.ope_->accept(*this);
+            auto commit = emit(OpCode::BackCommit);
+            patch(choice);
+            emit(OpCode::Fail);
+            patch(commit);
+        }
+        void visit(NotPredicate& ope) override {
+            auto choice = emit(OpCode::Choice);
+            ope.ope_->accept(*this);
+            emit(OpCode::FailTwice);
+            patch(choice);
+        }
+        void visit(Dictionary& ope) override {
+            emit(OpCode::Dictionary,
+                static_cast<uint32_t>(program_.dictionaries_.size()));
+            program_.dictionaries_.push_back(ope.shared_from_this());
+            if (start_.wordOpe && !word_mode_) { emit_word_check(); }
+            emit_skip_whitespace();
+        }
+        void visit(LiteralString& ope) override {
+            if (ope.lit_.size() == 1 && !ope.ignore_case_) {
+                emit(OpCode::Char, static_cast<unsigned char>(ope.lit_[0]));
+            }
+            else {
+                emit(OpCode::Literal, static_cast<uint32_t>(program_.literals_.size()));
+                program_.literals_.push_back({ ope.lit_, ope.ignore_case_ });
+            }
+            if (start_.wordOpe && !word_mode_ && is_word(ope.lit_)) {
+                emit_word_check();
+            }
+            emit_skip_whitespace();
+        }
+        void visit(CharacterClass& ope) override {
+            PegProgram::CharSet set{ {0, 0}, ope.shared_from_this() };
+            for (char32_t cp = 0; cp < 0x80; cp++) {
+                if (ope.contains(cp)) { set.ascii[cp >> 6] |= uint64_t(1) << (cp & 63); }
+            }
+            emit(OpCode::Set, static_cast<uint32_t>(program_.sets_.size()));
+            program_.sets_.push_back(std::move(set));
+        }
+        void visit(Character& ope) override {
+            emit(OpCode::Char, static_cast<unsigned char>(ope.ch_));
+        }
+        void visit(AnyCharacter&) override { emit(OpCode::Any); }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override {
+            if (ope.match_action_) {
+                supported_ = false;
+                return;
+            }
+            ope.ope_->accept(*this);
+        }
+        void visit(TokenBoundary& ope) override {
+            emit(OpCode::TokenBegin);
+            ope.ope_->accept(*this);
+            emit(OpCode::TokenEnd);
+            emit_skip_whitespace();
+        }
+        void visit(Ignore& ope) override { ope.ope_->accept(*this); }
+        void visit(User&) override { supported_ = false; }
+        void visit(WeakHolder& ope) override {
+            auto ptr = ope.weak_.lock();
+            if (ptr) { ptr->accept(*this); }
+        }
+        void visit(Holder& ope) override { call_rule(*ope.outer_); }
+        void visit(Reference& ope) override {
+            if (!ope.rule_) {
+                supported_ = false;
+                return;
+            }
+            call_rule(*ope.rule_);
+        }
+        void visit(Whitespace&) override { supported_ = false; }
+        void visit(BackReference&) override { supported_ = false; }
+        void visit(PrecedenceClimbing&) override { supported_ = false; }
+        void visit(Recovery&) override { supported_ = false; }
+        void visit(Cut&) override { supported_ = false; }
+
+    private:
+        struct Subroutine {
+            std::shared_ptr<Ope> ope;
+            bool word_mode;
+            uint32_t address;
+        };
+
+        static constexpr size_t max_unrolled = 16;
+
+        uint32_t here() const { return static_cast<uint32_t>(program_.code_.size()); }
+
+        size_t emit(OpCode op, uint32_t arg = 0) {
+            program_.code_.push_back({ op, arg });
+            return program_.code_.size() - 1;
+        }
+
+        void patch(size_t at) { program_.code_[at].arg = here(); }
+
+        void emit_call(OpCode op, const std::shared_ptr<Ope>& ope, bool word_mode) {
+            size_t id = 0;
+            while (id < subroutines_.size() && (subroutines_[id].ope != ope ||
+                subroutines_[id].word_mode != word_mode)) {
+                id++;
+            }
+            if (id == subroutines_.size()) {
+                subroutines_.push_back({ ope, word_mode, 0 });
+            }
+            calls_.emplace_back(emit(op), id);
+        }
+
+        void call_rule(const Definition& rule) {
+            if (rule.is_macro || rule.predicate) {
+                supported_ = false;
+                return;
+            }
+            emit_call(OpCode::Call, rule.get_core_operator(), word_mode_);
+        }
+
+        // The parser checks a keyword's word boundary with a context that
+        // skips no whitespace; a token boundary gives the same effect here.
+        void emit_word_check() {
+            auto choice = emit(OpCode::Choice);
+            emit(OpCode::TokenBegin);
+            emit_call(OpCode::Call, start_.wordOpe, true);
+            emit(OpCode::FailTwice);
+            patch(choice);
+        }
+
+        void emit_skip_whitespace() {
+            if (whitespace_ && !word_mode_) {
+                emit_call(OpCode::SkipWs, whitespace_, false);
+            }
+        }
+
+        bool is_word(const std::string& lit) const {
+            SemanticValues dummy_vs;
+            Context dummy_c(nullptr, lit.data(), lit.size(), 0, nullptr, nullptr,
+                false, nullptr, nullptr, nullptr, false, nullptr);
+            std::any dummy_dt;
+            auto len = start_.wordOpe->parse(lit.data(), lit.size(), dummy_vs,
+                dummy_c, dummy_dt);
+            return success(len);
+        }
+
+        PegProgram& program_;
+        const Definition& start_;
+        std::shared_ptr<Ope> whitespace_;
+        std::vector<Subroutine> subroutines_;
+        std::vector<std::pair<size_t, size_t>> calls_;
+        bool word_mode_ = false;
+        bool supported_ = true;
+    };
+
+    inline bool PegProgram::compile(const Definition& start) {
+        code_.clear();
+        sets_.clear();
+        literals_.clear();
+        dictionaries_.clear();
+
+        CompilePegProgram vis(*this, start);
+        if (!vis.compile()) {
+            code_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool PegProgram::match(std::string_view sv) const {
+        if (code_.empty()) { return false; }
+
+        thread_local std::vector<Entry> stack;
+        stack.clear();
+
+        // Backtrack entries need a non-null position even for empty input
+        auto s = sv.data() ? sv.data() : "";
+        auto e = s + sv.size();
+        auto pc = code_.data();
+        uint32_t flags = 0;
+
+        for (;;) {
+            switch (pc->op) {
+            case OpCode::Char:
+                if (s < e && static_cast<unsigned char>(*s) == pc->arg) {
+                    s++;
+                    pc++;
+                    continue;
+                }
+                break;
+            case OpCode::Any: {
+                auto len = codepoint_length(s, static_cast<size_t>(e - s));
+                if (len > 0) {
+                    s += len;
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OpCode::Set: {
+                size_t len = 0;
+                if (s < e && match_set(sets_[pc->arg], s, e, len)) {
+                    s += len;
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OpCode::Literal: {
+                const auto& lit = literals_[pc->arg];
+                if (match_literal(lit, s, e)) {
+                    s += lit.text.size();
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OpCode::Dictionary: {
+                auto len = dictionaries_[pc->arg]->trie_.match(
+                    s, static_cast<size_t>(e - s));
+                if (len > 0) {
+                    s += len;
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OpCode::Choice:
+                stack.push_back({ code_.data() + pc->arg, s, flags });
+                pc++;
+                continue;
+            case OpCode::Commit:
+                stack.pop_back();
+                pc = code_.data() + pc->arg;
+                continue;
+            case OpCode::PartialCommit:
+                stack.back().s = s;
+                stack.back().flags = flags;
+                pc = code_.data() + pc->arg;
+                continue;
+            case OpCode::BackCommit:
+                s = stack.back().s;
+                flags = stack.back().flags;
+                stack.pop_back();
+                pc = code_.data() + pc->arg;
+                continue;
+            case OpCode::Fail:
+                break;
+            case OpCode::FailTwice:
+                stack.pop_back();
+                break;
+            case OpCode::Call:
+                stack.push_back({ pc + 1, nullptr, flags });
+                pc = code_.data() + pc->arg;
+                continue;
+            case OpCode::Ret:
+                pc = stack.back().pc;
+                flags = stack.back().flags;
+                stack.pop_back();
+                continue;
+            case OpCode::TokenBegin:
+                flags++;
+                pc++;
+                continue;
+            case OpCode::TokenEnd:
+                flags--;
+                pc++;
+                continue;
+            case OpCode::SkipWs:
+                if (flags == 0) {
+                    stack.push_back({ pc + 1, nullptr, flags });
+                    flags = in_whitespace_flag;
+                    pc = code_.data() + pc->arg;
+                }
+                else {
+                    pc++;
+                }
+                continue;
+            case OpCode::End:
+                if (s == e) {
+                    pc++;
+                    continue;
+                }
+                break;
+            case OpCode::Accept:
+                return true;
+            }
+
+            // Backtrack to the latest choice point, dropping return addresses
+            while (!stack.empty() && !stack.back().s) {
+                stack.pop_back();
+            }
+            if (stack.empty()) { return false; }
+            pc = stack.back().pc;
+            s = stack.back().s;
+            flags = stack.back().flags;
+            stack.pop_back();
+        }
+    }
+
+    /*-----------------------------------------------------------------------------
+     *  Grammar image
+     *---------------------------------------------------------------------------*/
+
+    // A loaded and checked grammar written out as a compact byte string, so a
+    // later process can restore it without running the ParserGenerator: rules,
+    // their operator graph and flags, the whitespace and word operators and
+    // the applied instructions. Actions, predicates and tracers are not part
+    // of it. The image records a hash of the grammar source and only loads
+    // against the same source. Grammars holding captures or user operators
+    // cannot be saved.
+    //
+    // Integers are LEB128 varints. After the header and the rule names come
+    // the operators in post-order, so every operator only refers to ones
+    // before it, then the body of each rule. The last 8 bytes hash the rest,
+    // so that a damaged cache file is rejected rather than half loaded.
+    namespace image {
+
+        inline constexpr char magic[4] = { 'P', 'E', 'G', 'I' };
+        inline constexpr uint64_t version = 3;
+
+        enum class Tag : uint8_t {
+            Sequence,
+            PrioritizedChoice,
+            Repetition,
+            AndPredicate,
+            NotPredicate,
+            Dictionary,
+            LiteralString,
+            CharacterClass,
+            Character,
+            AnyCharacter,
+            CaptureScope,
+            TokenBoundary,
+            Ignore,
+            WeakHolder,
+            Reference,
+            Whitespace,
+            BackReference,
+            PrecedenceClimbing,
+            Recovery,
+            Cut,
+        };
+
+        enum RuleFlag : uint64_t {
+            ignore_semantic_value = 1,
+            is_macro = 2,
+            memoize = 4,
+            no_ast_opt = 8,
+            disable_action = 16,
+            eoi_check = 32,
+        };
+
+        // FNV-1a
+        inline uint64_t hash(std::string_view sv) {
+            uint64_t h = 14695981039346656037ull;
+            for (auto ch : sv) {
+                h = (h ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+            }
+            return h;
+        }
+
+        inline void write_varint(std::string& out, uint64_t v) {
+            while (v >= 0x80) {
+                out += static_cast<char>((v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            out += static_cast<char>(v);
+        }
+
+        inline void write_string(std::string& out, std::string_view sv) {
+            write_varint(out, sv.size());
+            out.append(sv.data(), sv.size());
+        }
+
+        // Reads an image, failing instead of reading past its end
+        class Reader {
+        public:
+            explicit Reader(std::string_view data) : data_(data) {}
+
+            bool varint(uint64_t& v) {
+                v = 0;
+                for (unsigned shift = 0; shift < 64; shift += 7) {
+                    if (pos_ >= data_.size()) { return false; }
+                    auto byte = static_cast<unsigned char>(data_[pos_++]);
+                    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) { return true; }
+                }
+                return false;
+            }
+
+            bool size(size_t& v, uint64_t limit) {
+                uint64_t u = 0;
+                if (!varint(u) || u >= limit) { return false; }
+                v = static_cast<size_t>(u);
+                return true;
+            }
+
+            bool string(std::string_view& sv) {
+                size_t n = 0;
+                if (!size(n, remaining() + 1)) { return false; }
+                sv = data_.substr(pos_, n);
+                pos_ += n;
+                return true;
+            }
+
+            bool bytes(const char* expected, size_t n) {
+                if (remaining() < n || data_.compare(pos_, n, expected, n) != 0) {
+                    return false;
+                }
+                pos_ += n;
+                return true;
+            }
+
+            size_t remaining() const { return data_.size() - pos_; }
+
+        private:
+            std::string_view data_;
+            size_t pos_ = 0;
+        };
+
+    } // namespace image
+
+    // Writes operators in post-order and numbers them; shared operators, such
+    // as the whitespace rule's body in the start rule's whitespace operator,
+    // are written once
+    struct GrammarImageWriter : public Ope::Visitor {
+        using Ope::Visitor::visit;
+        using Tag = image::Tag;
+
+        GrammarImageWriter(const std::vector<const Definition*>& rules,
+            std::string_view source)
+            : source_(source) {
+            for (size_t i = 0; i < rules.size(); i++) {
+                rule_ids_[rules[i]] = i;
+            }
+        }
+
+        // Id of `ope` plus one, or 0 for none
+        uint64_t write(const std::shared_ptr<Ope>& ope) {
+            if (!ope || !ok) { return 0; }
+            auto it = ids_.find(ope.get());
+            if (it != ids_.end()) { return it->second + 1; }
+            ope->accept(*this);
+            if (!ok) { return 0; }
+            auto id = count++;
+            ids_[ope.get()] = id;
+            return id + 1;
+        }
+
+        void visit(Sequence& ope) override {
+            auto ids = write_all(ope.opes_);
+            node(Tag::Sequence);
+            write_ids(ids);
+        }
+        void visit(PrioritizedChoice& ope) override {
+            auto ids = write_all(ope.opes_);
+            node(Tag::PrioritizedChoice);
+            image::write_varint(nodes, ope.for_label_);
+            write_ids(ids);
+        }
+        void visit(Repetition& ope) override {
+            auto id = write(ope.ope_);
+            node(Tag::Repetition);
+            image::write_varint(nodes, id);
+            image::write_varint(nodes, ope.min_);
+            // 0 for an unbounded repetition, so that the image is the same
+            // whatever the width of size_t
+            auto unbounded = ope.max_ == std::numeric_limits<size_t>::max();
+            image::write_varint(nodes, unbounded ? 0 : uint64_t(ope.max_) + 1);
+        }
+        void visit(AndPredicate& ope) override { unary(Tag::AndPredicate, ope.ope_); }
+        void visit(NotPredicate& ope) override { unary(Tag::NotPredicate, ope.ope_); }
+        void visit(Dictionary& ope) override {
+            node(Tag::Dictionary);
+            image::write_varint(nodes, ope.items_.size());
+            for (const auto& item : ope.items_) {
+                image::write_string(nodes, item);
+            }
+            image::write_varint(nodes, ope.ignore_case_);
+        }
+        void visit(LiteralString& ope) override {
+            node(Tag::LiteralString);
+            image::write_string(nodes, ope.lit_);
+            image::write_varint(nodes, ope.ignore_case_);
+        }
+        void visit(CharacterClass& ope) override {
+            node(Tag::CharacterClass);
+            image::write_varint(nodes, ope.ranges_.size());
+            for (const auto& [lo, hi] : ope.ranges_) {
+                image::write_varint(nodes, lo);
+                image::write_varint(nodes, hi);
+            }
+            image::write_varint(nodes, ope.negated_);
+            image::write_varint(nodes, ope.ignore_case_);
+        }
+        void visit(Character& ope) override {
+            node(Tag::Character);
+            image::write_varint(nodes, static_cast<unsigned char>(ope.ch_));
+        }
+        void visit(AnyCharacter& /*ope*/) override { node(Tag::AnyCharacter); }
+        void visit(CaptureScope& ope) override { unary(Tag::CaptureScope, ope.ope_); }
+        void visit(Capture& /*ope*/) override { ok = false; }
+        void visit(TokenBoundary& ope) override { unary(Tag::TokenBoundary, ope.ope_); }
+        void visit(Ignore& ope) override { unary(Tag::Ignore, ope.ope_); }
+        void visit(User& /*ope*/) override { ok = false; }
+        void visit(WeakHolder& ope) override {
+            // Only as a rule's own reference to itself
+            auto holder = std::dynamic_pointer_cast<Holder>(ope.weak_.lock());
+            auto rule = holder ? rule_id(holder->outer_) : 0;
+            if (!rule) {
+                ok = false;
+                return;
+            }
+            node(Tag::WeakHolder);
+            image::write_varint(nodes, rule);
+        }
+        void visit(Holder& /*ope*/) override { ok = false; }
+        void visit(Reference& ope) override {
+            auto args = write_all(ope.args_);
+            auto rule = ope.rule_ ? rule_id(ope.rule_) : 0;
+            if (ope.rule_ && !rule) {
+                ok = false;
+                return;
+            }
+            node(Tag::Reference);
+            image::write_string(nodes, ope.name_);
+            image::write_varint(nodes, ope.is_macro_);
+            write_ids(args);
+            image::write_varint(nodes, rule);
+            image::write_varint(nodes, ope.iarg_);
+        }
+        void visit(Whitespace& ope) override { unary(Tag::Whitespace, ope.ope_); }
+        void visit(BackReference& ope) override {
+            node(Tag::BackReference);
+            image::write_string(nodes, ope.name_);
+        }
+        void visit(PrecedenceClimbing& ope) override {
+            auto atom = write(ope.atom_);
+            auto binop = write(ope.binop_);
+            auto rule = rule_id(&ope.rule_);
+            if (!rule) {
+                ok = false;
+                return;
+            }
+            node(Tag::PrecedenceClimbing);
+            image::write_varint(nodes, atom);
+            image::write_varint(nodes, binop);
+            image::write_varint(nodes, ope.info_.size());
+            // Operators are views of the grammar source
+            std::less<const char*> before;
+            auto begin = source_.data(), end = begin + source_.size();
+            for (const auto& [op, level_assoc] : ope.info_) {
+                if (before(op.data(), begin) || before(end, op.data() + op.size())) {
+                    ok = false;
+                    return;
+                }
+                image::write_varint(nodes, static_cast<uint64_t>(op.data() - begin));
+                image::write_varint(nodes, op.size());
+                image::write_varint(nodes, level_assoc.first);
+                image::write_varint(nodes, static_cast<unsigned char>(level_assoc.second));
+            }
+            image::write_varint(nodes, ope.ignore_case_);
+            image::write_varint(nodes, rule);
+        }
+        void visit(Recovery& ope) override { unary(Tag::Recovery, ope.ope_); }
+        void visit(Cut& /*ope*/) override { node(Tag::Cut); }
+
+        // Index of the rule plus one, or 0 if it is not in the grammar
+        uint64_t rule_id(const Definition* rule) const {
+            auto it = rule_ids_.find(rule);
+            return it != rule_ids_.end() ? it->second + 1 : 0;
+        }
+
+        std::string nodes;
+        uint64_t count = 0;
+        bool ok = true;
+
+    private:
+        void node(Tag tag) { nodes += static_cast<char>(tag); }
+
+        void unary(Tag tag, const std::shared_ptr<Ope>& ope) {
+            auto id = write(ope);
+            node(tag);
+            image::write_varint(nodes, id);
+        }
+
+        std::vector<uint64_t> write_all(const std::vector<std::shared_ptr<Ope>>& opes) {
+            std::vector<uint64_t> ids;
+            for (const auto& ope : opes) {
+                ids.push_back(write(ope));
+            }
+            return ids;
+        }
+
+        void write_ids(const std::vector<uint64_t>& ids) {
+            image::write_varint(nodes, ids.size());
+            for (auto id : ids) {
+                image::write_varint(nodes, id);
+            }
+        }
+
+        std::string_view source_;
+        std::unordered_map<const Ope*, uint64_t> ids_;
+        std::unordered_map<const Definition*, uint64_t> rule_ids_;
+    };
+
+    // Rebuilds a grammar from an image written by save_grammar_image
+    class GrammarImageReader {
+    public:
+        using Tag = image::Tag;
+
+        GrammarImageReader(std::string_view data, std::string_view source)
+            : in_(data.substr(0, data.size() - (std::min)(data.size(), size_t(8)))),
+            source_(source) {
+            if (data.size() >= 8) {
+                uint64_t hash = 0;
+                for (size_t i = 0; i < 8; i++) {
+                    hash |= uint64_t(static_cast<unsigned char>(data[data.size() - 8 + i]))
+                        << (8 * i);
+                }
+                checked_ = hash == image::hash(data.substr(0, data.size() - 8));
+            }
+        }
+
+        std::shared_ptr<Grammar> read(std::string& start, bool& enablePackratParsing) {
+            if (!checked_) { return nullptr; }
+
+            uint64_t version = 0, source_size = 0, hash = 0, packrat = 0;
+            if (!in_.bytes(image::magic, sizeof(image::magic)) || !in_.varint(version) ||
+                version != image::version || !in_.varint(source_size) ||
+                source_size != source_.size() || !in_.varint(hash) ||
+                hash != image::hash(source_)) {
+                return nullptr;
+            }
+
+            auto grammar = std::make_shared<Grammar>();
+            size_t rule_count = 0, start_id = 0;
+            if (!in_.size(rule_count, in_.remaining() + 1)) { return nullptr; }
+            for (size_t i = 0; i < rule_count; i++) {
+                std::string_view name;
+                if (!in_.string(name)) { return nullptr; }
+                auto& rule = (*grammar)[std::string(name)];
+                rule.name = std::string(name);
+                rules_.push_back(&rule);
+            }
+            if (rules_.size() != grammar->size() ||
+                !in_.size(start_id, rule_count) || !in_.varint(packrat)) {
+                return nullptr;
+            }
+
+            size_t node_count = 0;
+            if (!in_.size(node_count, in_.remaining() + 1)) { return nullptr; }
+            for (size_t i = 0; i < node_count; i++) {
+                auto ope = read_node(*grammar);
+                if (!ope) { return nullptr; }
+                nodes_.push_back(std::move(ope));
+            }
+
+            for (auto rule : rules_) {
+                if (!read_rule(*rule)) { return nullptr; }
+            }
+            if (in_.remaining()) { return nullptr; }
+
+            optimize_grammar(*grammar);
+
+            BuildChoiceDispatch vis;
+            for (auto& [name, rule] : *grammar) {
+                rule.accept(vis);
+            }
+
+            start = rules_[start_id]->name;
+            enablePackratParsing = packrat != 0;
+            return grammar;
+        }
+
+    private:
+        bool node_id(std::shared_ptr<Ope>& ope) {
+            size_t id = 0;
+            if (!in_.size(id, nodes_.size() + 1) || id == 0) { return false; }
+            ope = nodes_[id - 1];
+            return true;
+        }
+
+        bool optional_node_id(std::shared_ptr<Ope>& ope) {
+            size_t id = 0;
+            if (!in_.size(id, nodes_.size() + 1)) { return false; }
+            ope = id ? nodes_[id - 1] : nullptr;
+            return true;
+        }
+
+        bool node_ids(std::vector<std::shared_ptr<Ope>>& opes) {
+            size_t n = 0;
+            if (!in_.size(n, in_.remaining() + 1)) { return false; }
+            opes.resize(n);
+            for (auto& ope : opes) {
+                if (!node_id(ope)) { return false; }
+            }
+            return true;
+        }
+
+        // Rule index plus one, 0 for none
+        bool rule_id(Definition*& rule) {
+            size_t id = 0;
+            if (!in_.size(id, rules_.size() + 1)) { return false; }
+            rule = id ? rules_[id - 1] : nullptr;
+            return true;
+        }
+
+        bool flag(bool& b) {
+            uint64_t v = 0;
+            if (!in_.varint(v) || v > 1) { return false; }
+            b = v != 0;
+            return true;
+        }
+
+        std::shared_ptr<Ope> read_node(const Grammar& grammar) {
+            uint64_t tag = 0;
+            if (!in_.varint(tag) || tag > static_cast<uint64_t>(Tag::Cut)) {
+                return nullptr;
+            }
+
+            std::shared_ptr<Ope> ope;
+            std::vector<std::shared_ptr<Ope>> opes;
+            switch (static_cast<Tag>(tag)) {
+            case Tag::Sequence:
+                if (!node_ids(opes)) { return nullptr; }
+                return std::make_shared<Sequence>(std::move(opes));
+            case Tag::PrioritizedChoice: {
+                bool for_label = false;
+                if (!flag(for_label) || !node_ids(opes)) { return nullptr; }
+                auto choice = std::make_shared<PrioritizedChoice>(std::move(opes));
+                choice->for_label_ = for_label;
+                return choice;
+            }
+            case Tag::Repetition: {
+                uint64_t min = 0, max = 0;
+                if (!node_id(ope) || !in_.varint(min) || !in_.varint(max)) {
+                    return nullptr;
+                }
+                constexpr uint64_t size_max = std::numeric_limits<size_t>::max();
+                if (min > size_max || (max && max - 1 > size_max)) { return nullptr; }
+                return rep(ope, static_cast<size_t>(min),
+                    max ? static_cast<size_t>(max - 1) : std::numeric_limits<size_t>::max());
+            }
+            case Tag::AndPredicate:
+                if (!node_id(ope)) { return nullptr; }
+                return apd(ope);
+            case Tag::NotPredicate:
+                if (!node_id(ope)) { return nullptr; }
+                return npd(ope);
+            case Tag::Dictionary: {
+                size_t n = 0;
+                if (!in_.size(n, in_.remaining() + 1)) { return nullptr; }
+                std::vector<std::string> items;
+                for (size_t i = 0; i < n; i++) {
+                    std::string_view item;
+                    if (!in_.string(item)) { return nullptr; }
+                    items.emplace_back(item);
+                }
+                bool ignore_case = false;
+                if (!flag(ignore_case)) { return nullptr; }
+                return dic(items, ignore_case);
+            }
+            case Tag::LiteralString: {
+                std::string_view lit;
+                bool ignore_case = false;
+                if (!in_.string(lit) || !flag(ignore_case)) { return nullptr; }
+                return std::make_shared<LiteralString>(std::string(lit), ignore_case);
+            }
+            case Tag::CharacterClass: {
+                size_t n = 0;
+                if (!in_.size(n, in_.remaining() + 1) || n == 0) { return nullptr; }
+                std::vector<std::pair<char32_t, char32_t>> ranges;
+                for (size_t i = 0; i < n; i++) {
+                    uint64_t lo = 0, hi = 0;
+                    if (!in_.varint(lo) || !in_.varint(hi) || lo > 0x10ffff ||
+                        hi > 0x10ffff) {
+                        return nullptr;
+                    }
+                    ranges.emplace_back(static_cast<char32_t>(lo),
+                        static_cast<char32_t>(hi));
+                }
+                bool negated = false, ignore_case = false;
+                if (!flag(negated) || !flag(ignore_case)) { return nullptr; }
+                return std::make_shared<CharacterClass>(ranges, negated, ignore_case);
+            }
+            case Tag::Character: {
+                uint64_t ch = 0;
+                if (!in_.varint(ch) || ch > 0xff) { return nullptr; }
+                return chr(static_cast<char>(ch));
+            }
+            case Tag::AnyCharacter: return dot();
+            case Tag::CaptureScope:
+                if (!node_id(ope)) { return nullptr; }
+                return csc(ope);
+            case Tag::TokenBoundary:
+                if (!node_id(ope)) { return nullptr; }
+                return tok(ope);
+            case Tag::Ignore:
+                if (!node_id(ope)) { return nullptr; }
+                return ign(ope);
+            case Tag::WeakHolder: {
+                Definition* rule = nullptr;
+                if (!rule_id(rule) || !rule) { return nullptr; }
+                return static_cast<std::shared_ptr<Ope>>(*rule);
+            }
+            case Tag::Reference: {
+                std::string_view name;
+                bool is_macro = false;
+                Definition* rule = nullptr;
+                size_t iarg = 0;
+                if (!in_.string(name) || !flag(is_macro) || !node_ids(opes) ||
+                    !rule_id(rule) || !in_.size(iarg, in_.remaining() + 1)) {
+                    return nullptr;
+                }
+                auto reference = std::make_shared<Reference>(grammar, std::string(name),
+                    nullptr, is_macro, opes);
+                reference->rule_ = rule;
+                reference->iarg_ = iarg;
+                return reference;
+            }
+            case Tag::Whitespace:
+                if (!node_id(ope)) { return nullptr; }
+                return std::make_shared<Whitespace>(ope);
+            case Tag::BackReference: {
+                std::string_view name;
+                if (!in_.string(name)) { return nullptr; }
+                return std::make_shared<BackReference>(std::string(name));
+            }
+            case Tag::PrecedenceClimbing: {
+                std::shared_ptr<Ope> binop;
+                size_t n = 0;
+                if (!node_id(ope) || !node_id(binop) ||
+                    !in_.size(n, in_.remaining() + 1)) {
+                    return nullptr;
+                }
+                PrecedenceClimbing::BinOpeInfo info;
+                for (size_t i = 0; i < n; i++) {
+                    size_t offset = 0, length = 0, level = 0;
+                    uint64_t assoc = 0;
+                    if (!in_.size(offset, source_.size() + 1) ||
+                        !in_.size(length, source_.size() - offset + 1) ||
+                        !in_.size(level, in_.remaining() + 1) || !in_.varint(assoc) ||
+                        (assoc != 'L' && assoc != 'R')) {
+                        return nullptr;
+                    }
+                    info[source_.substr(offset, length)] = { level, static_cast<char>(assoc) };
+                }
+                uint64_t ignore_case = 0;
+                Definition* rule = nullptr;
+                if (!in_.varint(ignore_case) || ignore_case > 1 || !rule_id(rule) || !rule) {
+                    return nullptr;
+                }
+                return pre(ope, binop, info, *rule, ignore_case != 0);
+            }
+            case Tag::Recovery:
+                if (!node_id(ope)) { return nullptr; }
+                return rec(ope);
+            case Tag::Cut: return cut();
+            }
+            return nullptr;
+        }
+
+        bool read_rule(Definition& rule) {
+            std::shared_ptr<Ope> core;
+            uint64_t flags = 0;
+            size_t param_count = 0, line = 0, col = 0;
+            std::string_view error_message;
+            if (!node_id(core) || !in_.varint(flags) ||
+                !in_.size(param_count, in_.remaining() + 1)) {
+                return false;
+            }
+            for (size_t i = 0; i < param_count; i++) {
+                std::string_view param;
+                if (!in_.string(param)) { return false; }
+                rule.params.emplace_back(param);
+            }
+            if (!in_.string(error_message) || !in_.size(line, source_.size() + 2) ||
+                !in_.size(col, source_.size() + 2) ||
+                !optional_node_id(rule.whitespaceOpe) ||
+                !optional_node_id(rule.wordOpe)) {
+                return false;
+            }
+
+            rule <= core;
+            rule.s_ = nullptr;
+            rule.line_ = { line, col };
+            rule.ignoreSemanticValue = flags & image::ignore_semantic_value;
+            rule.is_macro = flags & image::is_macro;
+            rule.memoize = flags & image::memoize;
+            rule.no_ast_opt = flags & image::no_ast_opt;
+            rule.disable_action = flags & image::disable_action;
+            rule.eoi_check = flags & image::eoi_check;
+            rule.error_message = std::string(error_message);
+            return true;
+        }
+
+        image::Reader in_;
+        std::string_view source_;
+        bool checked_ = false;
+        std::vector<Definition*> rules_;
+        std::vector<std::shared_ptr<Ope>> nodes_;
+    };
+
+    // Writes `grammar`, loaded from `source`, as an image. False if it holds
+    // operators an image cannot represent.
+    inline bool save_grammar_image(const Grammar& grammar, const std::string& start,
+        bool enablePackratParsing, std::string_view source, std::string& out) {
+        std::vector<const Definition*> rules;
+        for (const auto& [name, rule] : grammar) {
+            rules.push_back(&rule);
+        }
+        std::sort(rules.begin(), rules.end(),
+            [](auto a, auto b) { return a->name < b->name; });
+
+        GrammarImageWriter writer(rules, source);
+        std::vector<uint64_t> cores;
+        for (auto rule : rules) {
+            cores.push_back(writer.write(rule->get_core_operator()));
+            writer.write(rule->whitespaceOpe);
+            writer.write(rule->wordOpe);
+        }
+        auto start_it = grammar.find(start);
+        if (!writer.ok || start_it == grammar.end()) { return false; }
+
+        std::string s(image::magic, sizeof(image::magic));
+        image::write_varint(s, image::version);
+        image::write_varint(s, source.size());
+        image::write_varint(s, image::hash(source));
+        image::write_varint(s, rules.size());
+        for (auto rule : rules) {
+            image::write_string(s, rule->name);
+        }
+        image::write_varint(s, writer.rule_id(&start_it->second) - 1);
+        image::write_varint(s, enablePackratParsing);
+        image::write_varint(s, writer.count);
+        s += writer.nodes;
+
+        for (size_t i = 0; i < rules.size(); i++) {
+            const auto& rule = *rules[i];
+            if (!cores[i]) { return false; }
+            uint64_t flags = 0;
+            if (rule.ignoreSemanticValue) { flags |= image::ignore_semantic_value; }
+            if (rule.is_macro) { flags |= image::is_macro; }
+            if (rule.memoize) { flags |= image::memoize; }
+            if (rule.no_ast_opt) { flags |= image::no_ast_opt; }
+            if (rule.disable_action) { flags |= image::disable_action; }
+            if (rule.eoi_check) { flags |= image::eoi_check; }
+            image::write_varint(s, cores[i]);
+            image::write_varint(s, flags);
+            image::write_varint(s, rule.params.size());
+            for (const auto& param : rule.params) {
+                image::write_string(s, param);
+            }
+            image::write_string(s, rule.error_message);
+            image::write_varint(s, rule.line_.first);
+            image::write_varint(s, rule.line_.second);
+            image::write_varint(s, writer.write(rule.whitespaceOpe));
+            image::write_varint(s, writer.write(rule.wordOpe));
+        }
+
+        auto hash = image::hash(s);
+        for (size_t i = 0; i < 8; i++) {
+            s += static_cast<char>((hash >> (8 * i)) & 0xff);
+        }
+        out = std::move(s);
+        return true;
+    }
+
+    /*-----------------------------------------------------------------------------
+     *  Parser source generation
+     *---------------------------------------------------------------------------*/
+
+    // Writes a grammar as the C++ source of a standalone recursive descent
+    // parser. Each rule becomes a member function, literals and character
+    // classes are matched inline and references are direct calls, with no Ope
+    // graph, Context or std::any left at run time.
+    //
+    // The generated class template, `Name<T, Actions>`, produces values the
+    // way typed_parser<T> does: a rule's value is `actions.RULE(match, values)`
+    // when Actions has that member, else its first value or T{}. Like
+    // PegProgram, it keeps no packrat memo and records no error position.
+    // generate() returns false for grammars using macros, captures and back
+    // references, cut, user operators, precedence climbing, error recovery,
+    // %word or rules with semantic predicates.
+    struct GenerateParserSource : public Ope::Visitor {
+        using Ope::Visitor::visit;
+
+        GenerateParserSource(const Definition& start, std::string_view source)
+            : start_(start), source_(source) {}
+
+        bool generate(std::string_view name_space, std::string_view class_name,
+            std::string& out) {
+            if (start_.wordOpe || !is_identifier(class_name) ||
+                source_.find(")peg\"") != std::string_view::npos) {
+                return false;
+            }
+            if (start_.whitespaceOpe) {
+                auto ws = dynamic_cast<Whitespace*>(start_.whitespaceOpe.get());
+                if (!ws) { return false; }
+                whitespace_ = ws->ope_;
+                auto rep = dynamic_cast<Repetition*>(whitespace_.get());
+                whitespace_can_fail_ = !rep || rep->min_ > 0;
+            }
+
+            base_ = name_space.empty() ? 0 : 1;
+            auto start = call_name(start_);
+            for (size_t i = 0; i < rules_.size() && supported_; i++) {
+                emit_rule(*rules_[i]);
+            }
+            if (whitespace_ && supported_) { emit_whitespace(); }
+            if (!supported_) { return false; }
+
+            std::string match(class_name);
+            match += "Match";
+            std::string s;
+            auto put = [&](size_t level, std::string_view text) {
+                if (!text.empty()) { s.append((base_ + level) * 4, ' '); }
+                s += text;
+                s += '\n';
+                };
+
+            s += "//\n"
+                "//  Generated by peg::generate_parser_source. Do not edit; change the\n"
+                "//  grammar and generate it again.\n"
+                "//\n\n"
+                "#pragma once\n\n"
+                "#include <cstddef>\n"
+                "#include <cstdint>\n"
+                "#include <cstring>\n"
+                "#include <span>\n"
+                "#include <string_view>\n"
+                "#include <utility>\n"
+                "#include <vector>\n\n";
+            if (!name_space.empty()) {
+                s += "namespace ";
+                s += name_space;
+                s += " {\n\n";
+            }
+
+            put(0, "// What a rule matched, passed to the action hooks of " +
+                std::string(class_name));
+            put(0, "struct " + match + " {");
+            put(1, "std::string_view sv;");
+            put(1, "std::span<const std::string_view> tokens;");
+            put(1, "size_t choice;");
+            put(1, "std::string_view input;");
+            put(0, "");
+            put(1, "std::string_view token(size_t id = 0) const {");
+            put(2, "return tokens.empty() ? sv : tokens[id];");
+            put(1, "}");
+            put(0, "");
+            put(1, "// Line and byte column at which the match starts");
+            put(1, "std::pair<size_t, size_t> line_info() const {");
+            put(2, "size_t line = 1;");
+            put(2, "auto col = input.data();");
+            put(2, "for (auto p = input.data(); p != sv.data(); p++) {");
+            put(3, "if (*p == '\\n') {");
+            put(4, "line++;");
+            put(4, "col = p + 1;");
+            put(3, "}");
+            put(2, "}");
+            put(2, "return { line, static_cast<size_t>(sv.data() - col) + 1 };");
+            put(1, "}");
+            put(0, "};");
+            put(0, "");
+            put(0, "// Parses sentences of grammar_source. The hooks of Actions take");
+            put(0, "// `(const " + match + "&, std::span<const T>)` and return a T.");
+            put(0, "// An instance keeps its stacks between calls, so give each thread its");
+            put(0, "// own.");
+            put(0, "template <typename T, typename Actions> class " +
+                std::string(class_name) + " {");
+            put(0, "public:");
+            put(1, "using Match = " + match + ";");
+            put(0, "");
+            put(1, "static constexpr std::string_view grammar_source = R\"peg(" +
+                std::string(source_) + ")peg\";");
+            put(0, "");
+            put(1, "// Stores the value of the start rule in `value`; false if `input` is");
+            put(1, "// not a sentence of the grammar");
+            put(1, "bool parse(std::string_view input, Actions& actions, T& value) {");
+            put(2, "s_ = input.data();");
+            put(2, "n_ = input.size();");
+            put(2, "p_ = 0;");
+            put(2, "actions_ = &actions;");
+            put(2, "values_.clear();");
+            put(2, "tokens_.clear();");
+            put(2, "token_depth_ = 0;");
+            put(2, "in_whitespace_ = false;");
+            if (whitespace_) { put(2, "if (!skip_whitespace()) { return false; }"); }
+            put(2, "if (!" + start + "()) { return false; }");
+            if (start_.eoi_check) { put(2, "if (p_ != n_) { return false; }"); }
+            put(2, "if (!values_.empty()) { value = values_.front(); }");
+            put(2, "return true;");
+            put(1, "}");
+            put(0, "");
+            put(0, "private:");
+            s += runtime_support(match);
+            s += code_;
+            put(1, "const char* s_ = nullptr;");
+            put(1, "size_t n_ = 0;");
+            put(1, "size_t p_ = 0;");
+            put(1, "Actions* actions_ = nullptr;");
+            put(1, "std::vector<T> values_;");
+            put(1, "std::vector<std::string_view> tokens_;");
+            put(1, "size_t token_depth_ = 0;");
+            put(1, "bool in_whitespace_ = false;");
+            put(0, "};");
+            if (!name_space.empty()) {
+                s += "\n} // namespace ";
+                s += name_space;
+                s += '\n';
+            }
+            out = std::move(s);
+            return true;
+        }
+
+        void visit(Sequence& ope) override {
+            for (auto op : ope.opes_) {
+                op->accept(*this);
+            }
+        }
+        void visit(PrioritizedChoice& ope) override {
+            if (ope.opes_.empty()) {
+                line(fail_);
+                return;
+            }
+            auto id = std::to_string(next_id_++);
+            auto top = &ope == top_choice_;
+            auto count = ope.opes_.size();
+            auto marked = false;
+            for (size_t i = 0; i + 1 < count; i++) {
+                marked = marked || !is_atomic(*ope.opes_[i]);
+            }
+
+            line("{");
+            indent_++;
+            if (marked) { line("auto m" + id + " = mark();"); }
+            for (size_t i = 0; i < count; i++) {
+                auto last = i + 1 == count;
+                auto next = last ? fail_ : "goto L" + id + "_" + std::to_string(i + 1) + ";";
+                if (i > 0) {
+                    label("L" + id + "_" + std::to_string(i));
+                    if (marked) { line("reset(m" + id + ");"); }
+                }
+                // A terminal checks the byte itself
+                if (auto bytes = first_bytes(ope, i);
+                    !bytes.empty() && !is_atomic(*ope.opes_[i])) {
+                    line("if (p_ < n_ && !first_byte(s_[p_], " + bytes + ")) { " + next +
+                        " }");
+                }
+                if (!last) {
+                    line("{");
+                    indent_++;
+                }
+                emit(*ope.opes_[i], next);
+                if (top) { line("choice = " + std::to_string(i) + ";"); }
+                if (!last) {
+                    line("goto L" + id + ";");
+                    indent_--;
+                    line("}");
+                }
+            }
+            indent_--;
+            line("}");
+            label("L" + id, true);
+        }
+        void visit(Repetition& ope) override {
+            auto id = std::to_string(next_id_++);
+            auto atomic = is_atomic(*ope.ope_);
+            auto bounded = ope.max_ != std::numeric_limits<size_t>::max();
+            auto counted = bounded || ope.min_ > 0;
+            auto c = "c" + id;
+
+            if (counted) {
+                line("{");
+                indent_++;
+                line("size_t " + c + " = 0;");
+                line(bounded ? "for (; " + c + " < " + std::to_string(ope.max_) + "; " +
+                    c + "++) {"
+                    : "for (;; " + c + "++) {");
+            }
+            else {
+                line("for (;;) {");
+            }
+            indent_++;
+            if (!atomic) { line("auto m" + id + " = mark();"); }
+            emit(*ope.ope_, "goto L" + id + ";");
+            line("continue;");
+            label("L" + id);
+            if (!atomic) { line("reset(m" + id + ");"); }
+            line("break;");
+            indent_--;
+            line("}");
+            if (ope.min_ > 0) {
+                line("if (" + c + " < " + std::to_string(ope.min_) + ") { " + fail_ +
+                    " }");
+            }
+            if (counted) {
+                indent_--;
+                line("}");
+            }
+        }
+        void visit(AndPredicate& ope) override {
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("auto m" + id + " = mark();");
+            emit(*ope.ope_, fail_);
+            line("reset(m" + id + ");");
+            indent_--;
+            line("}");
+        }
+        void visit(NotPredicate& ope) override {
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("auto m" + id + " = mark();");
+            emit(*ope.ope_, "goto L" + id + ";");
+            line(fail_);
+            label("L" + id);
+            line("reset(m" + id + ");");
+            indent_--;
+            line("}");
+        }
+        void visit(Dictionary& ope) override {
+            auto words = ope.items_;
+            if (ope.ignore_case_) {
+                for (auto& word : words) {
+                    for (auto& ch : word) {
+                        ch = (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : ch;
+                    }
+                }
+            }
+            std::stable_sort(words.begin(), words.end(),
+                [](const auto& a, const auto& b) { return a.size() > b.size(); });
+            std::string list;
+            for (const auto& word : words) {
+                if (word.empty()) { continue; }
+                if (!list.empty()) { list += ", "; }
+                list += "std::string_view(" + c_string(word) + ", " +
+                    std::to_string(word.size()) + ")";
+            }
+
+            // The longest word that the input starts with
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("static constexpr std::string_view w" + id + "[] = { " + list + " };");
+            line("size_t l" + id + " = 0;");
+            line("for (auto word : w" + id + ") {");
+            line("    if (n_ - p_ >= word.size() &&");
+            if (ope.ignore_case_) {
+                line("        equal_ignore_case(s_ + p_, word.data(), word.size())) {");
+            }
+            else {
+                line("        std::memcmp(s_ + p_, word.data(), word.size()) == 0) {");
+            }
+            line("        l" + id + " = word.size();");
+            line("        break;");
+            line("    }");
+            line("}");
+            line("if (!l" + id + ") { " + fail_ + " }");
+            line("p_ += l" + id + ";");
+            indent_--;
+            line("}");
+            skip_whitespace();
+        }
+        void visit(LiteralString& ope) override {
+            const auto& lit = ope.lit_;
+            auto ignore_case = ope.ignore_case_ &&
+                std::any_of(lit.begin(), lit.end(), [](char ch) {
+                return std::isalpha(static_cast<unsigned char>(ch));
+                    });
+            if (lit.size() == 1 && !ignore_case) {
+                line("if (p_ == n_ || s_[p_] != " + c_char(lit[0]) + ") { " + fail_ +
+                    " }");
+                line("p_++;");
+            }
+            else if (!lit.empty()) {
+                auto size = std::to_string(lit.size());
+                if (ignore_case) {
+                    std::string lower;
+                    for (auto ch : lit) {
+                        lower += (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a')
+                            : ch;
+                    }
+                    line("if (n_ - p_ < " + size + " || !equal_ignore_case(s_ + p_, " +
+                        c_string(lower) + ", " + size + ")) { " + fail_ + " }");
+                }
+                else {
+                    line("if (n_ - p_ < " + size + " || std::memcmp(s_ + p_, " +
+                        c_string(lit) + ", " + size + ") != 0) { " + fail_ + " }");
+                }
+                line("p_ += " + size + ";");
+            }
+            skip_whitespace();
+        }
+        void visit(CharacterClass& ope) override {
+            line("if (!" + class_name(ope) + "()) { " + fail_ + " }");
+        }
+        void visit(Character& ope) override {
+            line("if (p_ == n_ || s_[p_] != " + c_char(ope.ch_) + ") { " + fail_ +
+                " }");
+            line("p_++;");
+        }
+        void visit(AnyCharacter&) override {
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("auto l" + id + " = codepoint_length(s_ + p_, n_ - p_);");
+            line("if (!l" + id + ") { " + fail_ + " }");
+            line("p_ += l" + id + ";");
+            indent_--;
+            line("}");
+        }
+        void visit(CaptureScope& ope) override { ope.ope_->accept(*this); }
+        void visit(Capture& ope) override {
+            if (ope.match_action_) {
+                supported_ = false;
+                return;
+            }
+            ope.ope_->accept(*this);
+        }
+        void visit(TokenBoundary& ope) override {
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("auto t" + id + " = p_;");
+            line("token_depth_++;");
+            in_token_++;
+            emit(*ope.ope_, "token_depth_--; " + fail_);
+            in_token_--;
+            line("token_depth_--;");
+            line("tokens_.emplace_back(s_ + t" + id + ", p_ - t" + id + ");");
+            indent_--;
+            line("}");
+            skip_whitespace();
+        }
+        void visit(Ignore& ope) override {
+            auto id = std::to_string(next_id_++);
+            line("{");
+            indent_++;
+            line("auto m" + id + " = mark();");
+            ope.ope_->accept(*this);
+            line("discard(m" + id + ");");
+            indent_--;
+            line("}");
+        }
+        void visit(User&) override { supported_ = false; }
+        void visit(WeakHolder& ope) override {
+            auto ptr = ope.weak_.lock();
+            if (ptr) { ptr->accept(*this); }
+        }
+        void visit(Holder& ope) override { call_rule(*ope.outer_); }
+        void visit(Reference& ope) override {
+            if (!ope.rule_) {
+                supported_ = false;
+                return;
+            }
+            call_rule(*ope.rule_);
+        }
+        void visit(Whitespace&) override { supported_ = false; }
+        void visit(BackReference&) override { supported_ = false; }
+        void visit(PrecedenceClimbing&) override { supported_ = false; }
+        void visit(Recovery&) override { supported_ = false; }
+        void visit(Cut&) override { supported_ = false; }
+
+    private:
+        static bool is_identifier(std::string_view name) {
+            if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+                return false;
+            }
+            return std::all_of(name.begin(), name.end(), [](char ch) {
+                return ch == '_' || std::isalnum(static_cast<unsigned char>(ch));
+                });
+        }
+
+        static std::string hex(uint64_t v) {
+            static const char digits[] = "0123456789abcdef";
+            std::string s;
+            do {
+                s.insert(s.begin(), digits[v & 15]);
+                v >>= 4;
+            } while (v);
+            return "0x" + s;
+        }
+
+        // Octal escapes, unlike hex ones, cannot run into a following digit
+        static std::string escape(char ch, char quote) {
+            auto b = static_cast<unsigned char>(ch);
+            if (b >= 0x20 && b < 0x7f && ch != quote && ch != '\\') {
+                return std::string(1, ch);
+            }
+            std::string s = "\\";
+            s += static_cast<char>('0' + ((b >> 6) & 7));
+            s += static_cast<char>('0' + ((b >> 3) & 7));
+            s += static_cast<char>('0' + (b & 7));
+            return s;
+        }
+
+        static std::string c_string(std::string_view sv) {
+            std::string s = "\"";
+            for (auto ch : sv) {
+                s += escape(ch, '"');
+            }
+            return s + "\"";
+        }
+
+        static std::string c_char(char ch) { return "'" + escape(ch, '\'') + "'"; }
+
+        void line(const std::string& text) {
+            if (!text.empty()) { code_.append((base_ + indent_) * 4, ' '); }
+            code_ += text;
+            code_ += '\n';
+        }
+
+        // A label goes one level out from the statements around it. `last`
+        // gives one ending a block the empty statement it needs.
+        void label(const std::string& name, bool last = false) {
+            code_.append((base_ + indent_ - 1) * 4, ' ');
+            code_ += name;
+            code_ += last ? ":;\n" : ":\n";
+        }
+
+        void emit(Ope& ope, const std::string& fail) {
+            auto outer = fail_;
+            fail_ = fail;
+            ope.accept(*this);
+            fail_ = outer;
+        }
+
+        // Whether `ope` fails without moving the position or leaving values,
+        // so backtracking over it needs no mark
+        bool is_atomic(Ope& ope) const {
+            if (dynamic_cast<Character*>(&ope) || dynamic_cast<CharacterClass*>(&ope) ||
+                dynamic_cast<AnyCharacter*>(&ope)) {
+                return true;
+            }
+            if (dynamic_cast<LiteralString*>(&ope) || dynamic_cast<Dictionary*>(&ope)) {
+                return !whitespace_ || in_token_ || !whitespace_can_fail_;
+            }
+            return false;
+        }
+
+        // The bytes alternative `i` can start with, as four bitmap words, from
+        // the masks BuildChoiceDispatch left on the choice; empty when any
+        // byte will do
+        static std::string first_bytes(const PrioritizedChoice& ope, size_t i) {
+            if (ope.dispatch_masks_.empty() || i >= 64) { return std::string(); }
+            uint64_t words[4] = {};
+            for (size_t b = 0; b < 256; b++) {
+                if ((ope.dispatch_masks_[ope.dispatch_index_[b]] >> i) & 1) {
+                    words[b >> 6] |= uint64_t(1) << (b & 63);
+                }
+            }
+            if (std::all_of(std::begin(words), std::end(words),
+                [](uint64_t w) { return w == ~uint64_t(0); })) {
+                return std::string();
+            }
+            return hex(words[0]) + "ull, " + hex(words[1]) + "ull, " + hex(words[2]) +
+                "ull, " + hex(words[3]) + "ull";
+        }
+
+        void skip_whitespace() {
+            if (whitespace_ && !in_token_ && !in_whitespace_) {
+                line("if (!token_depth_ && !skip_whitespace()) { " + fail_ + " }");
+            }
+        }
+
+        // The member function parsing `rule`, queued for emit_rule
+        std::string call_name(const Definition& rule) {
+            if (rule.is_macro || rule.predicate || !is_identifier(rule.name)) {
+                supported_ = false;
+                return std::string();
+            }
+            if (std::find(rules_.begin(), rules_.end(), &rule) == rules_.end()) {
+                rules_.push_back(&rule);
+            }
+            return "parse_" + rule.name;
+        }
+
+        void call_rule(const Definition& rule) {
+            auto name = call_name(rule);
+            if (!supported_) { return; }
+            line("if (!" + name + "()) { " + fail_ + " }");
+        }
+
+        void emit_rule(const Definition& rule) {
+            // Holder::parse_core reports the choice of a choice at the top of
+            // the rule, under a token boundary or not, and 0 otherwise
+            auto ope = rule.get_core_operator().get();
+            if (auto tok = dynamic_cast<TokenBoundary*>(ope)) { ope = tok->ope_.get(); }
+            top_choice_ = dynamic_cast<PrioritizedChoice*>(ope);
+
+            const auto& name = rule.name;
+            auto values = "std::span<const T> v";
+            indent_ = 1;
+            line("bool parse_" + name + "() {");
+            indent_++;
+            line("auto start = mark();");
+            if (top_choice_) { line("size_t choice = 0;"); }
+            emit(*rule.get_core_operator(), "return false;");
+            line("if constexpr (requires(Actions& a, const Match& m, " +
+                std::string(values) + ") { a." + name + "(m, v); }) {");
+            auto args = std::string("(match(start, ") + (top_choice_ ? "choice" : "0") +
+                "), values_since(start))";
+            if (rule.ignoreSemanticValue) {
+                line("    actions_->" + name + args + ";");
+                line("    discard(start);");
+            }
+            else {
+                line("    auto value = actions_->" + name + args + ";");
+                line("    discard(start);");
+                line("    values_.push_back(std::move(value));");
+            }
+            line("}");
+            line("else {");
+            line(rule.ignoreSemanticValue ? "    discard(start);"
+                : "    keep_first(start);");
+            line("}");
+            line("return true;");
+            indent_--;
+            line("}");
+            line("");
+            top_choice_ = nullptr;
+        }
+
+        // The Whitespace operator: a no-op while whitespace is being skipped
+        void emit_whitespace() {
+            indent_ = 1;
+            line("bool skip_whitespace() {");
+            indent_++;
+            line("if (in_whitespace_) { return true; }");
+            line("in_whitespace_ = true;");
+            in_whitespace_ = true;
+            emit(*whitespace_, "in_whitespace_ = false; return false;");
+            in_whitespace_ = false;
+            line("in_whitespace_ = false;");
+            line("return true;");
+            indent_--;
+            line("}");
+            line("");
+        }
+
+        std::string class_name(CharacterClass& ope) {
+            auto it = classes_.find(&ope);
+            if (it != classes_.end()) { return it->second; }
+            auto name = "match_class" + std::to_string(classes_.size());
+            classes_.emplace(&ope, name);
+
+            // Codepoints outside ASCII, or 0 when one does not decode, go
+            // through every range as CharacterClass::contains does
+            std::string ranges;
+            auto outside = ope.negated_;
+            for (auto [lo, hi] : ope.ranges_) {
+                if (ope.ignore_case_) {
+                    if (lo < 0x80) { lo = std::tolower(static_cast<int>(lo)); }
+                    if (hi < 0x80) { hi = std::tolower(static_cast<int>(hi)); }
+                }
+                if (!ranges.empty()) { ranges += " || "; }
+                ranges += "(" + hex(lo) + " <= cp && cp <= " + hex(hi) + ")";
+                outside = outside || hi >= 0x80 || lo == 0;
+            }
+
+            std::string comment = ope.negated_ ? "[^" : "[";
+            for (auto [lo, hi] : ope.ranges_) {
+                auto show = [&](char32_t cp) {
+                    if (cp >= 0x20 && cp < 0x7f && cp != '\\' && cp != ']' && cp != '-') {
+                        comment += static_cast<char>(cp);
+                    }
+                    else {
+                        comment += "\\u{" + hex(cp).substr(2) + "}";
+                    }
+                    };
+                show(lo);
+                if (hi != lo) {
+                    comment += '-';
+                    show(hi);
+                }
+            }
+            comment += ope.ignore_case_ ? "]i" : "]";
+
+            uint64_t ascii[2] = {};
+            for (char32_t cp = 0; cp < 0x80; cp++) {
+                if (ope.contains(cp)) { ascii[cp >> 6] |= uint64_t(1) << (cp & 63); }
+            }
+
+            auto& s = classes_code_;
+            auto put = [&](size_t level, const std::string& text) {
+                s.append((base_ + level) * 4, ' ');
+                s += text;
+                s += '\n';
+                };
+            put(1, "// " + comment);
+            put(1, "bool " + name + "() {");
+            put(2, "if (p_ == n_) { return false; }");
+            put(2, "auto ch = static_cast<unsigned char>(s_[p_]);");
+            put(2, "if (ch < 0x80) {");
+            put(3, "if (!(((ch < 64 ? " + hex(ascii[0]) + "ull : " + hex(ascii[1]) +
+                "ull) >> (ch & 63)) & 1)) { return false; }");
+            put(3, "p_++;");
+            put(3, "return true;");
+            put(2, "}");
+            if (outside) {
+                put(2, "char32_t cp = 0;");
+                put(2, "auto len = decode_codepoint(s_ + p_, n_ - p_, cp);");
+                put(2, std::string(ope.negated_ ? "if (" : "if (!(") + ranges +
+                    (ope.negated_ ? ") { return false; }" : ")) { return false; }"));
+                put(2, "p_ += len;");
+                put(2, "return true;");
+            }
+            else {
+                put(2, "return false;");
+            }
+            put(1, "}");
+            s += '\n';
+            return name;
+        }
+
+        std::string runtime_support(const std::string& match) const {
+            std::string s;
+            auto put = [&](size_t level, std::string_view text) {
+                if (!text.empty()) { s.append((base_ + level) * 4, ' '); }
+                s += text;
+                s += '\n';
+                };
+            put(1, "struct Mark {");
+            put(2, "size_t pos;");
+            put(2, "size_t values;");
+            put(2, "size_t tokens;");
+            put(1, "};");
+            put(0, "");
+            put(1, "Mark mark() const { return { p_, values_.size(), tokens_.size() }; }");
+            put(0, "");
+            put(1, "void reset(const Mark& m) {");
+            put(2, "p_ = m.pos;");
+            put(2, "discard(m);");
+            put(1, "}");
+            put(0, "");
+            put(1, "void discard(const Mark& m) {");
+            put(2, "values_.erase(values_.begin() + m.values, values_.end());");
+            put(2, "tokens_.erase(tokens_.begin() + m.tokens, tokens_.end());");
+            put(1, "}");
+            put(0, "");
+            put(1, "// Leaves the first value since `m`, or T{} if there is none");
+            put(1, "void keep_first(const Mark& m) {");
+            put(2, "if (values_.size() == m.values) {");
+            put(3, "values_.emplace_back();");
+            put(2, "}");
+            put(2, "else {");
+            put(3, "values_.erase(values_.begin() + m.values + 1, values_.end());");
+            put(2, "}");
+            put(2, "tokens_.erase(tokens_.begin() + m.tokens, tokens_.end());");
+            put(1, "}");
+            put(0, "");
+            put(1, match + " match(const Mark& m, size_t choice) const {");
+            put(2, "return { std::string_view(s_ + m.pos, p_ - m.pos),");
+            put(3, "std::span<const std::string_view>(tokens_.data() + m.tokens,");
+            put(4, "tokens_.size() - m.tokens),");
+            put(3, "choice, std::string_view(s_, n_) };");
+            put(1, "}");
+            put(0, "");
+            put(1, "std::span<const T> values_since(const Mark& m) const {");
+            put(2, "return std::span<const T>(values_.data() + m.values,");
+            put(3, "values_.size() - m.values);");
+            put(1, "}");
+            put(0, "");
+            put(1, "static bool equal_ignore_case(const char* s, const char* lower,");
+            put(2, "size_t n) {");
+            put(2, "for (size_t i = 0; i < n; i++) {");
+            put(3, "auto ch = s[i];");
+            put(3, "if (ch >= 'A' && ch <= 'Z') { ch = static_cast<char>(ch - 'A' + 'a'); }");
+            put(3, "if (ch != lower[i]) { return false; }");
+            put(2, "}");
+            put(2, "return true;");
+            put(1, "}");
+            put(0, "");
+            put(1, "// Whether byte `ch` is in the bitmap of words b0 to b3");
+            put(1, "static bool first_byte(char ch, uint64_t b0, uint64_t b1, uint64_t b2,");
+            put(2, "uint64_t b3) {");
+            put(2, "auto b = static_cast<unsigned char>(ch);");
+            put(2, "auto word = b < 128 ? (b < 64 ? b0 : b1) : (b < 192 ? b2 : b3);");
+            put(2, "return (word >> (b & 63)) & 1;");
+            put(1, "}");
+            put(0, "");
+            put(1, "static size_t codepoint_length(const char* s, size_t n) {");
+            put(2, "if (!n) { return 0; }");
+            put(2, "auto b = static_cast<unsigned char>(s[0]);");
+            put(2, "if ((b & 0x80) == 0) { return 1; }");
+            put(2, "if ((b & 0xE0) == 0xC0) { return n >= 2 ? 2 : 0; }");
+            put(2, "if ((b & 0xF0) == 0xE0) { return n >= 3 ? 3 : 0; }");
+            put(2, "if ((b & 0xF8) == 0xF0) { return n >= 4 ? 4 : 0; }");
+            put(2, "return 0;");
+            put(1, "}");
+            put(0, "");
+            put(1, "static size_t decode_codepoint(const char* s, size_t n, char32_t& cp) {");
+            put(2, "auto len = codepoint_length(s, n);");
+            put(2, "auto b = static_cast<unsigned char>(s[0]);");
+            put(2, "if (len == 1) { cp = b; }");
+            put(2, "else if (len == 2) { cp = b & 0x1F; }");
+            put(2, "else if (len == 3) { cp = b & 0x0F; }");
+            put(2, "else if (len == 4) { cp = b & 0x07; }");
+            put(2, "for (size_t i = 1; i < len; i++) {");
+            put(3, "cp = (cp << 6) | (static_cast<unsigned char>(s[i]) & 0x3F);");
+            put(2, "}");
+            put(2, "return len;");
+            put(1, "}");
+            put(0, "");
+            return s + classes_code_;
+        }
+
+        const Definition& start_;
+        std::string_view source_;
+        std::shared_ptr<Ope> whitespace_;
+        bool whitespace_can_fail_ = false;
+        std::vector<const Definition*> rules_;
+        std::unordered_map<const CharacterClass*, std::string> classes_;
+        std::string classes_code_;
+        std::string code_;
+        std::string fail_;
+        const PrioritizedChoice* top_choice_ = nullptr;
+        size_t base_ = 0;
+        size_t indent_ = 0;
+        size_t next_id_ = 0;
+        size_t in_token_ = 0;
+        bool in_whitespace_ = false;
+        bool supported_ = true;
+    };
+
+    // Writes the parser source for the grammar of `start`, loaded from
+    // `source`, as class template `class_name` in namespace `name_space`.
+    // False if the grammar uses an operator the source cannot express.
+    inline bool generate_parser_source(const Definition& start,
+        std::string_view source, std::string_view name_space,
+        std::string_view class_name, std::string& out) {
+        return GenerateParserSource(start, source)
+            .generate(name_space, class_name, out);
+    }
+
+    /*-----------------------------------------------------------------------------
+     *  parser
+     *---------------------------------------------------------------------------*/
+
+    class parser {
+    public:
+        parser() = default;
+
+        parser(const char* s, size_t n, const Rules& rules) {
+            load_grammar(s, n, rules);
+        }
+
+        parser(const char* s, size_t n) : parser(s, n, Rules()) {}
+
+        parser(std::string_view sv, const Rules& rules)
+            : parser(sv.data(), sv.size(), rules) {}
+
+        parser(std::string_view sv) : parser(sv.data(), sv.size(), Rules()) {}
+
+#if defined(__cpp_lib_char8_t)
+        parser(std::u8string_view sv, const Rules& rules)
+            : parser(reinterpret_cast<const char*>(sv.data()), sv.size(), rules) {}
+
+        parser(std::u8string_view sv)
+            : parser(reinterpret_cast<const char*>(sv.data()), sv.size(), Rules()) {}
+#endif
+
+        operator bool() const { return grammar_ != nullptr; }
+
+        // Loading the grammar that is already loaded, without user rules, keeps
+        // it along with its actions and settings
+        bool load_grammar(const char* s, size_t n, const Rules& rules) {
+            if (rules.empty() && grammar_ && source_ &&
+                *source_ == std::string_view(s, n)) {
+                return true;
+            }
+
+            // Operators of `precedence` instructions view the source they were
+            // generated from, so keep a copy to generate from
+            std::shared_ptr<const std::string> source;
+            if (rules.empty()) {
+                source = std::make_shared<const std::string>(s, n);
+                s = source->data();
+            }
+            grammar_ = ParserGenerator::parse(s, n, rules, start_,
+                enablePackratParsing_, log_);
+            source_ = grammar_ ? source : nullptr;
+            return grammar_ != nullptr;
+        }
+
+        bool load_grammar(const char* s, size_t n) {
+            return load_grammar(s, n, Rules());
+        }
+
+        bool load_grammar(std::string_view sv, const Rules& rules) {
+            return load_grammar(sv.data(), sv.size(), rules);
+        }
+
+        bool load_grammar(std::string_view sv) {
+            return load_grammar(sv.data(), sv.size());
+        }
+
+        bool parse_n(const char* s, size_t n, const char* path = nullptr) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result = rule.parse(s, n, path, log_);
+                return post_process(s, n, result);
+            }
+            return false;
+        }
+
+        bool parse_n(const char* s, size_t n, std::any& dt,
+            const char* path = nullptr) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result = rule.parse(s, n, dt, path, log_);
+                return post_process(s, n, result);
+            }
+            return false;
+        }
+
+        template <typename T>
+        bool parse_n(const char* s, size_t n, T& val,
+            const char* path = nullptr) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result = rule.parse_and_get_value(s, n, val, path, log_);
+                return post_process(s, n, result);
+            }
+            return false;
+        }
+
+        template <typename T>
+        bool parse_n(const char* s, size_t n, std::any& dt, T& val,
+            const char* path = nullptr) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result = rule.parse_and_get_value(s, n, dt, val, path, log_);
+                return post_process(s, n, result);
+            }
+            return false;
+        }
+
+        bool parse(std::string_view sv, const char* path = nullptr) const {
+            return parse_n(sv.data(), sv.size(), path);
+        }
+
+        bool parse(std::string_view sv, std::any& dt,
+            const char* path = nullptr) const {
             return parse_n(sv.data(), sv.size(), dt, path);
         }
 
@@ -4656,6 +8013,40 @@ namespace peg {
             return parse_n(sv.data(), sv.size(), dt, val, path);
         }
 
+        // Thread-safe entry points. They only read the parser; the logger,
+        // tracer and error mode come from `options`. Any number of threads may
+        // call them on one parser at once, provided nothing modifies it
+        // meanwhile (load_grammar, set_logger, enable_*, assigning actions)
+        // and the actions themselves are safe to run concurrently.
+        bool parse_with(std::string_view sv, std::any& dt,
+            const ParseOptions& options) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result = rule.parse(sv.data(), sv.size(), dt, options);
+                return post_process(sv.data(), sv.size(), result, options);
+            }
+            return false;
+        }
+
+        template <typename T>
+        bool parse_with(std::string_view sv, std::any& dt, T& val,
+            const ParseOptions& options) const {
+            if (grammar_ != nullptr) {
+                const auto& rule = (*grammar_)[start_];
+                auto result =
+                    rule.parse_and_get_value(sv.data(), sv.size(), dt, val, options);
+                return post_process(sv.data(), sv.size(), result, options);
+            }
+            return false;
+        }
+
+        template <typename T>
+        bool parse_with(std::string_view sv, T& val,
+            const ParseOptions& options) const {
+            std::any dt;
+            return parse_with(sv, dt, val, options);
+        }
+
 #if defined(__cpp_lib_char8_t)
         bool parse(std::u8string_view sv, const char* path = nullptr) const {
             return parse_n(reinterpret_cast<const char*>(sv.data()), sv.size(), path);
@@ -4694,11 +8085,54 @@ namespace peg {
             }
         }
 
-        void enable_packrat_parsing() {
+        // Inlining of trivial rules and the leading literal checks of ordered
+        // choices are on by default. Off, every rule is called as written.
+        void enable_grammar_optimizations(bool enable = true) {
+            if (grammar_ != nullptr) {
+                auto& rule = (*grammar_)[start_];
+                rule.grammar_optimizations = enable;
+            }
+        }
+
+        // With PackratMode::Selected only rules annotated `{ memoize }` or
+        // picked by select_packrat_rules are memoized.
+        void enable_packrat_parsing(PackratMode mode = PackratMode::All) {
             if (grammar_ != nullptr) {
                 auto& rule = (*grammar_)[start_];
                 rule.enablePackratParsing = enablePackratParsing_ && true;
+                rule.packrat_mode = mode;
+            }
+        }
+
+        // Marks for memoization every rule whose hit rate in `stats` reaches
+        // `min_hit_rate`, in addition to rules already marked. Returns how many
+        // rules are marked. Call it before sharing the parser between threads.
+        size_t select_packrat_rules(const PackratStats& stats, double min_hit_rate) {
+            size_t count = 0;
+            for (auto& [name, rule] : *grammar_) {
+                if (is_profiled(name, rule, stats)) {
+                    const auto& rule_stats = stats[rule.id];
+                    if (rule_stats.hits && rule_stats.hit_rate() >= min_hit_rate) {
+                        rule.memoize = true;
+                    }
+                }
+                if (rule.memoize) { count++; }
+            }
+            return count;
+        }
+
+        // Memo hits and misses of every rule counted in `stats`, by rule name
+        std::vector<std::pair<std::string, PackratRuleStats>>
+            packrat_report(const PackratStats& stats) const {
+            std::vector<std::pair<std::string, PackratRuleStats>> report;
+            for (const auto& [name, rule] : *grammar_) {
+                if (is_profiled(name, rule, stats)) {
+                    report.emplace_back(name, stats[rule.id]);
+                }
             }
+            std::sort(report.begin(), report.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+            return report;
         }
 
         void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
@@ -4728,6 +8162,48 @@ namespace peg {
             }
         }
 
+        // Writes the loaded grammar as an image for load_grammar_image. False if
+        // nothing is loaded, it was loaded with user rules or holds captures.
+        bool save_grammar_image(std::string& image) const {
+            return grammar_ != nullptr && source_ &&
+                peg::save_grammar_image(*grammar_, start_, enablePackratParsing_,
+                    *source_, image);
+        }
+
+        // Restores a grammar saved by save_grammar_image from `source`, without
+        // running the generator. Like load_grammar, it drops the actions of a
+        // grammar loaded before. False, leaving the parser as it was, if the
+        // image is malformed, from another version or from another source.
+        bool load_grammar_image(std::string_view source, std::string_view image) {
+            auto copy = std::make_shared<const std::string>(source);
+            std::string start;
+            bool enablePackratParsing = false;
+            auto grammar =
+                GrammarImageReader(image, *copy).read(start, enablePackratParsing);
+            if (!grammar) { return false; }
+            grammar_ = grammar;
+            start_ = start;
+            enablePackratParsing_ = enablePackratParsing;
+            source_ = copy;
+            return true;
+        }
+
+        // Lowers the grammar to a PegProgram; false if it uses operators the
+        // program does not support
+        bool compile_program(PegProgram& program) const {
+            return grammar_ != nullptr && program.compile((*grammar_)[start_]);
+        }
+
+        // Writes the loaded grammar as the source of a standalone parser, class
+        // template `class_name` in `name_space`. False if nothing is loaded, it
+        // was loaded with user rules or uses operators the source cannot express.
+        bool generate_parser_source(std::string_view name_space,
+            std::string_view class_name, std::string& out) const {
+            return grammar_ != nullptr && source_ &&
+                peg::generate_parser_source((*grammar_)[start_], *source_,
+                    name_space, class_name, out);
+        }
+
         template <typename T = Ast> parser& enable_ast() {
             for (auto& [_, rule] : *grammar_) {
                 if (!rule.action) { add_ast_action<T>(rule); }
@@ -4756,6 +8232,36 @@ namespace peg {
             return r.ret && !r.recovered;
         }
 
+        bool post_process(const char* s, size_t n, Definition::Result& r,
+            const ParseOptions& options) const {
+            if (!r.ret) {
+                if (options.log) { r.error_info.output_log(options.log, s, n); }
+                if (options.error_mode == ErrorMode::Throw) {
+                    r.error_info.last_output_pos = nullptr;
+                    r.error_info.output_log(
+                        [](size_t line, size_t col, const std::string& msg,
+                            const std::string& /*rule*/) {
+                                throw parse_error(line, col, msg);
+                        },
+                        s, n);
+                    throw parse_error(1, 1, "syntax error.");
+                }
+            }
+            else if (r.recovered && options.error_mode == ErrorMode::Throw &&
+                !r.recovered_errors.empty()) {
+                throw r.recovered_errors.front();
+            }
+            return r.ret && !r.recovered;
+        }
+
+        bool is_profiled(const std::string& name, const Definition& rule,
+            const PackratStats& stats) const {
+            // Rules not reachable from the start rule keep the default id 0
+            if (rule.id == 0 && name != start_) { return false; }
+            if (rule.id >= stats.size()) { return false; }
+            return stats[rule.id].hits + stats[rule.id].misses != 0;
+        }
+
         std::vector<std::string> get_no_ast_opt_rules() const {
             std::vector<std::string> rules;
             for (auto& [name, rule] : *grammar_) {
@@ -4764,10 +8270,402 @@ namespace peg {
             return rules;
         }
 
+        template <typename T> friend class typed_parser;
+
         std::shared_ptr<Grammar> grammar_;
         std::string start_;
         bool enablePackratParsing_ = false;
         Log log_;
+        // Source of the loaded grammar, unless it was loaded with user rules
+        std::shared_ptr<const std::string> source_;
+    };
+
+    /*-----------------------------------------------------------------------------
+     *  typed_parser
+     *---------------------------------------------------------------------------*/
+
+    // A parser whose semantic values all have type T. Values are stored unboxed
+    // in one contiguous buffer per scope instead of one std::any each, and
+    // actions receive them as TypedValues<T>:
+    //
+    //   typed_parser<int> p(grammar);
+    //   p["SUM"] = [](const SemanticValues& vs, TypedValues<int> values) {
+    //       return values[0] + values[1];
+    //   };
+    //
+    // A rule without an action yields its first value, or T{} if it has none.
+    // T must be trivially copyable and at most max_typed_value_size bytes.
+    // Grammars with a `precedence` instruction are rejected.
+    template <typename T> class typed_parser {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "typed_parser values are copied as bytes");
+        static_assert(sizeof(T) <= max_typed_value_size,
+            "typed_parser values are stored inline");
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+            "typed_parser values are stored in plain byte buffers");
+
+    public:
+        class Rule {
+        public:
+            explicit Rule(Definition& rule) : rule_(rule) {}
+
+            // F is T(const SemanticValues&, TypedValues<T>) or
+            // T(const SemanticValues&, TypedValues<T>, std::any& dt)
+            template <typename F> void operator=(F fn) {
+                rule_.typed_action = make_adaptor(fn);
+            }
+
+        private:
+            template <typename F> static TypedAction make_adaptor(F fn) {
+                if constexpr (argument_count<F>::value == 2) {
+                    return [fn](SemanticValues& vs, std::any& /*dt*/, void* value) {
+                        T result = fn(vs, vs.typed_values<T>());
+                        std::memcpy(value, &result, sizeof(T));
+                        };
+                }
+                else {
+                    return [fn](SemanticValues& vs, std::any& dt, void* value) {
+                        T result = fn(vs, vs.typed_values<T>(), dt);
+                        std::memcpy(value, &result, sizeof(T));
+                        };
+                }
+            }
+
+            Definition& rule_;
+        };
+
+        typed_parser() = default;
+
+        explicit typed_parser(std::string_view sv) { load_grammar(sv); }
+
+        operator bool() { return static_cast<bool>(parser_); }
+
+        bool load_grammar(std::string_view sv) {
+            if (!parser_.load_grammar(sv)) { return false; }
+
+            for (auto& [name, rule] : *parser_.grammar_) {
+                if (dynamic_cast<const PrecedenceClimbing*>(
+                    rule.get_core_operator().get())) {
+                    parser_.grammar_ = nullptr;
+                    return false;
+                }
+                rule.typed_action = [](SemanticValues& vs, std::any& /*dt*/,
+                    void* value) {
+                        auto values = vs.typed_values<T>();
+                        T result = values.empty() ? T{} : values[0];
+                        std::memcpy(value, &result, sizeof(T));
+                    };
+            }
+            (*parser_.grammar_)[parser_.start_].typed_size = sizeof(T);
+            return true;
+        }
+
+        Rule operator[](const char* s) { return Rule((*parser_.grammar_)[s]); }
+
+        bool parse(std::string_view sv, std::any& dt, T& val,
+            const char* path = nullptr) const {
+            ParseOptions options;
+            options.path = path;
+            options.log = parser_.log_;
+            return parse_with(sv, dt, val, options);
+        }
+
+        bool parse(std::string_view sv, T& val, const char* path = nullptr) const {
+            std::any dt;
+            return parse(sv, dt, val, path);
+        }
+
+        // Thread-safe under the same conditions as parser::parse_with
+        bool parse_with(std::string_view sv, std::any& dt, T& val,
+            const ParseOptions& options) const {
+            if (parser_.grammar_ != nullptr) {
+                const auto& rule = (*parser_.grammar_)[parser_.start_];
+                auto result = rule.parse_and_get_typed_value(sv.data(), sv.size(), dt,
+                    val, options);
+                return parser_.post_process(sv.data(), sv.size(), result, options);
+            }
+            return false;
+        }
+
+        void enable_packrat_parsing(PackratMode mode = PackratMode::All) {
+            parser_.enable_packrat_parsing(mode);
+        }
+
+        size_t select_packrat_rules(const PackratStats& stats, double min_hit_rate) {
+            return parser_.select_packrat_rules(stats, min_hit_rate);
+        }
+
+        void set_logger(Log log) { parser_.set_logger(std::move(log)); }
+
+        const Grammar& get_grammar() const { return parser_.get_grammar(); }
+
+    private:
+        parser parser_;
+    };
+
+    /*-----------------------------------------------------------------------------
+     *  ArenaAst
+     *---------------------------------------------------------------------------*/
+
+    // A compact alternative to enable_ast(). Every node of one parse lives in a
+    // single ArenaAst: nodes name their rule by an interned id instead of a
+    // string, and their children are an index range into one shared child
+    // array. Building a tree makes no per-node allocation, and clear() drops
+    // the whole tree at once while keeping the storage for the next parse.
+    using AstId = uint32_t;
+
+    struct ArenaAstNode {
+        uint32_t rule;
+        uint32_t original_rule;
+        uint32_t position;
+        uint32_t length;
+        // A token's offset and length in the input; for other nodes, the
+        // children ArenaAst::nodes() returns
+        uint32_t first;
+        uint32_t count;
+        uint16_t choice_count;
+        uint16_t choice;
+        uint16_t original_choice_count;
+        uint16_t original_choice;
+        bool is_token;
+    };
+
+    class ArenaAst {
+    public:
+        AstId root() const { return root_; }
+        size_t size() const { return nodes_.size(); }
+        bool empty() const { return nodes_.empty(); }
+
+        const ArenaAstNode& operator[](AstId id) const { return nodes_[id]; }
+
+        const char* path() const { return path_; }
+
+        std::string_view name(AstId id) const {
+            return (*names_)[nodes_[id].rule];
+        }
+
+        std::string_view original_name(AstId id) const {
+            return (*names_)[nodes_[id].original_rule];
+        }
+
+        std::string_view token(AstId id) const {
+            const auto& node = nodes_[id];
+            assert(node.is_token);
+            return std::string_view(s_ + node.first, node.count);
+        }
+
+        TypedValues<AstId> nodes(AstId id) const {
+            const auto& node = nodes_[id];
+            if (node.is_token) { return TypedValues<AstId>(nullptr, 0); }
+            return TypedValues<AstId>(children_.data() + node.first, node.count);
+        }
+
+        std::pair<size_t, size_t> line_info(AstId id) const {
+            return peg::line_info(s_, s_ + nodes_[id].position);
+        }
+
+        void clear() {
+            nodes_.clear();
+            children_.clear();
+            root_ = 0;
+        }
+
+    private:
+        friend class arena_ast_parser;
+
+        void reset(const char* s, const char* path,
+            const std::shared_ptr<const std::vector<std::string>>& names) {
+            clear();
+            s_ = s;
+            path_ = path;
+            if (names_ != names) { names_ = names; }
+        }
+
+        AstId add(const SemanticValues& vs, uint32_t rule, bool is_token,
+            TypedValues<AstId> values) {
+            ArenaAstNode node{};
+            node.rule = rule;
+            node.original_rule = rule;
+            node.position = static_cast<uint32_t>(vs.sv().data() - s_);
+            node.length = static_cast<uint32_t>(vs.sv().size());
+            node.choice_count = static_cast<uint16_t>(vs.choice_count());
+            node.choice = static_cast<uint16_t>(vs.choice());
+            node.original_choice_count = node.choice_count;
+            node.original_choice = node.choice;
+            node.is_token = is_token;
+            if (is_token) {
+                auto tok = vs.token();
+                node.first = static_cast<uint32_t>(tok.data() - s_);
+                node.count = static_cast<uint32_t>(tok.size());
+            }
+            else {
+                node.first = static_cast<uint32_t>(children_.size());
+                node.count = static_cast<uint32_t>(values.size());
+                children_.insert(children_.end(), values.begin(), values.end());
+            }
+            nodes_.push_back(node);
+            return static_cast<AstId>(nodes_.size() - 1);
+        }
+
+        // Same rewrite as AstOptimizer. The optimized nodes are appended to
+        // this arena, so the original tree stays intact until clear().
+        AstId optimize(AstId id, bool mode, const std::vector<bool>& listed) {
+            auto original = nodes_[id];
+            auto opt = mode ? !listed[original.rule] : listed[original.rule];
+
+            if (opt && !original.is_token && original.count == 1) {
+                auto node = nodes_[optimize(children_[original.first], mode, listed)];
+                node.original_rule = original.rule;
+                node.position = original.position;
+                node.length = original.length;
+                node.original_choice_count = original.choice_count;
+                node.original_choice = original.choice;
+                nodes_.push_back(node);
+                return static_cast<AstId>(nodes_.size() - 1);
+            }
+
+            if (!original.is_token) {
+                auto first = static_cast<uint32_t>(children_.size());
+                children_.resize(children_.size() + original.count);
+                for (uint32_t i = 0; i < original.count; i++) {
+                    auto child = optimize(children_[original.first + i], mode, listed);
+                    children_[first + i] = child;
+                }
+                original.first = first;
+            }
+            nodes_.push_back(original);
+            return static_cast<AstId>(nodes_.size() - 1);
+        }
+
+        const char* s_ = nullptr;
+        const char* path_ = nullptr;
+        std::shared_ptr<const std::vector<std::string>> names_;
+        std::vector<ArenaAstNode> nodes_;
+        std::vector<AstId> children_;
+        AstId root_ = 0;
+    };
+
+    inline void ast_to_s_core(const ArenaAst& ast, AstId id, std::string& s,
+        int level) {
+        const auto& node = ast[id];
+        for (auto i = 0; i < level; i++) {
+            s += "  ";
+        }
+        auto name = std::string(ast.original_name(id));
+        if (node.original_choice_count > 0) {
+            name += "/" + std::to_string(node.original_choice);
+        }
+        if (ast.name(id) != ast.original_name(id)) {
+            name += "[";
+            name += ast.name(id);
+            name += "]";
+        }
+        if (node.is_token) {
+            s += "- " + name + " (";
+            s += ast.token(id);
+            s += ")\n";
+        }
+        else {
+            s += "+ " + name + "\n";
+        }
+        for (auto child : ast.nodes(id)) {
+            ast_to_s_core(ast, child, s, level + 1);
+        }
+    }
+
+    inline std::string ast_to_s(const ArenaAst& ast) {
+        std::string s;
+        if (!ast.empty()) { ast_to_s_core(ast, ast.root(), s, 0); }
+        return s;
+    }
+
+    // Builds an ArenaAst for every rule of a grammar, like enable_ast() does
+    // with shared nodes:
+    //
+    //   arena_ast_parser p(grammar);
+    //   ArenaAst ast;
+    //   if (p.parse(input, ast)) { p.optimize_ast(ast); }
+    //
+    // The tree refers to the input text, which must outlive it. Inputs must be
+    // shorter than 4GB.
+    class arena_ast_parser {
+    public:
+        arena_ast_parser() = default;
+
+        explicit arena_ast_parser(std::string_view sv) { load_grammar(sv); }
+
+        operator bool() { return static_cast<bool>(parser_); }
+
+        bool load_grammar(std::string_view sv) {
+            if (!parser_.load_grammar(sv)) { return false; }
+
+            auto names = std::make_shared<std::vector<std::string>>();
+            no_ast_opt_.clear();
+            for (const auto& [name, rule] : parser_.get_grammar()) {
+                auto id = static_cast<uint32_t>(names->size());
+                auto is_token = rule.is_token();
+                names->push_back(name);
+                no_ast_opt_.push_back(rule.no_ast_opt);
+                parser_[name.c_str()] = [id, is_token](const SemanticValues& vs,
+                    TypedValues<AstId> values, std::any& dt) {
+                        return std::any_cast<ArenaAst*>(dt)->add(vs, id, is_token,
+                            values);
+                    };
+            }
+            names_ = std::move(names);
+            return true;
+        }
+
+        bool parse(std::string_view sv, ArenaAst& ast,
+            const char* path = nullptr) const {
+            return parse_core(sv, ast, path, [&](std::any& dt, AstId& root) {
+                return parser_.parse(sv, dt, root, path);
+                });
+        }
+
+        // Thread-safe under the same conditions as parser::parse_with, as long
+        // as each thread parses into its own ArenaAst
+        bool parse_with(std::string_view sv, ArenaAst& ast,
+            const ParseOptions& options) const {
+            return parse_core(sv, ast, options.path, [&](std::any& dt, AstId& root) {
+                return parser_.parse_with(sv, dt, root, options);
+                });
+        }
+
+        void optimize_ast(ArenaAst& ast, bool opt_mode = true) const {
+            if (!ast.empty()) {
+                ast.root_ = ast.optimize(ast.root_, opt_mode, no_ast_opt_);
+            }
+        }
+
+        void enable_packrat_parsing(PackratMode mode = PackratMode::All) {
+            parser_.enable_packrat_parsing(mode);
+        }
+
+        void set_logger(Log log) { parser_.set_logger(std::move(log)); }
+
+        const Grammar& get_grammar() const { return parser_.get_grammar(); }
+
+    private:
+        template <typename F>
+        bool parse_core(std::string_view sv, ArenaAst& ast, const char* path,
+            F parse) const {
+            ast.reset(sv.data(), path, names_);
+            if (sv.size() > std::numeric_limits<uint32_t>::max()) { return false; }
+
+            std::any dt = &ast;
+            AstId root = 0;
+            if (!parse(dt, root)) {
+                ast.clear();
+                return false;
+            }
+            ast.root_ = root;
+            return true;
+        }
+
+        typed_parser<AstId> parser_;
+        std::shared_ptr<const std::vector<std::string>> names_;
+        std::vector<bool> no_ast_opt_;
     };
 
     /*-----------------------------------------------------------------------------
@@ -0,0 +1,541 @@
+//
+//  query.h
+//
+//  Compile-once query plans for the file version DSL.
+//
+
+#pragma once
+
+#include "peglib.h"
+#include "version_store.h"
+
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace gwmb {
+
+    inline constexpr const char* query_grammar = R"(
+    EXPR          <- OR_OP
+    OR_OP         <- AND_OP ('or'i AND_OP)*
+    AND_OP        <- COMP ('and'i COMP)*
+    COMP          <- NOT_OP (COMP_OP NOT_OP)?
+    NOT_OP        <- ARITHMETIC / 'not'i COMP
+    ARITHMETIC    <- TERM (ADD_SUB_OP TERM)*
+    TERM          <- FACTOR (MUL_DIV_OP FACTOR)*
+    FACTOR        <- PRIMARY / NUMBER
+    PRIMARY       <- (EXISTS  / COMPARE_TYPE / '(' EXPR ')' ) WHITESPACE
+    ADD_SUB_OP    <- '+' / '-'
+    MUL_DIV_OP    <- '*' / '/' / '%'
+    EXISTS        <- 'exists'i '(' HASH NUMBER (',' HASH NUMBER)* ')'
+    COMP_OP       <- '==' / '!=' / '>=' / '<=' / '>' / '<'
+    COMPARE_TYPE  <- HASH NUMBER / SIZE NUMBER / FNAME0 NUMBER / FNAME1 NUMBER / FNAME NUMBER
+    ~HASH         <- 'hash'i
+    ~SIZE         <- 'size'i
+    ~FNAME        <- 'fname'i
+    ~FNAME0       <- 'fname0'i
+    ~FNAME1       <- 'fname1'i
+    NUMBER        <- HEX_NUMBER / DEC_NUMBER
+    HEX_NUMBER    <- '0x'i [a-fA-F0-9]+
+    DEC_NUMBER    <- < [0-9]+ >
+    ~WHITESPACE   <- SPACE
+    ~SPACE        <- (' ' / '\t')*
+    %whitespace   <- [ \t]*
+)";
+
+    // `query_grammar` with the `or`/`and` and arithmetic levels folded into
+    // two precedence-climbing rules. Comparisons keep their own rule: they do
+    // not chain (`a == b == c` is rejected), and `not` sits between them and
+    // `and`, so neither fits a precedence table. EXPR and ARITHMETIC actions
+    // see one binary step at a time: [lhs, operator index, rhs].
+    inline constexpr const char* query_precedence_grammar = R"(
+    EXPR          <- COMP (LOGIC_OP COMP)* {
+                       precedence
+                         L or
+                         L and
+                     }
+    COMP          <- NOT_OP (COMP_OP NOT_OP)?
+    NOT_OP        <- ARITHMETIC / 'not'i COMP
+    ARITHMETIC    <- FACTOR (ARITH_OP FACTOR)* {
+                       precedence
+                         L + -
+                         L * / %
+                     }
+    FACTOR        <- PRIMARY / NUMBER
+    PRIMARY       <- (EXISTS  / COMPARE_TYPE / '(' EXPR ')' ) WHITESPACE
+    LOGIC_OP      <- < 'or'i / 'and'i >
+    ARITH_OP      <- < '+' / '-' / '*' / '/' / '%' >
+    EXISTS        <- 'exists'i '(' HASH NUMBER (',' HASH NUMBER)* ')'
+    COMP_OP       <- '==' / '!=' / '>=' / '<=' / '>' / '<'
+    COMPARE_TYPE  <- HASH NUMBER / SIZE NUMBER / FNAME0 NUMBER / FNAME1 NUMBER / FNAME NUMBER
+    ~HASH         <- 'hash'i
+    ~SIZE         <- 'size'i
+    ~FNAME        <- 'fname'i
+    ~FNAME0       <- 'fname0'i
+    ~FNAME1       <- 'fname1'i
+    NUMBER        <- HEX_NUMBER / DEC_NUMBER
+    HEX_NUMBER    <- '0x'i [a-fA-F0-9]+
+    DEC_NUMBER    <- < [0-9]+ >
+    ~WHITESPACE   <- SPACE
+    ~SPACE        <- (' ' / '\t')*
+    %whitespace   <- [ \t]*
+)";
+
+    /*
+     * Query program
+     */
+    enum class OpCode : uint8_t {
+        Constant,
+        Hash,
+        Size,
+        Fname0,
+        Fname1,
+        Fname,
+        Exists,
+        Or,
+        And,
+        Not,
+        Equal,
+        NotEqual,
+        GreaterEqual,
+        LessEqual,
+        Greater,
+        Less,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Mod,
+    };
+
+    using NodeId = uint32_t;
+
+    // `value` holds the constant or the version slot of a field load. Children
+    // always precede their parent, so `nodes.back()` is the root.
+    struct QueryNode {
+        OpCode op;
+        int value = 0;
+        NodeId lhs = 0;
+        NodeId rhs = 0;
+    };
+
+    constexpr bool is_field_load(OpCode op) {
+        return op >= OpCode::Hash && op <= OpCode::Fname;
+    }
+
+    constexpr bool is_binary(OpCode op) {
+        return op >= OpCode::Or && op != OpCode::Not;
+    }
+
+    // Arithmetic wraps on overflow so that every backend agrees on the result.
+    inline int wrap_add(int l, int r) {
+        return static_cast<int>(static_cast<uint32_t>(l) + static_cast<uint32_t>(r));
+    }
+
+    inline int wrap_sub(int l, int r) {
+        return static_cast<int>(static_cast<uint32_t>(l) - static_cast<uint32_t>(r));
+    }
+
+    inline int wrap_mul(int l, int r) {
+        return static_cast<int>(static_cast<uint32_t>(l) * static_cast<uint32_t>(r));
+    }
+
+    // INT_MIN / -1 wraps to INT_MIN and INT_MIN % -1 is 0, as in the JIT;
+    // `r` must not be 0.
+    inline int wrap_div(int l, int r) {
+        return r == -1 ? wrap_sub(0, l) : l / r;
+    }
+
+    inline int wrap_mod(int l, int r) {
+        return r == -1 ? 0 : l % r;
+    }
+
+    // A field of a missing version evaluates to the slot number itself.
+    inline int load_field(OpCode op, const FileVersionStore& versions, int slot) {
+        if (!versions.contains(slot)) { return slot; }
+        switch (op) {
+        case OpCode::Hash: return versions.hash(slot);
+        case OpCode::Size: return versions.size(slot);
+        case OpCode::Fname0: return versions.fname0(slot);
+        case OpCode::Fname1: return versions.fname1(slot);
+        case OpCode::Fname: return versions.fname(slot);
+        default: break;
+        }
+        return 0;
+    }
+
+    inline int apply_binary(OpCode op, int l, int r) {
+        switch (op) {
+        case OpCode::Or: return static_cast<int>(l != 0 || r != 0);
+        case OpCode::And: return static_cast<int>(l != 0 && r != 0);
+        case OpCode::Equal: return static_cast<int>(l == r);
+        case OpCode::NotEqual: return static_cast<int>(l != r);
+        case OpCode::GreaterEqual: return static_cast<int>(l >= r);
+        case OpCode::LessEqual: return static_cast<int>(l <= r);
+        case OpCode::Greater: return static_cast<int>(l > r);
+        case OpCode::Less: return static_cast<int>(l < r);
+        case OpCode::Add: return wrap_add(l, r);
+        case OpCode::Sub: return wrap_sub(l, r);
+        case OpCode::Mul: return wrap_mul(l, r);
+        case OpCode::Div:
+            if (r == 0) { throw std::runtime_error("Division by zero"); }
+            return wrap_div(l, r);
+        case OpCode::Mod:
+            if (r == 0) { throw std::runtime_error("Modulo by zero"); }
+            return wrap_mod(l, r);
+        default: break;
+        }
+        return 0;
+    }
+
+    /*
+     * Query semantics
+     */
+    // What each alternative of a query_grammar rule stands for, by choice
+    // index. The precedence grammar's LOGIC_OP and ARITH_OP list their
+    // operators in one rule each.
+    inline constexpr OpCode compare_type_fields[] = { OpCode::Hash, OpCode::Size,
+        OpCode::Fname0, OpCode::Fname1, OpCode::Fname };
+    inline constexpr OpCode comp_ops[] = { OpCode::Equal, OpCode::NotEqual,
+        OpCode::GreaterEqual, OpCode::LessEqual, OpCode::Greater, OpCode::Less };
+    inline constexpr OpCode add_sub_ops[] = { OpCode::Add, OpCode::Sub };
+    inline constexpr OpCode mul_div_ops[] = { OpCode::Mul, OpCode::Div, OpCode::Mod };
+    inline constexpr OpCode logic_ops[] = { OpCode::Or, OpCode::And };
+    inline constexpr OpCode arith_ops[] = { OpCode::Add, OpCode::Sub,
+        OpCode::Mul, OpCode::Div, OpCode::Mod };
+
+    // The value of each query_grammar rule from the values of its parts, for
+    // parsers that evaluate while parsing. `Values` is any indexed sequence of
+    // int; operator rules give their choice index. QueryCompiler builds the
+    // same operations as nodes instead.
+    namespace semantics {
+
+        inline int compare_type(const FileVersionStore& versions, size_t choice, int slot) {
+            return load_field(compare_type_fields[choice], versions, slot);
+        }
+
+        template <typename Values>
+        int exists(const FileVersionStore& versions, const Values& slots) {
+            for (size_t i = 0; i < slots.size(); i++) {
+                if (!versions.contains(slots[i])) { return 0; }
+            }
+            return 1;
+        }
+
+        inline int not_op(size_t choice, int operand) {
+            return choice == 0 ? operand : static_cast<int>(operand == 0);
+        }
+
+        // OR_OP and AND_OP; a single operand passes through unchanged.
+        template <typename Values>
+        int logic(OpCode op, const Values& values) {
+            auto result = values[0];
+            if (values.size() == 1) { return result; }
+            for (size_t i = 1; i < values.size(); i++) {
+                result = apply_binary(op, result, values[i]);
+            }
+            return result;
+        }
+
+        template <typename Values>
+        int comp(const Values& values) {
+            if (values.size() == 1) { return values[0]; }
+            return apply_binary(comp_ops[values[1]], values[0], values[2]);
+        }
+
+        // ARITHMETIC and TERM: operands interleaved with operator choices.
+        template <size_t N, typename Values>
+        int chain(const OpCode (&ops)[N], const Values& values) {
+            auto result = values[0];
+            for (size_t i = 1; i + 1 < values.size(); i += 2) {
+                result = apply_binary(ops[values[i]], result, values[i + 1]);
+            }
+            return result;
+        }
+
+    } // namespace semantics
+
+    /*
+     * Compiled query
+     */
+    class CompiledQuery {
+    public:
+        CompiledQuery() = default;
+
+        bool empty() const { return nodes_.empty(); }
+
+        const std::vector<QueryNode>& nodes() const { return nodes_; }
+
+        // Only a non-empty query has a root
+        NodeId root() const {
+            assert(!empty());
+            return static_cast<NodeId>(nodes_.size() - 1);
+        }
+
+        // Whether short-circuit evaluation runs the right operand of an
+        // `and`/`or` node first
+        bool rhs_first(NodeId id) const { return rhs_first_[id]; }
+
+        // Evaluates every operand of `and`/`or`, matching the parse-time
+        // semantic actions (a division by zero anywhere in the query throws).
+        // An empty query, as left by a failed compile, evaluates to 0.
+        int evaluate(const FileVersionStore& versions) const {
+            if (empty()) { return 0; }
+            return evaluate_node(root(), versions);
+        }
+
+        // Skips the right operand of `and`/`or` once the left one decides the
+        // result, and runs the cheaper operand first when neither can fail.
+        // Differs from `evaluate` only in that skipped operands cannot throw.
+        int evaluate_short_circuit(const FileVersionStore& versions) const {
+            if (empty()) { return 0; }
+            return short_circuit_node(root(), versions);
+        }
+
+    private:
+        friend class QueryCompiler;
+
+        int short_circuit_node(NodeId id, const FileVersionStore& versions) const {
+            const auto& node = nodes_[id];
+            switch (node.op) {
+            case OpCode::Or:
+            case OpCode::And: {
+                auto first = node.lhs;
+                auto second = node.rhs;
+                if (rhs_first_[id]) { std::swap(first, second); }
+                // `or` is decided by a true operand, `and` by a false one
+                auto decisive = node.op == OpCode::Or;
+                if ((short_circuit_node(first, versions) != 0) == decisive) {
+                    return static_cast<int>(decisive);
+                }
+                return static_cast<int>(short_circuit_node(second, versions) != 0);
+            }
+            case OpCode::Not:
+                return static_cast<int>(!short_circuit_node(node.lhs, versions));
+            default:
+                if (!is_binary(node.op)) { return evaluate_node(id, versions); }
+                auto l = short_circuit_node(node.lhs, versions);
+                auto r = short_circuit_node(node.rhs, versions);
+                return apply_binary(node.op, l, r);
+            }
+        }
+
+        // Decides the operand order of every `and`/`or`. Cost is the number of
+        // nodes in a subtree; a subtree can fail if it divides by anything but
+        // a non-zero constant. Operands that can fail keep their order so that
+        // the same error surfaces as with left-to-right evaluation.
+        void plan_short_circuit() {
+            std::vector<uint32_t> cost(nodes_.size());
+            std::vector<bool> can_fail(nodes_.size());
+            rhs_first_.assign(nodes_.size(), false);
+
+            for (size_t id = 0; id < nodes_.size(); id++) {
+                const auto& node = nodes_[id];
+                if (node.op == OpCode::Not) {
+                    cost[id] = 1 + cost[node.lhs];
+                    can_fail[id] = can_fail[node.lhs];
+                }
+                else if (is_binary(node.op)) {
+                    cost[id] = 1 + cost[node.lhs] + cost[node.rhs];
+                    can_fail[id] = can_fail[node.lhs] || can_fail[node.rhs];
+                    if (node.op == OpCode::Div || node.op == OpCode::Mod) {
+                        const auto& divisor = nodes_[node.rhs];
+                        can_fail[id] = can_fail[id] ||
+                            divisor.op != OpCode::Constant || divisor.value == 0;
+                    }
+                    else if (node.op == OpCode::Or || node.op == OpCode::And) {
+                        rhs_first_[id] = !can_fail[node.lhs] && !can_fail[node.rhs] &&
+                            cost[node.rhs] < cost[node.lhs];
+                    }
+                }
+                else {
+                    cost[id] = node.op == OpCode::Constant ? 0 : 1;
+                }
+            }
+        }
+
+        int evaluate_node(NodeId id, const FileVersionStore& versions) const {
+            const auto& node = nodes_[id];
+            switch (node.op) {
+            case OpCode::Constant: return node.value;
+            case OpCode::Hash:
+            case OpCode::Size:
+            case OpCode::Fname0:
+            case OpCode::Fname1:
+            case OpCode::Fname:
+                return load_field(node.op, versions, node.value);
+            case OpCode::Exists:
+                return static_cast<int>(versions.contains(node.value));
+            case OpCode::Not:
+                return static_cast<int>(!evaluate_node(node.lhs, versions));
+            default: {
+                auto l = evaluate_node(node.lhs, versions);
+                auto r = evaluate_node(node.rhs, versions);
+                return apply_binary(node.op, l, r);
+            }
+            }
+        }
+
+        std::vector<QueryNode> nodes_;
+        std::vector<bool> rhs_first_;
+    };
+
+    /*
+     * Query compiler
+     */
+    class QueryCompiler {
+    public:
+        QueryCompiler() : parser_(query_grammar) {
+            if (!parser_) { return; }
+            parser_.enable_packrat_parsing();
+            setup_actions();
+        }
+
+        operator bool() const { return static_cast<bool>(parser_); }
+
+        void set_logger(peg::Log log) { log_ = std::move(log); }
+
+        // Parses `expr` once into `query`. Returns false on a syntax error and
+        // throws std::out_of_range for a number that does not fit in an int.
+        // The error is only located for the logger once the parse has failed.
+        bool compile(std::string_view expr, CompiledQuery& query) const {
+            std::vector<QueryNode> nodes;
+            std::any dt = &nodes;
+            NodeId root = 0;
+            peg::ParseOptions options;
+            options.log = log_;
+            options.lazy_errors = true;
+            if (!parser_.parse_with(expr, dt, root, options)) { return false; }
+
+            query = CompiledQuery();
+            std::vector<NodeId> remap(nodes.size(), static_cast<NodeId>(-1));
+            compact(nodes, root, remap, query);
+            query.plan_short_circuit();
+            return true;
+        }
+
+    private:
+        static NodeId emit(std::any& dt, QueryNode node) {
+            auto& nodes = *std::any_cast<std::vector<QueryNode>*>(dt);
+            nodes.push_back(node);
+            return static_cast<NodeId>(nodes.size() - 1);
+        }
+
+        static NodeId emit_binary(std::any& dt, OpCode op, NodeId lhs, NodeId rhs) {
+            return emit(dt, QueryNode{ op, 0, lhs, rhs });
+        }
+
+        // Nodes emitted by abandoned alternatives are dropped and the rest is
+        // renumbered in post-order.
+        static NodeId compact(const std::vector<QueryNode>& nodes, NodeId id,
+            std::vector<NodeId>& remap, CompiledQuery& query) {
+            if (remap[id] != static_cast<NodeId>(-1)) { return remap[id]; }
+
+            auto node = nodes[id];
+            if (node.op == OpCode::Not) {
+                node.lhs = compact(nodes, node.lhs, remap, query);
+            }
+            else if (is_binary(node.op)) {
+                node.lhs = compact(nodes, node.lhs, remap, query);
+                node.rhs = compact(nodes, node.rhs, remap, query);
+            }
+
+            query.nodes_.push_back(node);
+            remap[id] = static_cast<NodeId>(query.nodes_.size() - 1);
+            return remap[id];
+        }
+
+        void setup_actions() {
+            using peg::SemanticValues;
+
+            parser_["COMPARE_TYPE"] = [](const SemanticValues& sv, std::any& dt) {
+                auto num = std::any_cast<int>(sv[0]);
+                return emit(dt, QueryNode{ compare_type_fields[sv.choice()], num });
+                };
+
+            parser_["EXISTS"] = [](const SemanticValues& sv, std::any& dt) {
+                auto result = emit(dt, QueryNode{ OpCode::Exists, std::any_cast<int>(sv[0]) });
+                for (size_t i = 1; i < sv.size(); i++) {
+                    auto exists = emit(dt, QueryNode{ OpCode::Exists, std::any_cast<int>(sv[i]) });
+                    result = emit_binary(dt, OpCode::And, result, exists);
+                }
+                return result;
+                };
+
+            parser_["NOT_OP"] = [](const SemanticValues& sv, std::any& dt) {
+                auto operand = std::any_cast<NodeId>(sv[0]);
+                if (sv.choice() == 0) { return operand; }
+                return emit(dt, QueryNode{ OpCode::Not, 0, operand });
+                };
+
+            auto fold = [](OpCode op) {
+                return [op](const SemanticValues& sv, std::any& dt) {
+                    auto result = std::any_cast<NodeId>(sv[0]);
+                    for (size_t i = 1; i < sv.size(); i++) {
+                        result = emit_binary(dt, op, result, std::any_cast<NodeId>(sv[i]));
+                    }
+                    return result;
+                    };
+                };
+            parser_["OR_OP"] = fold(OpCode::Or);
+            parser_["AND_OP"] = fold(OpCode::And);
+
+            parser_["COMP"] = [](const SemanticValues& sv, std::any& dt) {
+                auto left = std::any_cast<NodeId>(sv[0]);
+                if (sv.size() == 1) { return left; }
+                auto op_choice = std::any_cast<int>(sv[1]);
+                return emit_binary(dt, comp_ops[op_choice], left, std::any_cast<NodeId>(sv[2]));
+                };
+
+            auto fold_ops = [](const OpCode* ops) {
+                return [ops](const SemanticValues& sv, std::any& dt) {
+                    auto result = std::any_cast<NodeId>(sv[0]);
+                    for (size_t i = 1; i < sv.size(); i += 2) {
+                        auto op_choice = std::any_cast<int>(sv[i]);
+                        auto rhs = std::any_cast<NodeId>(sv[i + 1]);
+                        result = emit_binary(dt, ops[op_choice], result, rhs);
+                    }
+                    return result;
+                    };
+                };
+            parser_["ARITHMETIC"] = fold_ops(add_sub_ops);
+            parser_["TERM"] = fold_ops(mul_div_ops);
+
+            parser_["FACTOR"] = [](const SemanticValues& sv, std::any& dt) {
+                if (sv.choice() == 0) { return std::any_cast<NodeId>(sv[0]); }
+                return emit(dt, QueryNode{ OpCode::Constant, std::any_cast<int>(sv[0]) });
+                };
+
+            parser_["PRIMARY"] = [](const SemanticValues& sv) {
+                return std::any_cast<NodeId>(sv[0]);
+                };
+
+            auto choice = [](const SemanticValues& sv) {
+                return static_cast<int>(sv.choice());
+                };
+            parser_["COMP_OP"] = choice;
+            parser_["ADD_SUB_OP"] = choice;
+            parser_["MUL_DIV_OP"] = choice;
+
+            parser_["NUMBER"] = [](const SemanticValues& sv) {
+                return std::any_cast<int>(sv[0]);
+                };
+
+            parser_["HEX_NUMBER"] = [](const SemanticValues& sv) {
+                return sv.token_to_integer<int>(16);
+                };
+
+            parser_["DEC_NUMBER"] = [](const SemanticValues& sv) {
+                return sv.token_to_integer<int>();
+                };
+        }
+
+        peg::parser parser_;
+        peg::Log log_;
+    };
+
+} // namespace gwmb
@@ -0,0 +1,950 @@
+//
+//  Generated by peg::generate_parser_source. Do not edit; change the
+//  grammar and generate it again.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace gwmb {
+
+    // What a rule matched, passed to the action hooks of QueryParser
+    struct QueryParserMatch {
+        std::string_view sv;
+        std::span<const std::string_view> tokens;
+        size_t choice;
+        std::string_view input;
+
+        std::string_view token(size_t id = 0) const {
+            return tokens.empty() ? sv : tokens[id];
+        }
+
+        // Line and byte column at which the match starts
+        std::pair<size_t, size_t> line_info() const {
+            size_t line = 1;
+            auto col = input.data();
+            for (auto p = input.data(); p != sv.data(); p++) {
+                if (*p == '\n') {
+                    line++;
+                    col = p + 1;
+                }
+            }
+            return { line, static_cast<size_t>(sv.data() - col) + 1 };
+        }
+    };
+
+    // Parses sentences of grammar_source. The hooks of Actions take
+    // `(const QueryParserMatch&, std::span<const T>)` and return a T.
+    // An instance keeps its stacks between calls, so give each thread its
+    // own.
+    template <typename T, typename Actions> class QueryParser {
+    public:
+        using Match = QueryParserMatch;
+
+        static constexpr std::string_view grammar_source = R"peg(
+    EXPR          <- OR_OP
+    OR_OP         <- AND_OP ('or'i AND_OP)*
+    AND_OP        <- COMP ('and'i COMP)*
+    COMP          <- NOT_OP (COMP_OP NOT_OP)?
+    NOT_OP        <- ARITHMETIC / 'not'i COMP
+    ARITHMETIC    <- TERM (ADD_SUB_OP TERM)*
+    TERM          <- FACTOR (MUL_DIV_OP FACTOR)*
+    FACTOR        <- PRIMARY / NUMBER
+    PRIMARY       <- (EXISTS  / COMPARE_TYPE / '(' EXPR ')' ) WHITESPACE
+    ADD_SUB_OP    <- '+' / '-'
+    MUL_DIV_OP    <- '*' / '/' / '%'
+    EXISTS        <- 'exists'i '(' HASH NUMBER (',' HASH NUMBER)* ')'
+    COMP_OP       <- '==' / '!=' / '>=' / '<=' / '>' / '<'
+    COMPARE_TYPE  <- HASH NUMBER / SIZE NUMBER / FNAME0 NUMBER / FNAME1 NUMBER / FNAME NUMBER
+    ~HASH         <- 'hash'i
+    ~SIZE         <- 'size'i
+    ~FNAME        <- 'fname'i
+    ~FNAME0       <- 'fname0'i
+    ~FNAME1       <- 'fname1'i
+    NUMBER        <- HEX_NUMBER / DEC_NUMBER
+    HEX_NUMBER    <- '0x'i [a-fA-F0-9]+
+    DEC_NUMBER    <- < [0-9]+ >
+    ~WHITESPACE   <- SPACE
+    ~SPACE        <- (' ' / '\t')*
+    %whitespace   <- [ \t]*
+)peg";
+
+        // Stores the value of the start rule in `value`; false if `input` is
+        // not a sentence of the grammar
+        bool parse(std::string_view input, Actions& actions, T& value) {
+            s_ = input.data();
+            n_ = input.size();
+            p_ = 0;
+            actions_ = &actions;
+            values_.clear();
+            tokens_.clear();
+            token_depth_ = 0;
+            in_whitespace_ = false;
+            if (!skip_whitespace()) { return false; }
+            if (!parse_EXPR()) { return false; }
+            if (p_ != n_) { return false; }
+            if (!values_.empty()) { value = values_.front(); }
+            return true;
+        }
+
+    private:
+        struct Mark {
+            size_t pos;
+            size_t values;
+            size_t tokens;
+        };
+
+        Mark mark() const { return { p_, values_.size(), tokens_.size() }; }
+
+        void reset(const Mark& m) {
+            p_ = m.pos;
+            discard(m);
+        }
+
+        void discard(const Mark& m) {
+            values_.erase(values_.begin() + m.values, values_.end());
+            tokens_.erase(tokens_.begin() + m.tokens, tokens_.end());
+        }
+
+        // Leaves the first value since `m`, or T{} if there is none
+        void keep_first(const Mark& m) {
+            if (values_.size() == m.values) {
+                values_.emplace_back();
+            }
+            else {
+                values_.erase(values_.begin() + m.values + 1, values_.end());
+            }
+            tokens_.erase(tokens_.begin() + m.tokens, tokens_.end());
+        }
+
+        QueryParserMatch match(const Mark& m, size_t choice) const {
+            return { std::string_view(s_ + m.pos, p_ - m.pos),
+                std::span<const std::string_view>(tokens_.data() + m.tokens,
+                    tokens_.size() - m.tokens),
+                choice, std::string_view(s_, n_) };
+        }
+
+        std::span<const T> values_since(const Mark& m) const {
+            return std::span<const T>(values_.data() + m.values,
+                values_.size() - m.values);
+        }
+
+        static bool equal_ignore_case(const char* s, const char* lower,
+            size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                auto ch = s[i];
+                if (ch >= 'A' && ch <= 'Z') { ch = static_cast<char>(ch - 'A' + 'a'); }
+                if (ch != lower[i]) { return false; }
+            }
+            return true;
+        }
+
+        // Whether byte `ch` is in the bitmap of words b0 to b3
+        static bool first_byte(char ch, uint64_t b0, uint64_t b1, uint64_t b2,
+            uint64_t b3) {
+            auto b = static_cast<unsigned char>(ch);
+            auto word = b < 128 ? (b < 64 ? b0 : b1) : (b < 192 ? b2 : b3);
+            return (word >> (b & 63)) & 1;
+        }
+
+        static size_t codepoint_length(const char* s, size_t n) {
+            if (!n) { return 0; }
+            auto b = static_cast<unsigned char>(s[0]);
+            if ((b & 0x80) == 0) { return 1; }
+            if ((b & 0xE0) == 0xC0) { return n >= 2 ? 2 : 0; }
+            if ((b & 0xF0) == 0xE0) { return n >= 3 ? 3 : 0; }
+            if ((b & 0xF8) == 0xF0) { return n >= 4 ? 4 : 0; }
+            return 0;
+        }
+
+        static size_t decode_codepoint(const char* s, size_t n, char32_t& cp) {
+            auto len = codepoint_length(s, n);
+            auto b = static_cast<unsigned char>(s[0]);
+            if (len == 1) { cp = b; }
+            else if (len == 2) { cp = b & 0x1F; }
+            else if (len == 3) { cp = b & 0x0F; }
+            else if (len == 4) { cp = b & 0x07; }
+            for (size_t i = 1; i < len; i++) {
+                cp = (cp << 6) | (static_cast<unsigned char>(s[i]) & 0x3F);
+            }
+            return len;
+        }
+
+        // [a-fA-F0-9]
+        bool match_class0() {
+            if (p_ == n_) { return false; }
+            auto ch = static_cast<unsigned char>(s_[p_]);
+            if (ch < 0x80) {
+                if (!(((ch < 64 ? 0x3ff000000000000ull : 0x7e0000007eull) >> (ch & 63)) & 1)) { return false; }
+                p_++;
+                return true;
+            }
+            return false;
+        }
+
+        // [0-9]
+        bool match_class1() {
+            if (p_ == n_) { return false; }
+            auto ch = static_cast<unsigned char>(s_[p_]);
+            if (ch < 0x80) {
+                if (!(((ch < 64 ? 0x3ff000000000000ull : 0x0ull) >> (ch & 63)) & 1)) { return false; }
+                p_++;
+                return true;
+            }
+            return false;
+        }
+
+        // [ \u{9}]
+        bool match_class2() {
+            if (p_ == n_) { return false; }
+            auto ch = static_cast<unsigned char>(s_[p_]);
+            if (ch < 0x80) {
+                if (!(((ch < 64 ? 0x100000200ull : 0x0ull) >> (ch & 63)) & 1)) { return false; }
+                p_++;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_EXPR() {
+            auto start = mark();
+            if (!parse_OR_OP()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.EXPR(m, v); }) {
+                auto value = actions_->EXPR(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_OR_OP() {
+            auto start = mark();
+            if (!parse_AND_OP()) { return false; }
+            for (;;) {
+                auto m0 = mark();
+                if (n_ - p_ < 2 || !equal_ignore_case(s_ + p_, "or", 2)) { goto L0; }
+                p_ += 2;
+                if (!token_depth_ && !skip_whitespace()) { goto L0; }
+                if (!parse_AND_OP()) { goto L0; }
+                continue;
+            L0:
+                reset(m0);
+                break;
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.OR_OP(m, v); }) {
+                auto value = actions_->OR_OP(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_AND_OP() {
+            auto start = mark();
+            if (!parse_COMP()) { return false; }
+            for (;;) {
+                auto m1 = mark();
+                if (n_ - p_ < 3 || !equal_ignore_case(s_ + p_, "and", 3)) { goto L1; }
+                p_ += 3;
+                if (!token_depth_ && !skip_whitespace()) { goto L1; }
+                if (!parse_COMP()) { goto L1; }
+                continue;
+            L1:
+                reset(m1);
+                break;
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.AND_OP(m, v); }) {
+                auto value = actions_->AND_OP(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_COMP() {
+            auto start = mark();
+            if (!parse_NOT_OP()) { return false; }
+            {
+                size_t c2 = 0;
+                for (; c2 < 1; c2++) {
+                    auto m2 = mark();
+                    if (!parse_COMP_OP()) { goto L2; }
+                    if (!parse_NOT_OP()) { goto L2; }
+                    continue;
+                L2:
+                    reset(m2);
+                    break;
+                }
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.COMP(m, v); }) {
+                auto value = actions_->COMP(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_NOT_OP() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto m3 = mark();
+                if (p_ < n_ && !first_byte(s_[p_], 0x3ff010000000000ull, 0x8016000080160ull, 0xffffffffffffffffull, 0xffffffffffffffffull)) { goto L3_1; }
+                {
+                    if (!parse_ARITHMETIC()) { goto L3_1; }
+                    choice = 0;
+                    goto L3;
+                }
+            L3_1:
+                reset(m3);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x400000004000ull, 0x0ull, 0x0ull)) { return false; }
+                if (n_ - p_ < 3 || !equal_ignore_case(s_ + p_, "not", 3)) { return false; }
+                p_ += 3;
+                if (!token_depth_ && !skip_whitespace()) { return false; }
+                if (!parse_COMP()) { return false; }
+                choice = 1;
+            }
+        L3:;
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.NOT_OP(m, v); }) {
+                auto value = actions_->NOT_OP(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_COMP_OP() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto t4 = p_;
+                token_depth_++;
+                {
+                    {
+                        if (n_ - p_ < 2 || std::memcmp(s_ + p_, "==", 2) != 0) { goto L5_1; }
+                        p_ += 2;
+                        choice = 0;
+                        goto L5;
+                    }
+                L5_1:
+                    {
+                        if (n_ - p_ < 2 || std::memcmp(s_ + p_, "!=", 2) != 0) { goto L5_2; }
+                        p_ += 2;
+                        choice = 1;
+                        goto L5;
+                    }
+                L5_2:
+                    {
+                        if (n_ - p_ < 2 || std::memcmp(s_ + p_, ">=", 2) != 0) { goto L5_3; }
+                        p_ += 2;
+                        choice = 2;
+                        goto L5;
+                    }
+                L5_3:
+                    {
+                        if (n_ - p_ < 2 || std::memcmp(s_ + p_, "<=", 2) != 0) { goto L5_4; }
+                        p_ += 2;
+                        choice = 3;
+                        goto L5;
+                    }
+                L5_4:
+                    {
+                        if (p_ == n_ || s_[p_] != '>') { goto L5_5; }
+                        p_++;
+                        choice = 4;
+                        goto L5;
+                    }
+                L5_5:
+                    if (p_ == n_ || s_[p_] != '<') { token_depth_--; return false; }
+                    p_++;
+                    choice = 5;
+                }
+            L5:;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t4, p_ - t4);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.COMP_OP(m, v); }) {
+                auto value = actions_->COMP_OP(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_ARITHMETIC() {
+            auto start = mark();
+            if (!parse_TERM()) { return false; }
+            for (;;) {
+                auto m6 = mark();
+                if (!parse_ADD_SUB_OP()) { goto L6; }
+                if (!parse_TERM()) { goto L6; }
+                continue;
+            L6:
+                reset(m6);
+                break;
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.ARITHMETIC(m, v); }) {
+                auto value = actions_->ARITHMETIC(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_TERM() {
+            auto start = mark();
+            if (!parse_FACTOR()) { return false; }
+            for (;;) {
+                auto m7 = mark();
+                if (!parse_MUL_DIV_OP()) { goto L7; }
+                if (!parse_FACTOR()) { goto L7; }
+                continue;
+            L7:
+                reset(m7);
+                break;
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.TERM(m, v); }) {
+                auto value = actions_->TERM(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_ADD_SUB_OP() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto t8 = p_;
+                token_depth_++;
+                {
+                    {
+                        if (p_ == n_ || s_[p_] != '+') { goto L9_1; }
+                        p_++;
+                        choice = 0;
+                        goto L9;
+                    }
+                L9_1:
+                    if (p_ == n_ || s_[p_] != '-') { token_depth_--; return false; }
+                    p_++;
+                    choice = 1;
+                }
+            L9:;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t8, p_ - t8);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.ADD_SUB_OP(m, v); }) {
+                auto value = actions_->ADD_SUB_OP(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_FACTOR() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto m10 = mark();
+                if (p_ < n_ && !first_byte(s_[p_], 0x10000000000ull, 0x8016000080160ull, 0x0ull, 0x0ull)) { goto L10_1; }
+                {
+                    if (!parse_PRIMARY()) { goto L10_1; }
+                    choice = 0;
+                    goto L10;
+                }
+            L10_1:
+                reset(m10);
+                if (p_ < n_ && !first_byte(s_[p_], 0x3ff000000000000ull, 0x0ull, 0xffffffffffffffffull, 0xffffffffffffffffull)) { return false; }
+                if (!parse_NUMBER()) { return false; }
+                choice = 1;
+            }
+        L10:;
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.FACTOR(m, v); }) {
+                auto value = actions_->FACTOR(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_MUL_DIV_OP() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto t11 = p_;
+                token_depth_++;
+                {
+                    {
+                        if (p_ == n_ || s_[p_] != '*') { goto L12_1; }
+                        p_++;
+                        choice = 0;
+                        goto L12;
+                    }
+                L12_1:
+                    {
+                        if (p_ == n_ || s_[p_] != '/') { goto L12_2; }
+                        p_++;
+                        choice = 1;
+                        goto L12;
+                    }
+                L12_2:
+                    if (p_ == n_ || s_[p_] != '%') { token_depth_--; return false; }
+                    p_++;
+                    choice = 2;
+                }
+            L12:;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t11, p_ - t11);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.MUL_DIV_OP(m, v); }) {
+                auto value = actions_->MUL_DIV_OP(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_PRIMARY() {
+            auto start = mark();
+            {
+                auto m13 = mark();
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x2000000020ull, 0x0ull, 0x0ull)) { goto L13_1; }
+                {
+                    if (!parse_EXISTS()) { goto L13_1; }
+                    goto L13;
+                }
+            L13_1:
+                reset(m13);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x8014000080140ull, 0x0ull, 0x0ull)) { goto L13_2; }
+                {
+                    if (!parse_COMPARE_TYPE()) { goto L13_2; }
+                    goto L13;
+                }
+            L13_2:
+                reset(m13);
+                if (p_ < n_ && !first_byte(s_[p_], 0x10000000000ull, 0x0ull, 0x0ull, 0x0ull)) { return false; }
+                if (p_ == n_ || s_[p_] != '(') { return false; }
+                p_++;
+                if (!token_depth_ && !skip_whitespace()) { return false; }
+                if (!parse_EXPR()) { return false; }
+                if (p_ == n_ || s_[p_] != ')') { return false; }
+                p_++;
+                if (!token_depth_ && !skip_whitespace()) { return false; }
+            }
+        L13:;
+            if (!parse_WHITESPACE()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.PRIMARY(m, v); }) {
+                auto value = actions_->PRIMARY(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_NUMBER() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto m14 = mark();
+                if (p_ < n_ && !first_byte(s_[p_], 0x1000000000000ull, 0x0ull, 0x0ull, 0x0ull)) { goto L14_1; }
+                {
+                    if (!parse_HEX_NUMBER()) { goto L14_1; }
+                    choice = 0;
+                    goto L14;
+                }
+            L14_1:
+                reset(m14);
+                if (p_ < n_ && !first_byte(s_[p_], 0x3ff000000000000ull, 0x0ull, 0xffffffffffffffffull, 0xffffffffffffffffull)) { return false; }
+                if (!parse_DEC_NUMBER()) { return false; }
+                choice = 1;
+            }
+        L14:;
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.NUMBER(m, v); }) {
+                auto value = actions_->NUMBER(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_EXISTS() {
+            auto start = mark();
+            if (n_ - p_ < 6 || !equal_ignore_case(s_ + p_, "exists", 6)) { return false; }
+            p_ += 6;
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if (p_ == n_ || s_[p_] != '(') { return false; }
+            p_++;
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if (!parse_HASH()) { return false; }
+            if (!parse_NUMBER()) { return false; }
+            for (;;) {
+                auto m15 = mark();
+                if (p_ == n_ || s_[p_] != ',') { goto L15; }
+                p_++;
+                if (!token_depth_ && !skip_whitespace()) { goto L15; }
+                if (!parse_HASH()) { goto L15; }
+                if (!parse_NUMBER()) { goto L15; }
+                continue;
+            L15:
+                reset(m15);
+                break;
+            }
+            if (p_ == n_ || s_[p_] != ')') { return false; }
+            p_++;
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.EXISTS(m, v); }) {
+                auto value = actions_->EXISTS(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_COMPARE_TYPE() {
+            auto start = mark();
+            size_t choice = 0;
+            {
+                auto m16 = mark();
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x10000000100ull, 0x0ull, 0x0ull)) { goto L16_1; }
+                {
+                    if (!parse_HASH()) { goto L16_1; }
+                    if (!parse_NUMBER()) { goto L16_1; }
+                    choice = 0;
+                    goto L16;
+                }
+            L16_1:
+                reset(m16);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x8000000080000ull, 0x0ull, 0x0ull)) { goto L16_2; }
+                {
+                    if (!parse_SIZE()) { goto L16_2; }
+                    if (!parse_NUMBER()) { goto L16_2; }
+                    choice = 1;
+                    goto L16;
+                }
+            L16_2:
+                reset(m16);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x4000000040ull, 0x0ull, 0x0ull)) { goto L16_3; }
+                {
+                    if (!parse_FNAME0()) { goto L16_3; }
+                    if (!parse_NUMBER()) { goto L16_3; }
+                    choice = 2;
+                    goto L16;
+                }
+            L16_3:
+                reset(m16);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x4000000040ull, 0x0ull, 0x0ull)) { goto L16_4; }
+                {
+                    if (!parse_FNAME1()) { goto L16_4; }
+                    if (!parse_NUMBER()) { goto L16_4; }
+                    choice = 3;
+                    goto L16;
+                }
+            L16_4:
+                reset(m16);
+                if (p_ < n_ && !first_byte(s_[p_], 0x0ull, 0x4000000040ull, 0x0ull, 0x0ull)) { return false; }
+                if (!parse_FNAME()) { return false; }
+                if (!parse_NUMBER()) { return false; }
+                choice = 4;
+            }
+        L16:;
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.COMPARE_TYPE(m, v); }) {
+                auto value = actions_->COMPARE_TYPE(match(start, choice), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_WHITESPACE() {
+            auto start = mark();
+            if (!parse_SPACE()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.WHITESPACE(m, v); }) {
+                actions_->WHITESPACE(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_HEX_NUMBER() {
+            auto start = mark();
+            if (n_ - p_ < 2 || !equal_ignore_case(s_ + p_, "0x", 2)) { return false; }
+            p_ += 2;
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            {
+                size_t c17 = 0;
+                for (;; c17++) {
+                    if (!match_class0()) { goto L17; }
+                    continue;
+                L17:
+                    break;
+                }
+                if (c17 < 1) { return false; }
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.HEX_NUMBER(m, v); }) {
+                auto value = actions_->HEX_NUMBER(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_DEC_NUMBER() {
+            auto start = mark();
+            {
+                auto t18 = p_;
+                token_depth_++;
+                {
+                    size_t c19 = 0;
+                    for (;; c19++) {
+                        if (!match_class1()) { goto L19; }
+                        continue;
+                    L19:
+                        break;
+                    }
+                    if (c19 < 1) { token_depth_--; return false; }
+                }
+                token_depth_--;
+                tokens_.emplace_back(s_ + t18, p_ - t18);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.DEC_NUMBER(m, v); }) {
+                auto value = actions_->DEC_NUMBER(match(start, 0), values_since(start));
+                discard(start);
+                values_.push_back(std::move(value));
+            }
+            else {
+                keep_first(start);
+            }
+            return true;
+        }
+
+        bool parse_HASH() {
+            auto start = mark();
+            {
+                auto t20 = p_;
+                token_depth_++;
+                if (n_ - p_ < 4 || !equal_ignore_case(s_ + p_, "hash", 4)) { token_depth_--; return false; }
+                p_ += 4;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t20, p_ - t20);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.HASH(m, v); }) {
+                actions_->HASH(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_SIZE() {
+            auto start = mark();
+            {
+                auto t21 = p_;
+                token_depth_++;
+                if (n_ - p_ < 4 || !equal_ignore_case(s_ + p_, "size", 4)) { token_depth_--; return false; }
+                p_ += 4;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t21, p_ - t21);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.SIZE(m, v); }) {
+                actions_->SIZE(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_FNAME0() {
+            auto start = mark();
+            {
+                auto t22 = p_;
+                token_depth_++;
+                if (n_ - p_ < 6 || !equal_ignore_case(s_ + p_, "fname0", 6)) { token_depth_--; return false; }
+                p_ += 6;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t22, p_ - t22);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.FNAME0(m, v); }) {
+                actions_->FNAME0(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_FNAME1() {
+            auto start = mark();
+            {
+                auto t23 = p_;
+                token_depth_++;
+                if (n_ - p_ < 6 || !equal_ignore_case(s_ + p_, "fname1", 6)) { token_depth_--; return false; }
+                p_ += 6;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t23, p_ - t23);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.FNAME1(m, v); }) {
+                actions_->FNAME1(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_FNAME() {
+            auto start = mark();
+            {
+                auto t24 = p_;
+                token_depth_++;
+                if (n_ - p_ < 5 || !equal_ignore_case(s_ + p_, "fname", 5)) { token_depth_--; return false; }
+                p_ += 5;
+                token_depth_--;
+                tokens_.emplace_back(s_ + t24, p_ - t24);
+            }
+            if (!token_depth_ && !skip_whitespace()) { return false; }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.FNAME(m, v); }) {
+                actions_->FNAME(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool parse_SPACE() {
+            auto start = mark();
+            for (;;) {
+                auto m25 = mark();
+                {
+                    auto m26 = mark();
+                    if (p_ < n_ && !first_byte(s_[p_], 0x100000000ull, 0x0ull, 0x0ull, 0x0ull)) { goto L26_1; }
+                    {
+                        if (p_ == n_ || s_[p_] != ' ') { goto L26_1; }
+                        p_++;
+                        if (!token_depth_ && !skip_whitespace()) { goto L26_1; }
+                        goto L26;
+                    }
+                L26_1:
+                    reset(m26);
+                    if (p_ < n_ && !first_byte(s_[p_], 0x200ull, 0x0ull, 0x0ull, 0x0ull)) { goto L25; }
+                    if (p_ == n_ || s_[p_] != '\011') { goto L25; }
+                    p_++;
+                    if (!token_depth_ && !skip_whitespace()) { goto L25; }
+                }
+            L26:;
+                continue;
+            L25:
+                reset(m25);
+                break;
+            }
+            if constexpr (requires(Actions& a, const Match& m, std::span<const T> v) { a.SPACE(m, v); }) {
+                actions_->SPACE(match(start, 0), values_since(start));
+                discard(start);
+            }
+            else {
+                discard(start);
+            }
+            return true;
+        }
+
+        bool skip_whitespace() {
+            if (in_whitespace_) { return true; }
+            in_whitespace_ = true;
+            {
+                auto m27 = mark();
+                for (;;) {
+                    if (!match_class2()) { goto L28; }
+                    continue;
+                L28:
+                    break;
+                }
+                discard(m27);
+            }
+            in_whitespace_ = false;
+            return true;
+        }
+
+        const char* s_ = nullptr;
+        size_t n_ = 0;
+        size_t p_ = 0;
+        Actions* actions_ = nullptr;
+        std::vector<T> values_;
+        std::vector<std::string_view> tokens_;
+        size_t token_depth_ = 0;
+        bool in_whitespace_ = false;
+    };
+
+} // namespace gwmb
@@ -0,0 +1,191 @@
+//
+//  rule_set.h
+//
+//  Many compiled queries merged into one node DAG and evaluated in one scan.
+//
+
+#pragma once
+
+#include "batch.h"
+#include "query.h"
+#include "version_store.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace gwmb {
+
+    /*
+     * Rule set
+     */
+
+    // Rules are added as compiled queries, so keyword spelling (`OR`, `Hash`,
+    // `exists`...) is already gone. Their nodes are hash-consed into one
+    // post-order DAG: a sub-term such as `exists(hash0)` or `size2 > size1`
+    // is computed once per block no matter how many rules contain it.
+    // Commutative operators have their operands ordered and `<`, `<=` are
+    // rewritten as `>`, `>=`, so `size1 < size2` shares with `size2 > size1`.
+    class RuleSet {
+    public:
+        // Adds a rule and returns its index in the results of `evaluate`.
+        size_t add(const CompiledQuery& query) {
+            std::vector<NodeId> shared(query.nodes().size());
+            std::vector<NodeId> failing;
+            for (size_t id = 0; id < query.nodes().size(); id++) {
+                auto node = query.nodes()[id];
+                node.lhs = shared[node.lhs];
+                node.rhs = shared[node.rhs];
+                shared[id] = intern(node);
+                if (node.op == OpCode::Div || node.op == OpCode::Mod) {
+                    failing.push_back(shared[id]);
+                }
+            }
+
+            std::sort(failing.begin(), failing.end());
+            failing.erase(std::unique(failing.begin(), failing.end()), failing.end());
+
+            roots_.push_back(query.empty() ? no_root : shared.back());
+            failing_.push_back(std::move(failing));
+            return roots_.size() - 1;
+        }
+
+        size_t size() const { return roots_.size(); }
+
+        // Distinct nodes across all rules
+        size_t node_count() const { return nodes_.size(); }
+
+        // One result per rule, in the order the rules were added.
+        std::vector<BatchResult> evaluate(const FileTable& files,
+            SimdLevel level = best_simd_level()) const {
+#if defined(GWMB_X86)
+            if (level == SimdLevel::Avx2) {
+                return evaluate_with<detail::Avx2Kernels>(files);
+            }
+#endif
+            return evaluate_with<detail::ScalarKernels>(files);
+        }
+
+    private:
+        static constexpr NodeId no_root = (std::numeric_limits<NodeId>::max)();
+
+        struct NodeKey {
+            OpCode op;
+            int value;
+            NodeId lhs;
+            NodeId rhs;
+
+            bool operator==(const NodeKey& other) const {
+                return op == other.op && value == other.value &&
+                    lhs == other.lhs && rhs == other.rhs;
+            }
+        };
+
+        struct NodeKeyHash {
+            size_t operator()(const NodeKey& key) const {
+                auto h = static_cast<uint64_t>(key.op);
+                h = h * 0x9E3779B97F4A7C15ull + static_cast<uint32_t>(key.value);
+                h = h * 0x9E3779B97F4A7C15ull + key.lhs;
+                h = h * 0x9E3779B97F4A7C15ull + key.rhs;
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+        };
+
+        static bool is_commutative(OpCode op) {
+            switch (op) {
+            case OpCode::Or:
+            case OpCode::And:
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Add:
+            case OpCode::Mul:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        static NodeKey canonical(const QueryNode& node) {
+            NodeKey key{ node.op, node.value, 0, 0 };
+            if (node.op == OpCode::Not) {
+                key.lhs = node.lhs;
+            }
+            else if (is_binary(node.op)) {
+                key.lhs = node.lhs;
+                key.rhs = node.rhs;
+                if (node.op == OpCode::Less || node.op == OpCode::LessEqual) {
+                    key.op = node.op == OpCode::Less ? OpCode::Greater : OpCode::GreaterEqual;
+                    std::swap(key.lhs, key.rhs);
+                }
+                else if (is_commutative(node.op) && key.rhs < key.lhs) {
+                    std::swap(key.lhs, key.rhs);
+                }
+            }
+            return key;
+        }
+
+        NodeId intern(const QueryNode& node) {
+            auto key = canonical(node);
+            auto it = index_.find(key);
+            if (it != index_.end()) {
+                return it->second;
+            }
+
+            auto id = static_cast<NodeId>(nodes_.size());
+            nodes_.push_back(QueryNode{ key.op, key.value, key.lhs, key.rhs });
+            index_.emplace(key, id);
+            return id;
+        }
+
+        template <typename Kernels>
+        std::vector<BatchResult> evaluate_with(const FileTable& files) const {
+            auto rows = files.padded_count();
+            std::vector<BatchResult> results(roots_.size(),
+                BatchResult{ Bitmap(rows / 64), Bitmap(rows / 64) });
+            if (nodes_.empty() || rows == 0) { return results; }
+
+            // Rules sharing a root are written when that node is computed
+            std::vector<std::vector<size_t>> rooted(nodes_.size());
+            for (size_t rule = 0; rule < roots_.size(); rule++) {
+                if (roots_[rule] != no_root) {
+                    rooted[roots_[rule]].push_back(rule);
+                }
+            }
+
+            auto plan = detail::make_plan(nodes_);
+            std::vector<int> values(plan.block_count * detail::batch_block_size);
+            std::vector<uint64_t> errors(plan.error_count * detail::batch_error_words);
+
+            for (size_t first = 0; first < rows; first += detail::batch_block_size) {
+                auto n = (std::min)(detail::batch_block_size, rows - first);
+                detail::evaluate_block<Kernels>(nodes_, plan, files, first, n,
+                    values.data(), errors.data(), [&](size_t id, const int* out) {
+                        for (auto rule : rooted[id]) {
+                            Kernels::to_bits(out, results[rule].matches.data() + first / 64, n);
+                        }
+                    });
+                for (size_t rule = 0; rule < roots_.size(); rule++) {
+                    for (auto id : failing_[rule]) {
+                        detail::merge_errors(errors.data(), plan.error_of[id],
+                            results[rule].errors.data() + first / 64, n);
+                    }
+                }
+            }
+
+            for (auto& result : results) {
+                detail::finish_bitmaps(files.file_count(), result.matches, result.errors);
+            }
+            return results;
+        }
+
+        std::vector<QueryNode> nodes_;
+        std::unordered_map<NodeKey, NodeId, NodeKeyHash> index_;
+        std::vector<NodeId> roots_;
+        // Div/Mod nodes each rule evaluates; any of them failing fails the rule
+        std::vector<std::vector<NodeId>> failing_;
+    };
+
+} // namespace gwmb
@@ -0,0 +1,403 @@
+//
+//  static_query.h
+//
+//  Queries parsed at compile time into expression templates.
+//
+
+#pragma once
+
+#include "query.h"
+#include "version_store.h"
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace gwmb {
+
+    // A string literal usable as a template argument: static_query<"size0 > 100">
+    template <size_t N>
+    struct fixed_string {
+        char text[N]{};
+
+        consteval fixed_string(const char (&s)[N]) {
+            for (size_t i = 0; i < N; i++) { text[i] = s[i]; }
+        }
+
+        constexpr std::string_view view() const { return { text, N - 1 }; }
+    };
+
+    /*
+     * Expression templates
+     */
+    namespace expr {
+
+        template <int Value>
+        struct Constant {
+            static constexpr int evaluate(const FileVersionStore&) { return Value; }
+        };
+
+        template <OpCode Op, int Slot>
+        struct Field {
+            static int evaluate(const FileVersionStore& versions) {
+                return load_field(Op, versions, Slot);
+            }
+        };
+
+        template <int Slot>
+        struct Exists {
+            static int evaluate(const FileVersionStore& versions) {
+                return static_cast<int>(versions.contains(Slot));
+            }
+        };
+
+        template <typename Operand>
+        struct Not {
+            static int evaluate(const FileVersionStore& versions) {
+                return static_cast<int>(!Operand::evaluate(versions));
+            }
+        };
+
+        // Both operands are evaluated, as by CompiledQuery::evaluate.
+        template <OpCode Op, typename Lhs, typename Rhs>
+        struct Binary {
+            static int evaluate(const FileVersionStore& versions) {
+                auto l = Lhs::evaluate(versions);
+                auto r = Rhs::evaluate(versions);
+                return apply_binary(Op, l, r);
+            }
+        };
+
+    } // namespace expr
+
+    namespace detail {
+
+        /*
+         * Compile-time parser
+         */
+
+        // A hand-written equivalent of `query_grammar`: the same ordered
+        // choices, case-insensitive keywords and `0x` hex numbers. [ \t]* is
+        // skipped where the runtime parser skips it: after literals, decimal
+        // numbers and PRIMARY, but not after the digits of a hex number
+        // (`0x 1+1` parses, `0x1 +1` does not). Errors are thrown, which during constant evaluation makes
+        // the program ill-formed.
+        class StaticParser {
+        public:
+            constexpr explicit StaticParser(std::string_view text) : text_(text) {}
+
+            // Reachable nodes in post-order, root last
+            constexpr std::vector<QueryNode> parse() {
+                skip_whitespace();
+                NodeId root = 0;
+                if (!parse_or(root) || pos_ != text_.size()) {
+                    throw "syntax error in static query";
+                }
+                std::vector<QueryNode> out;
+                std::vector<NodeId> remap(nodes_.size(), static_cast<NodeId>(-1));
+                compact(root, remap, out);
+                return out;
+            }
+
+        private:
+            constexpr void skip_whitespace() {
+                while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t')) { pos_++; }
+            }
+
+            static constexpr char lower(char c) {
+                return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+            }
+
+            // Matches `word` case-insensitively, as the grammar's 'word'i
+            constexpr bool literal(std::string_view word) {
+                if (text_.size() - pos_ < word.size()) { return false; }
+                for (size_t i = 0; i < word.size(); i++) {
+                    if (lower(text_[pos_ + i]) != word[i]) { return false; }
+                }
+                pos_ += word.size();
+                skip_whitespace();
+                return true;
+            }
+
+            static constexpr int digit_value(char c) {
+                if (c >= '0' && c <= '9') { return c - '0'; }
+                if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+                if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+                return -1;
+            }
+
+            constexpr bool digits(int base, int& value) {
+                auto start = pos_;
+                long long n = 0;
+                while (pos_ < text_.size()) {
+                    auto d = digit_value(text_[pos_]);
+                    if (d < 0 || d >= base) { break; }
+                    n = n * base + d;
+                    if (n > 0x7FFFFFFF) { throw "number out of range in static query"; }
+                    pos_++;
+                }
+                if (pos_ == start) { return false; }
+                value = static_cast<int>(n);
+                if (base == 10) { skip_whitespace(); }
+                return true;
+            }
+
+            constexpr bool number(int& value) {
+                auto save = pos_;
+                if (text_.size() - pos_ >= 2 && text_[pos_] == '0' && lower(text_[pos_ + 1]) == 'x') {
+                    pos_ += 2;
+                    auto digits_at = pos_;
+                    skip_whitespace();
+                    auto spaced = pos_ != digits_at;
+                    if (digits(16, value)) {
+                        // HEX_NUMBER reads "0x 1f" as just "0", as
+                        // std::stoi does
+                        if (spaced) { value = 0; }
+                        return true;
+                    }
+                    pos_ = save;
+                }
+                return digits(10, value);
+            }
+
+            constexpr NodeId emit(QueryNode node) {
+                nodes_.push_back(node);
+                return static_cast<NodeId>(nodes_.size() - 1);
+            }
+
+            constexpr bool parse_or(NodeId& out) {
+                if (!parse_and(out)) { return false; }
+                for (;;) {
+                    auto save = pos_;
+                    NodeId rhs = 0;
+                    if (!literal("or") || !parse_and(rhs)) {
+                        pos_ = save;
+                        return true;
+                    }
+                    out = emit(QueryNode{ OpCode::Or, 0, out, rhs });
+                }
+            }
+
+            constexpr bool parse_and(NodeId& out) {
+                if (!parse_comp(out)) { return false; }
+                for (;;) {
+                    auto save = pos_;
+                    NodeId rhs = 0;
+                    if (!literal("and") || !parse_comp(rhs)) {
+                        pos_ = save;
+                        return true;
+                    }
+                    out = emit(QueryNode{ OpCode::And, 0, out, rhs });
+                }
+            }
+
+            constexpr bool parse_comp(NodeId& out) {
+                if (!parse_not(out)) { return false; }
+                auto save = pos_;
+                OpCode op = OpCode::Equal;
+                NodeId rhs = 0;
+                if (comp_op(op) && parse_not(rhs)) {
+                    out = emit(QueryNode{ op, 0, out, rhs });
+                }
+                else {
+                    pos_ = save;
+                }
+                return true;
+            }
+
+            constexpr bool comp_op(OpCode& op) {
+                if (literal("==")) { op = OpCode::Equal; return true; }
+                if (literal("!=")) { op = OpCode::NotEqual; return true; }
+                if (literal(">=")) { op = OpCode::GreaterEqual; return true; }
+                if (literal("<=")) { op = OpCode::LessEqual; return true; }
+                if (literal(">")) { op = OpCode::Greater; return true; }
+                if (literal("<")) { op = OpCode::Less; return true; }
+                return false;
+            }
+
+            constexpr bool parse_not(NodeId& out) {
+                auto save = pos_;
+                if (parse_arithmetic(out)) { return true; }
+                pos_ = save;
+                NodeId operand = 0;
+                if (literal("not") && parse_comp(operand)) {
+                    out = emit(QueryNode{ OpCode::Not, 0, operand });
+                    return true;
+                }
+                pos_ = save;
+                return false;
+            }
+
+            constexpr bool parse_arithmetic(NodeId& out) {
+                if (!parse_term(out)) { return false; }
+                for (;;) {
+                    auto save = pos_;
+                    auto op = literal("+") ? OpCode::Add : literal("-") ? OpCode::Sub : OpCode::Constant;
+                    NodeId rhs = 0;
+                    if (op == OpCode::Constant || !parse_term(rhs)) {
+                        pos_ = save;
+                        return true;
+                    }
+                    out = emit(QueryNode{ op, 0, out, rhs });
+                }
+            }
+
+            constexpr bool parse_term(NodeId& out) {
+                if (!parse_factor(out)) { return false; }
+                for (;;) {
+                    auto save = pos_;
+                    auto op = literal("*") ? OpCode::Mul
+                        : literal("/") ? OpCode::Div
+                        : literal("%") ? OpCode::Mod
+                        : OpCode::Constant;
+                    NodeId rhs = 0;
+                    if (op == OpCode::Constant || !parse_factor(rhs)) {
+                        pos_ = save;
+                        return true;
+                    }
+                    out = emit(QueryNode{ op, 0, out, rhs });
+                }
+            }
+
+            constexpr bool parse_factor(NodeId& out) {
+                auto save = pos_;
+                if (parse_primary(out)) { return true; }
+                pos_ = save;
+                int value = 0;
+                if (number(value)) {
+                    out = emit(QueryNode{ OpCode::Constant, value });
+                    return true;
+                }
+                pos_ = save;
+                return false;
+            }
+
+            constexpr bool parse_primary(NodeId& out) {
+                auto save = pos_;
+                if (parse_exists(out) || (pos_ = save, parse_compare_type(out)) ||
+                    (pos_ = save, literal("(") && parse_or(out) && literal(")"))) {
+                    skip_whitespace();
+                    return true;
+                }
+                pos_ = save;
+                return false;
+            }
+
+            constexpr bool parse_exists(NodeId& out) {
+                int slot = 0;
+                if (!literal("exists") || !literal("(") || !literal("hash") || !number(slot)) {
+                    return false;
+                }
+                out = emit(QueryNode{ OpCode::Exists, slot });
+                for (;;) {
+                    auto save = pos_;
+                    if (!literal(",") || !literal("hash") || !number(slot)) {
+                        pos_ = save;
+                        break;
+                    }
+                    auto exists = emit(QueryNode{ OpCode::Exists, slot });
+                    out = emit(QueryNode{ OpCode::And, 0, out, exists });
+                }
+                return literal(")");
+            }
+
+            constexpr bool parse_compare_type(NodeId& out) {
+                struct Keyword { std::string_view word; OpCode op; };
+                constexpr Keyword keywords[] = { { "hash", OpCode::Hash },
+                    { "size", OpCode::Size }, { "fname0", OpCode::Fname0 },
+                    { "fname1", OpCode::Fname1 }, { "fname", OpCode::Fname } };
+
+                auto save = pos_;
+                for (const auto& keyword : keywords) {
+                    int slot = 0;
+                    if (literal(keyword.word) && number(slot)) {
+                        out = emit(QueryNode{ keyword.op, slot });
+                        return true;
+                    }
+                    pos_ = save;
+                }
+                return false;
+            }
+
+            constexpr NodeId compact(NodeId id, std::vector<NodeId>& remap,
+                std::vector<QueryNode>& out) const {
+                if (remap[id] != static_cast<NodeId>(-1)) { return remap[id]; }
+                auto node = nodes_[id];
+                if (node.op == OpCode::Not) {
+                    node.lhs = compact(node.lhs, remap, out);
+                }
+                else if (is_binary(node.op)) {
+                    node.lhs = compact(node.lhs, remap, out);
+                    node.rhs = compact(node.rhs, remap, out);
+                }
+                out.push_back(node);
+                remap[id] = static_cast<NodeId>(out.size() - 1);
+                return remap[id];
+            }
+
+            std::string_view text_;
+            size_t pos_ = 0;
+            std::vector<QueryNode> nodes_;
+        };
+
+        template <fixed_string Text>
+        consteval size_t static_node_count() {
+            return StaticParser(Text.view()).parse().size();
+        }
+
+        template <fixed_string Text>
+        consteval auto static_nodes() {
+            std::array<QueryNode, static_node_count<Text>()> nodes{};
+            auto parsed = StaticParser(Text.view()).parse();
+            for (size_t i = 0; i < parsed.size(); i++) { nodes[i] = parsed[i]; }
+            return nodes;
+        }
+
+        template <const auto& Nodes, NodeId Id>
+        constexpr auto make_expression() {
+            constexpr auto node = Nodes[Id];
+            if constexpr (node.op == OpCode::Constant) {
+                return expr::Constant<node.value>{};
+            }
+            else if constexpr (is_field_load(node.op)) {
+                return expr::Field<node.op, node.value>{};
+            }
+            else if constexpr (node.op == OpCode::Exists) {
+                return expr::Exists<node.value>{};
+            }
+            else if constexpr (node.op == OpCode::Not) {
+                return expr::Not<decltype(make_expression<Nodes, node.lhs>())>{};
+            }
+            else {
+                return expr::Binary<node.op,
+                    decltype(make_expression<Nodes, node.lhs>()),
+                    decltype(make_expression<Nodes, node.rhs>())>{};
+            }
+        }
+
+    } // namespace detail
+
+    /*
+     * Static query
+     */
+
+    // A query fixed at build time. The text is parsed during compilation (a
+    // syntax error does not compile) and `expression` is a type such as
+    // expr::Binary<OpCode::Greater, expr::Field<OpCode::Size, 0>,
+    // expr::Constant<100>>, so evaluation inlines to straight-line code.
+    template <fixed_string Text>
+    struct StaticQuery {
+        static constexpr auto nodes = detail::static_nodes<Text>();
+
+        using expression = decltype(detail::make_expression<nodes, nodes.size() - 1>());
+
+        static int evaluate(const FileVersionStore& versions) {
+            return expression::evaluate(versions);
+        }
+    };
+
+    template <fixed_string Text>
+    inline constexpr StaticQuery<Text> static_query{};
+
+} // namespace gwmb
@@ -0,0 +1,214 @@
+//
+//  version_store.h
+//
+//  Columnar storage of the file versions a query is evaluated against.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+namespace gwmb {
+
+    struct FileVersion {
+        int hash;
+        int size;
+        int fname0;
+        int fname1;
+    };
+
+    inline int fname_of(int fname0, int fname1) {
+        return ((fname0 & 0xFFFF) << 16) | (fname1 & 0xFFFF);
+    }
+
+    /*
+     * File version store
+     */
+
+    // Versions are addressed directly by their slot number (the `N` in
+    // `hashN`), one column per field plus a presence bitmap, so fetching an
+    // operand is a bounds check and an array load. Slots are expected to be
+    // small and dense.
+    class FileVersionStore {
+    public:
+        FileVersionStore() = default;
+
+        FileVersionStore(std::initializer_list<std::pair<int, FileVersion>> versions) {
+            for (const auto& [slot, version] : versions) {
+                set(slot, version);
+            }
+        }
+
+        void set(int slot, const FileVersion& version) {
+            auto i = static_cast<size_t>(slot);
+            if (i >= hash_.size()) {
+                hash_.resize(i + 1);
+                size_.resize(i + 1);
+                fname0_.resize(i + 1);
+                fname1_.resize(i + 1);
+                present_.resize(i / 64 + 1);
+            }
+            hash_[i] = version.hash;
+            size_[i] = version.size;
+            fname0_[i] = version.fname0;
+            fname1_[i] = version.fname1;
+            present_[i / 64] |= uint64_t(1) << (i % 64);
+        }
+
+        void erase(int slot) {
+            if (contains(slot)) {
+                auto i = static_cast<size_t>(slot);
+                present_[i / 64] &= ~(uint64_t(1) << (i % 64));
+            }
+        }
+
+        void clear() {
+            hash_.clear();
+            size_.clear();
+            fname0_.clear();
+            fname1_.clear();
+            present_.clear();
+        }
+
+        // Number of addressable slots (one past the highest slot ever set)
+        size_t slot_count() const { return hash_.size(); }
+
+        bool contains(int slot) const {
+            auto i = static_cast<size_t>(static_cast<unsigned int>(slot));
+            return i < hash_.size() && ((present_[i / 64] >> (i % 64)) & 1);
+        }
+
+        // Presence bits of slots [64 * word, 64 * word + 64)
+        uint64_t presence(size_t word) const {
+            return word < present_.size() ? present_[word] : 0;
+        }
+
+        // Field accessors do not check presence; callers test `contains` first.
+        int hash(int slot) const { return hash_[static_cast<size_t>(slot)]; }
+        int size(int slot) const { return size_[static_cast<size_t>(slot)]; }
+        int fname0(int slot) const { return fname0_[static_cast<size_t>(slot)]; }
+        int fname1(int slot) const { return fname1_[static_cast<size_t>(slot)]; }
+        int fname(int slot) const { return fname_of(fname0(slot), fname1(slot)); }
+
+        FileVersion get(int slot) const {
+            return FileVersion{ hash(slot), size(slot), fname0(slot), fname1(slot) };
+        }
+
+        // Raw columns, `slot_count()` entries each, for generated code
+        const int* hash_data() const { return hash_.data(); }
+        const int* size_data() const { return size_.data(); }
+        const int* fname0_data() const { return fname0_.data(); }
+        const int* fname1_data() const { return fname1_.data(); }
+        const uint64_t* presence_data() const { return present_.data(); }
+
+    private:
+        std::vector<int> hash_;
+        std::vector<int> size_;
+        std::vector<int> fname0_;
+        std::vector<int> fname1_;
+        std::vector<uint64_t> present_;
+    };
+
+    /*
+     * File table
+     */
+
+    // The versions of many files at once: one set of columns per slot, each
+    // column holding one row per file. Columns are padded to a multiple of 64
+    // rows so that batch kernels can work on whole bitmap words.
+    class FileTable {
+    public:
+        struct Columns {
+            std::vector<int> hash;
+            std::vector<int> size;
+            std::vector<int> fname0;
+            std::vector<int> fname1;
+            std::vector<uint64_t> present;
+        };
+
+        FileTable() = default;
+
+        explicit FileTable(size_t file_count) { resize(file_count); }
+
+        size_t file_count() const { return file_count_; }
+
+        size_t padded_count() const { return (file_count_ + 63) / 64 * 64; }
+
+        size_t slot_count() const { return slots_.size(); }
+
+        void resize(size_t file_count) {
+            file_count_ = file_count;
+            for (auto& columns : slots_) {
+                resize_columns(columns);
+            }
+        }
+
+        void set(size_t file, int slot, const FileVersion& version) {
+            auto i = static_cast<size_t>(slot);
+            if (i >= slots_.size()) {
+                slots_.resize(i + 1);
+                for (auto& columns : slots_) {
+                    resize_columns(columns);
+                }
+            }
+            auto& columns = slots_[i];
+            columns.hash[file] = version.hash;
+            columns.size[file] = version.size;
+            columns.fname0[file] = version.fname0;
+            columns.fname1[file] = version.fname1;
+            columns.present[file / 64] |= uint64_t(1) << (file % 64);
+        }
+
+        void erase(size_t file, int slot) {
+            if (contains(file, slot)) {
+                auto& columns = slots_[static_cast<size_t>(slot)];
+                columns.present[file / 64] &= ~(uint64_t(1) << (file % 64));
+            }
+        }
+
+        bool contains(size_t file, int slot) const {
+            auto columns = find(slot);
+            return columns && ((columns->present[file / 64] >> (file % 64)) & 1);
+        }
+
+        // Columns of `slot`, or nullptr when no file has that slot.
+        const Columns* find(int slot) const {
+            auto i = static_cast<size_t>(static_cast<unsigned int>(slot));
+            return i < slots_.size() ? &slots_[i] : nullptr;
+        }
+
+        FileVersionStore versions_of(size_t file) const {
+            FileVersionStore versions;
+            for (size_t i = 0; i < slots_.size(); i++) {
+                const auto& columns = slots_[i];
+                if ((columns.present[file / 64] >> (file % 64)) & 1) {
+                    versions.set(static_cast<int>(i),
+                        FileVersion{ columns.hash[file], columns.size[file],
+                        columns.fname0[file], columns.fname1[file] });
+                }
+            }
+            return versions;
+        }
+
+    private:
+        void resize_columns(Columns& columns) const {
+            auto rows = padded_count();
+            columns.hash.resize(rows);
+            columns.size.resize(rows);
+            columns.fname0.resize(rows);
+            columns.fname1.resize(rows);
+            columns.present.resize(rows / 64);
+            if (file_count_ % 64) {
+                columns.present.back() &= (uint64_t(1) << (file_count_ % 64)) - 1;
+            }
+        }
+
+        size_t file_count_ = 0;
+        std::vector<Columns> slots_;
+    };
+
+} // namespace gwmb